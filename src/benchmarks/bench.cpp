@@ -0,0 +1,742 @@
+// Microbenchmarks for the coroutine primitives.
+//
+// Run with `--benchmark_format=json` (or `make bench`, which writes
+// bench.json in the build directory) to get machine-readable results that
+// can be compared across commits.
+//
+// Build with optimisation (the Makefile's default is RelWithDebInfo).
+// Besides giving meaningless numbers, unoptimised GCC builds don't turn
+// symmetric transfer into a tail call, so the long await loops here can
+// run out of stack.
+//
+// Benchmarks that run entirely on the calling thread also report
+// `allocs/iter`, the number of calls to global operator new per iteration,
+// counted by the replacement operator new below.
+
+#include <coroexample/coroexample.h>
+
+#include <benchmark/benchmark.h>
+
+#include <barrier>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace {
+thread_local std::size_t heap_allocations = 0;
+}
+
+// noinline keeps GCC from pairing the inlined malloc() with the free() in
+// the replacement operator delete and warning about a mismatch.
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    ++heap_allocations;
+    if (void* p = std::malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+struct allocation_counter {
+    benchmark::State& state;
+    std::size_t       start = heap_allocations;
+
+    ~allocation_counter() {
+        state.counters["allocs/iter"] =
+            benchmark::Counter(static_cast<double>(heap_allocations - start),
+                               benchmark::Counter::kAvgIterations);
+    }
+};
+
+template <typename Task>
+struct leaves;
+
+template <typename T>
+struct leaves<task<T>> {
+    static task<int> leaf(int i) { co_return i; }
+    static task<void> leaf_void() { co_return; }
+    static task<int> chain(int depth) {
+        if (depth == 0) {
+            co_return 0;
+        }
+        co_return co_await chain(depth - 1) + 1;
+    }
+};
+
+template <typename T>
+struct leaves<inline_task<T>> {
+    static inline_task<int> leaf(int i) { co_return i; }
+    static inline_task<int> chain(int depth) {
+        if (depth == 0) {
+            co_return 0;
+        }
+        co_return co_await chain(depth - 1) + 1;
+    }
+};
+
+template <typename Task>
+task<void> await_loop(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(co_await leaves<Task>::leaf(1));
+    }
+}
+
+template <typename Task>
+task<void> chain_loop(benchmark::State& state) {
+    int depth = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(co_await leaves<Task>::chain(depth));
+    }
+    state.SetItemsProcessed(state.iterations() * depth);
+}
+
+template <typename Scheduler>
+task<void> schedule_on(Scheduler& sched) {
+    co_await sched.schedule();
+}
+
+constexpr int throughput_tasks = 1024;
+
+// Spawns 'throughput_tasks' tasks per iteration that each hop onto 'sched',
+// with state.range(0) threads calling run(sched, st).
+template <typename Scheduler, typename Run>
+void scheduler_throughput(benchmark::State& state, Scheduler& sched, Run run) {
+    int threads = static_cast<int>(state.range(0));
+    {
+        std::vector<std::jthread> workers;
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([&](std::stop_token st) { run(sched, st); });
+        }
+
+        for (auto _ : state) {
+            async_scope scope;
+            for (int i = 0; i < throughput_tasks; ++i) {
+                scope.spawn_detached(schedule_on(sched));
+            }
+            sync_wait(scope.join_async());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * throughput_tasks);
+}
+
+template <typename Scheduler>
+void scheduler_throughput(benchmark::State& state, Scheduler& sched) {
+    scheduler_throughput(
+        state, sched, [](Scheduler& s, std::stop_token st) { s.run(st); });
+}
+
+// Futex activity per task, to check that notifications are skipped when
+// workers are already awake.
+void report_loop_stats(benchmark::State& state, manual_event_loop& loop) {
+    manual_event_loop::loop_stats stats = loop.stats();
+    double tasks = static_cast<double>(state.iterations() * throughput_tasks);
+    state.counters["wakeups/task"] =
+        static_cast<double>(stats.wakeups) / tasks;
+    state.counters["sleeps/task"] = static_cast<double>(stats.sleeps) / tasks;
+    if (stats.batches > 0) {
+        state.counters["batch_size"] = static_cast<double>(stats.batch_items) /
+                                       static_cast<double>(stats.batches);
+    }
+}
+} // namespace
+
+// task<T> create / await / destroy of a synchronously completing child.
+static void BM_task_await(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(await_loop<task<int>>(state));
+}
+BENCHMARK(BM_task_await);
+
+static void BM_inline_task_await(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(await_loop<inline_task<int>>(state));
+}
+BENCHMARK(BM_inline_task_await);
+
+// Cost of a chain of nested awaits as the depth grows.
+static void BM_task_chain(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(chain_loop<task<int>>(state));
+}
+BENCHMARK(BM_task_chain)->RangeMultiplier(4)->Range(1, 256);
+
+static void BM_inline_task_chain(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(chain_loop<inline_task<int>>(state));
+}
+BENCHMARK(BM_inline_task_chain)->RangeMultiplier(4)->Range(1, 256);
+
+// Round trip through sync_wait for an already-complete operation.
+static void BM_sync_wait(benchmark::State& state) {
+    allocation_counter allocs{state};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sync_wait(leaves<task<int>>::leaf(1)));
+    }
+}
+BENCHMARK(BM_sync_wait);
+
+// spawn_detached N synchronously completing tasks then join_async().
+static void BM_scope_spawn_join(benchmark::State& state) {
+    allocation_counter allocs{state};
+    for (auto _ : state) {
+        async_scope scope;
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            scope.spawn_detached(leaves<task<void>>::leaf_void());
+        }
+        sync_wait(scope.join_async());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_scope_spawn_join)->RangeMultiplier(8)->Range(1, 4096);
+
+// As BM_scope_spawn_join, through a nursery, which adds its accounting
+// (two clock reads and a few relaxed RMWs) to each spawn.
+static void BM_nursery_spawn_join(benchmark::State& state) {
+    allocation_counter allocs{state};
+    for (auto _ : state) {
+        nursery children;
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            children.spawn_detached(leaves<task<void>>::leaf_void());
+        }
+        sync_wait(children.join_async());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_nursery_spawn_join)->RangeMultiplier(8)->Range(1, 4096);
+
+// As above, but via lazy_task so the task frame can be merged into the
+// detached_task frame; compare allocs/iter with BM_scope_spawn_join.
+static void BM_scope_spawn_join_lazy(benchmark::State& state) {
+    allocation_counter allocs{state};
+    for (auto _ : state) {
+        async_scope scope;
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            scope.spawn_detached(
+                lazy_task{[] { return leaves<task<void>>::leaf_void(); }});
+        }
+        sync_wait(scope.join_async());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_scope_spawn_join_lazy)->RangeMultiplier(8)->Range(1, 4096);
+
+namespace {
+task<void> spawn_bounded_loop(benchmark::State& state) {
+    for (auto _ : state) {
+        async_scope scope{async_scope::concurrency_limit{64}};
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            co_await scope.spawn(leaves<task<void>>::leaf_void());
+        }
+        co_await scope.join_async();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+} // namespace
+
+// As BM_scope_spawn_join, through the bounded spawn() of a scope with a
+// concurrency limit: the extra cost is claiming and returning a slot.
+static void BM_scope_spawn_bounded(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(spawn_bounded_loop(state));
+}
+BENCHMARK(BM_scope_spawn_bounded)->RangeMultiplier(8)->Range(1, 4096);
+
+namespace {
+// spawn_future N synchronously completing tasks, then await every future
+// and join. Unlike BM_scope_spawn_join there is no sync_wait() per
+// iteration.
+task<void> spawn_future_loop(benchmark::State& state) {
+    using leaf = leaves<task<int>>;
+    std::vector<async_scope::future<int>> futures;
+    futures.reserve(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        async_scope scope;
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            futures.push_back(scope.spawn_future(leaf::leaf(1)));
+        }
+        for (auto& f : futures) {
+            benchmark::DoNotOptimize(co_await std::move(f));
+        }
+        futures.clear();
+        co_await scope.join_async();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+} // namespace
+
+static void BM_scope_spawn_future(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(spawn_future_loop(state));
+}
+BENCHMARK(BM_scope_spawn_future)->RangeMultiplier(8)->Range(1, 4096);
+
+// The same fan-out through when_all(range), which also collects the
+// results; compare with BM_scope_spawn_join.
+static void BM_when_all_range(benchmark::State& state) {
+    allocation_counter allocs{state};
+    for (auto _ : state) {
+        std::vector<task<int>> tasks;
+        tasks.reserve(static_cast<std::size_t>(state.range(0)));
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            tasks.push_back(leaves<task<int>>::leaf(1));
+        }
+        benchmark::DoNotOptimize(sync_wait(when_all(std::move(tasks))));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_when_all_range)->RangeMultiplier(8)->Range(1, 4096);
+
+// Variadic form: the children live in a tuple inside the awaiter.
+static void BM_when_all_variadic(benchmark::State& state) {
+    allocation_counter allocs{state};
+    using leaf = leaves<task<int>>;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sync_wait(
+            when_all(leaf::leaf(1), leaf::leaf(2), leaf::leaf(3))));
+    }
+    state.SetItemsProcessed(state.iterations() * 3);
+}
+BENCHMARK(BM_when_all_variadic);
+
+namespace {
+generator<int> iota(int n) {
+    for (int i = 0; i < n; ++i) {
+        co_yield i;
+    }
+}
+
+async_generator<int> async_iota(int n) {
+    for (int i = 0; i < n; ++i) {
+        co_yield i;
+    }
+}
+
+task<void> consume_async_iota(benchmark::State& state) {
+    int n = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        auto gen = async_iota(n);
+        for (auto it = co_await gen.begin(); it != gen.end(); co_await ++it) {
+            benchmark::DoNotOptimize(*it);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+} // namespace
+
+// Streaming N elements out of a generator; the per-element cost is one
+// resume/suspend pair and the frame comes from the frame pool.
+static void BM_generator_iterate(benchmark::State& state) {
+    allocation_counter allocs{state};
+    int                n = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        for (int i : iota(n)) {
+            benchmark::DoNotOptimize(i);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_generator_iterate)->RangeMultiplier(8)->Range(1, 4096);
+
+// As above, consumed from a coroutine by symmetric transfer.
+static void BM_async_generator_iterate(benchmark::State& state) {
+    allocation_counter allocs{state};
+    sync_wait(consume_async_iota(state));
+}
+BENCHMARK(BM_async_generator_iterate)->RangeMultiplier(8)->Range(1, 4096);
+
+namespace {
+using bench_channel = channel<int, 64>;
+
+constexpr int channel_items = 4096;
+
+task<void> channel_producer(bench_channel& ch, std::size_t batch) {
+    std::vector<int> values(batch);
+    for (int sent = 0; sent < channel_items;) {
+        if (batch == 1) {
+            co_await ch.send(sent++);
+            continue;
+        }
+        for (int& v : values) {
+            v = sent++;
+        }
+        co_await ch.send_n(values);
+    }
+    ch.close();
+}
+
+task<void> channel_consumer(bench_channel& ch, std::size_t batch) {
+    std::vector<int> values(batch);
+    if (batch == 1) {
+        while (std::optional<int> v = co_await ch.receive()) {
+            benchmark::DoNotOptimize(*v);
+        }
+    } else {
+        while (std::size_t n = co_await ch.receive_n(values)) {
+            benchmark::DoNotOptimize(values.data());
+            benchmark::DoNotOptimize(n);
+        }
+    }
+}
+} // namespace
+
+// A producer and a consumer on one thread, handing 'channel_items'
+// elements through a channel one at a time (Arg 1) or in batches.
+static void BM_channel_throughput(benchmark::State& state) {
+    auto batch = static_cast<std::size_t>(state.range(0));
+    for (auto _ : state) {
+        bench_channel ch;
+        sync_wait(when_all(channel_producer(ch, batch),
+                           channel_consumer(ch, batch)));
+    }
+    state.SetItemsProcessed(state.iterations() * channel_items);
+}
+BENCHMARK(BM_channel_throughput)->Arg(1)->Arg(16)->Arg(64);
+
+namespace {
+task<void> mutex_loop(benchmark::State& state, async_mutex& mutex) {
+    for (auto _ : state) {
+        async_mutex_lock lock = co_await mutex.scoped_lock_async();
+        benchmark::DoNotOptimize(lock);
+    }
+}
+
+task<void> semaphore_loop(benchmark::State& state, async_semaphore& sem) {
+    for (auto _ : state) {
+        co_await sem.acquire();
+        sem.release();
+    }
+}
+} // namespace
+
+// Uncontended lock/unlock and acquire/release: the fast paths are a
+// single atomic operation each way.
+static void BM_async_mutex_uncontended(benchmark::State& state) {
+    async_mutex mutex;
+    sync_wait(mutex_loop(state, mutex));
+}
+BENCHMARK(BM_async_mutex_uncontended);
+
+static void BM_async_semaphore_uncontended(benchmark::State& state) {
+    async_semaphore sem{1};
+    sync_wait(semaphore_loop(state, sem));
+}
+BENCHMARK(BM_async_semaphore_uncontended);
+
+// Latency of a hop from this thread onto a loop worker and back.
+static void BM_event_loop_schedule_latency(benchmark::State& state) {
+    manual_event_loop loop;
+    std::jthread      worker{[&](std::stop_token st) { loop.run(st); }};
+    for (auto _ : state) {
+        sync_wait(schedule_on(loop));
+    }
+}
+BENCHMARK(BM_event_loop_schedule_latency)->UseRealTime();
+
+// The same hop, with the calling thread running the loop itself inside
+// sync_wait(loop, ...) instead of parking while a worker does.
+static void BM_sync_wait_driving_loop(benchmark::State& state) {
+    allocation_counter allocs{state};
+    manual_event_loop  loop;
+    for (auto _ : state) {
+        sync_wait(loop, schedule_on(loop));
+    }
+}
+BENCHMARK(BM_sync_wait_driving_loop);
+
+namespace {
+task<int> completes_inline(int i) { co_return i; }
+
+// Hops back onto 'loop' after each await, as a plain task has to in order
+// to be sure of where it carries on.
+task<void> rescheduling_awaits(benchmark::State&  state,
+                               manual_event_loop& loop) {
+    co_await loop.schedule();
+    for (auto _ : state) {
+        int x = co_await completes_inline(1);
+        benchmark::DoNotOptimize(x);
+        co_await loop.schedule();
+    }
+}
+
+affine_task<void> affine_awaits(benchmark::State&  state,
+                                manual_event_loop& loop) {
+    co_await loop.schedule();
+    for (auto _ : state) {
+        int x = co_await completes_inline(1);
+        benchmark::DoNotOptimize(x);
+    }
+}
+} // namespace
+
+// An await that completes on the loop the task is running on, followed by
+// a blanket `co_await loop.schedule()`...
+static void BM_await_then_reschedule(benchmark::State& state) {
+    allocation_counter allocs{state};
+    manual_event_loop  loop;
+    sync_wait(loop, rescheduling_awaits(state, loop));
+}
+BENCHMARK(BM_await_then_reschedule);
+
+// ...versus an affine_task, which sees that it is still on the loop and
+// skips the hop.
+static void BM_affine_task_await(benchmark::State& state) {
+    allocation_counter allocs{state};
+    manual_event_loop  loop;
+    sync_wait(loop, affine_awaits(state, loop));
+}
+BENCHMARK(BM_affine_task_await);
+
+// Throughput of schedule() as the number of run() threads grows.
+static void BM_event_loop_schedule_throughput(benchmark::State& state) {
+    manual_event_loop loop;
+    scheduler_throughput(state, loop);
+    report_loop_stats(state, loop);
+}
+BENCHMARK(BM_event_loop_schedule_throughput)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime();
+
+// As above, with workers in run_batched() mode.
+static void
+BM_event_loop_batched_schedule_throughput(benchmark::State& state) {
+    manual_event_loop loop;
+    scheduler_throughput(
+        state, loop, [](manual_event_loop& l, std::stop_token st) {
+            l.run_batched(st);
+        });
+    report_loop_stats(state, loop);
+}
+BENCHMARK(BM_event_loop_batched_schedule_throughput)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime();
+
+namespace {
+using priority = manual_event_loop::priority;
+
+task<void> background(manual_event_loop& loop, std::atomic<int>& done) {
+    co_await loop.schedule(priority::low);
+    done.fetch_add(1, std::memory_order_relaxed);
+}
+
+task<void> probe(manual_event_loop& loop,
+                 priority           p,
+                 std::atomic<int>&  done,
+                 int&               ran_before) {
+    co_await loop.schedule(p);
+    ran_before = done.load(std::memory_order_relaxed);
+}
+} // namespace
+
+// How many of 'throughput_tasks' background continuations scheduled just
+// before it run ahead of one more continuation, scheduled on the lane
+// given by state.range(0) (0 = high, 2 = low, i.e. plain FIFO).
+static void BM_event_loop_priority_lanes(benchmark::State& state) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+    auto              lane = static_cast<priority>(state.range(0));
+
+    double ran_before_total = 0;
+    for (auto _ : state) {
+        std::atomic<int> done{0};
+        int              ran_before = 0;
+        async_scope      scope;
+        for (int i = 0; i < throughput_tasks; ++i) {
+            scope.spawn_detached(background(loop, done));
+        }
+        scope.spawn_detached(probe(loop, lane, done, ran_before));
+        sync_wait(scope.join_async());
+        ran_before_total += ran_before;
+    }
+    state.counters["ran_before_probe"] = benchmark::Counter(
+        ran_before_total, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_event_loop_priority_lanes)->Arg(0)->Arg(2)->UseRealTime();
+
+static void BM_work_stealing_schedule_throughput(benchmark::State& state) {
+    work_stealing_scheduler sched{static_cast<std::size_t>(state.range(0))};
+    scheduler_throughput(state, sched);
+}
+BENCHMARK(BM_work_stealing_schedule_throughput)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime();
+
+// As above, but the pool owns its workers. Arg is the thread count.
+static void BM_thread_pool_schedule_throughput(benchmark::State& state) {
+    static_thread_pool pool{static_cast<std::size_t>(state.range(0))};
+    for (auto _ : state) {
+        async_scope scope;
+        for (int i = 0; i < throughput_tasks; ++i) {
+            scope.spawn_detached(schedule_on(pool));
+        }
+        sync_wait(scope.join_async());
+    }
+    state.SetItemsProcessed(state.iterations() * throughput_tasks);
+}
+BENCHMARK(BM_thread_pool_schedule_throughput)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime();
+
+namespace {
+// state.range(0) producer threads each spawn their share of
+// 'throughput_tasks' tasks that hop onto 'loop', which has one consumer.
+template <typename Loop>
+void producers_to_one_consumer(benchmark::State& state, Loop& loop) {
+    int          producers = static_cast<int>(state.range(0));
+    int          share     = throughput_tasks / producers;
+    async_scope* scope     = nullptr;
+    std::barrier sync{producers + 1};
+
+    std::jthread consumer{[&](std::stop_token st) { loop.run(st); }};
+    std::vector<std::jthread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&](std::stop_token st) {
+            while (true) {
+                sync.arrive_and_wait(); // start of an iteration
+                if (st.stop_requested()) {
+                    return;
+                }
+                for (int i = 0; i < share; ++i) {
+                    scope->spawn_detached(schedule_on(loop));
+                }
+                sync.arrive_and_wait(); // everything spawned
+            }
+        });
+    }
+
+    for (auto _ : state) {
+        async_scope s;
+        scope = &s;
+        sync.arrive_and_wait();
+        sync.arrive_and_wait();
+        sync_wait(s.join_async());
+    }
+
+    for (std::jthread& t : threads) {
+        t.request_stop();
+    }
+    sync.arrive_and_wait();
+    state.SetItemsProcessed(state.iterations() * share * producers);
+}
+} // namespace
+
+// N producer threads -> one run() thread, with the mutex-based loop and
+// the lock-free single-consumer loop.
+static void BM_event_loop_many_to_one(benchmark::State& state) {
+    manual_event_loop loop;
+    producers_to_one_consumer(state, loop);
+}
+BENCHMARK(BM_event_loop_many_to_one)
+    ->RangeMultiplier(2)
+    ->Range(1, 8)
+    ->UseRealTime();
+
+static void BM_single_consumer_loop_many_to_one(benchmark::State& state) {
+    single_consumer_event_loop loop;
+    producers_to_one_consumer(state, loop);
+}
+BENCHMARK(BM_single_consumer_loop_many_to_one)
+    ->RangeMultiplier(2)
+    ->Range(1, 8)
+    ->UseRealTime();
+
+namespace {
+// state.range(0) threads each spawn their share of 16384 synchronously
+// completing tasks into one shared Scope, so each spawn is just the
+// reference count's increment and decrement, all threads at once.
+template <typename Scope>
+void concurrent_spawn(benchmark::State& state) {
+    constexpr int spawned = 16384;
+    int           threads = static_cast<int>(state.range(0));
+    int           share   = spawned / threads;
+    Scope*        scope   = nullptr;
+    std::barrier  sync{threads + 1};
+
+    std::vector<std::jthread> spawners;
+    for (int t = 0; t < threads; ++t) {
+        spawners.emplace_back([&](std::stop_token st) {
+            while (true) {
+                sync.arrive_and_wait(); // start of an iteration
+                if (st.stop_requested()) {
+                    return;
+                }
+                for (int i = 0; i < share; ++i) {
+                    scope->spawn_detached(leaves<task<void>>::leaf_void());
+                }
+                sync.arrive_and_wait(); // everything spawned
+            }
+        });
+    }
+
+    for (auto _ : state) {
+        Scope s;
+        scope = &s;
+        sync.arrive_and_wait();
+        sync.arrive_and_wait();
+        sync_wait(s.join_async());
+    }
+
+    for (std::jthread& t : spawners) {
+        t.request_stop();
+    }
+    sync.arrive_and_wait();
+    state.SetItemsProcessed(state.iterations() * share * threads);
+}
+} // namespace
+
+// N threads spawning into one scope: a single shared count against
+// sharded_async_scope's per-thread shards.
+static void BM_scope_concurrent_spawn(benchmark::State& state) {
+    concurrent_spawn<async_scope>(state);
+}
+BENCHMARK(BM_scope_concurrent_spawn)
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime();
+
+static void BM_sharded_scope_concurrent_spawn(benchmark::State& state) {
+    concurrent_spawn<sharded_async_scope>(state);
+}
+BENCHMARK(BM_sharded_scope_concurrent_spawn)
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime();
+
+// Insert N timers into a timer_queue, cancel half of them, and pop the rest.
+static void BM_timer_queue_insert_cancel_pop(benchmark::State& state) {
+    std::vector<timer_node> nodes(static_cast<std::size_t>(state.range(0)));
+    auto                    base = timer_node::clock::now();
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i].deadline =
+            base + std::chrono::microseconds((i * 7919) % 65536);
+    }
+
+    for (auto _ : state) {
+        timer_queue queue;
+        for (timer_node& node : nodes) {
+            queue.push(&node);
+        }
+        for (std::size_t i = 0; i < nodes.size(); i += 2) {
+            queue.remove(&nodes[i]);
+        }
+        while (!queue.empty()) {
+            benchmark::DoNotOptimize(queue.pop());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_timer_queue_insert_cancel_pop)
+    ->RangeMultiplier(8)
+    ->Range(64, 1 << 18);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,2 @@
+// coroexample_affinetask.cpp                                         -*-C++-*-
+#include <coroexample/affinetask.h>
@@ -0,0 +1,312 @@
+// coroexample_affinetask.h                                           -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_AFFINETASK
+#define INCLUDED_COROEXAMPLE_AFFINETASK
+
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <source_location>
+#include <stop_token>
+#include <type_traits>
+#include <utility>
+
+#include <coroexample/asyncstacks.h>
+#include <coroexample/cancellation.h>
+#include <coroexample/currentscheduler.h>
+#include <coroexample/frameallocator.h>
+#include <coroexample/helper.h>
+#include <coroexample/task.h>
+#include <coroexample/tracing.h>
+
+///////////////////////////////////////////////////
+// affine_task<T> - a task that stays on its scheduler
+//
+// After `co_await loop.schedule()` a task runs on one of the loop's
+// threads, but it carries on from each later co_await on whichever thread
+// completed the operation: the thread that set an event, the loop running
+// a child task that hopped elsewhere, an I/O loop. Putting a
+// `co_await loop.schedule()` after every such await gets it back, but pays
+// for a trip through the queue even when the operation completed on the
+// loop anyway.
+//
+// An affine_task instead remembers its scheduler - the one the awaiting
+// thread was running work for when it started (see currentscheduler.h),
+// or, after it awaits another scheduler's schedule() or timer, that one -
+// and its promise's await_transform() checks where each operation
+// completed:
+//
+//   affine_task<int> g(int i, manual_event_loop& loop) {
+//       co_await loop.schedule();   // now affine to 'loop'
+//       int x = co_await f(i, io);  // completes on io's thread...
+//       co_return x + 1;            // ...but this runs on 'loop' again
+//   }
+//
+// Rather than its own handle, the task gives the operations it awaits the
+// handle of a small resumer coroutine, created on the first await that
+// needs it and reused after that. Whichever thread resumes the resumer
+// either transfers straight to the task, if that thread belongs to the
+// task's scheduler, or queues the task there through the scheduler's
+// schedule(), with the awaitable kept in the promise so the hop doesn't
+// allocate. Awaitables that move the task themselves (those with a
+// `scheduler_type`, such as manual_event_loop's) are given the task's own
+// handle and, unless they are cancelled, change its scheduler instead. A
+// task that isn't running on any scheduler has nothing to return to, and
+// awaits as a plain task does.
+//
+// The resumer shares the task's stop token and async stack frame, so
+// cancellation and async stack dumps see through it.
+
+template <typename T>
+struct affine_task;
+
+struct _affinity;
+
+// Hands control back to the task from the thread that resumes it.
+struct _affine_resumer {
+    struct promise_type : frame_allocating_promise, stop_token_promise {
+        promise_type(_affinity& a, async_frame& task_frame) noexcept
+            : affinity(&a), stack_frame(task_frame) {}
+
+        _affine_resumer get_return_object() noexcept {
+            return _affine_resumer{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void                return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+
+        _affinity* affinity;
+
+        // The task's, so that awaitables which mark their awaiter as
+        // waiting (see asyncstacks.h) mark the task.
+        async_frame& stack_frame;
+    };
+
+    using handle_t = std::coroutine_handle<promise_type>;
+
+    struct return_to_task {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_t h) noexcept;
+        void                    await_resume() noexcept {}
+    };
+
+    handle_t coro;
+
+    _affine_resumer() = default;
+
+    explicit _affine_resumer(handle_t h) noexcept : coro(h) {}
+
+    _affine_resumer(_affine_resumer&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+
+    _affine_resumer& operator=(_affine_resumer&& other) noexcept {
+        std::swap(coro, other.coro);
+        return *this;
+    }
+
+    ~_affine_resumer() {
+        if (coro)
+            coro.destroy();
+    }
+
+    static _affine_resumer make(_affinity&, async_frame&) {
+        for (;;) {
+            co_await return_to_task{};
+        }
+    }
+};
+
+// The part of an affine_task's promise that doesn't depend on T.
+struct _affinity {
+    current_scheduler       home; // null scheduler if it has none
+    std::coroutine_handle<> task;
+    scheduler_hop           hop;
+    _affine_resumer         resumer;
+
+    // The resumer, to be resumed in place of 'h' (the task).
+    template <typename Promise>
+    _affine_resumer::handle_t resumer_for(std::coroutine_handle<Promise> h) {
+        if (!resumer.coro) {
+            resumer = _affine_resumer::make(*this, h.promise().stack_frame);
+        }
+        resumer.coro.promise().stop = h.promise().stop;
+        return resumer.coro;
+    }
+
+    // Called on the thread that resumed the resumer.
+    std::coroutine_handle<> return_to_task() noexcept {
+        if (current_scheduler::get().scheduler == home.scheduler) {
+            return task;
+        }
+        return home.reschedule(home.scheduler, hop, task);
+    }
+};
+
+inline std::coroutine_handle<>
+_affine_resumer::return_to_task::await_suspend(handle_t h) noexcept {
+    return h.promise().affinity->return_to_task();
+}
+
+// Wraps the awaiter of an operation awaited by an affine task, so that the
+// operation resumes the resumer rather than the task.
+template <typename Awaiter>
+struct _affine_awaiter {
+    Awaiter    inner;
+    _affinity* affinity;
+
+    bool await_ready() { return inner.await_ready(); }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) {
+        if (affinity->home.scheduler == nullptr) {
+            return suspend(h, h);
+        }
+        return suspend(affinity->resumer_for(h), h);
+    }
+
+    decltype(auto) await_resume() {
+        affinity->hop.reset();
+        return inner.await_resume();
+    }
+
+    // Calls inner.await_suspend(target) and returns what to transfer to.
+    template <typename Target>
+    std::coroutine_handle<> suspend(Target target, std::coroutine_handle<> h) {
+        using result = decltype(inner.await_suspend(target));
+        if constexpr (std::is_void_v<result>) {
+            inner.await_suspend(target);
+            return std::noop_coroutine();
+        } else if constexpr (std::is_same_v<result, bool>) {
+            if (inner.await_suspend(target)) {
+                return std::noop_coroutine();
+            }
+            return h;
+        } else {
+            return inner.await_suspend(target);
+        }
+    }
+};
+
+// Wraps the awaiter of an awaitable that resumes the task on a scheduler
+// of its own, which becomes the task's.
+template <typename Awaiter>
+struct _rehoming_awaiter {
+    Awaiter    inner;
+    _affinity* affinity;
+
+    bool await_ready() { return inner.await_ready(); }
+
+    template <typename Promise>
+    decltype(auto) await_suspend(std::coroutine_handle<Promise> h) {
+        return inner.await_suspend(h);
+    }
+
+    using result_type = decltype(std::declval<Awaiter&>().await_resume());
+
+    // The task is only rehomed once the operation has completed: one that
+    // was cancelled throws, and may resume the task on any thread.
+    result_type await_resume() {
+        if constexpr (std::is_void_v<result_type>) {
+            inner.await_resume();
+            affinity->home = current_scheduler::get();
+        } else {
+            result_type result = inner.await_resume();
+            affinity->home     = current_scheduler::get();
+            return static_cast<result_type&&>(result);
+        }
+    }
+};
+
+template <typename Awaiter>
+concept _scheduling_awaiter =
+    requires { typename std::remove_cvref_t<Awaiter>::scheduler_type; };
+
+template <typename T>
+struct affine_promise : task_promise<T> {
+    affine_promise(std::source_location where =
+                       std::source_location::current()) noexcept
+        : task_promise<T>(where) {
+        affinity.task =
+            std::coroutine_handle<affine_promise>::from_promise(*this);
+    }
+
+    affine_task<T> get_return_object() noexcept;
+
+    template <typename Awaitable>
+    auto await_transform(Awaitable&& a) {
+        using awaiter_t = awaiter_type_t<Awaitable>;
+        if constexpr (_scheduling_awaiter<awaiter_t>) {
+            return _rehoming_awaiter<awaiter_t>{
+                get_awaiter(static_cast<Awaitable&&>(a)), &affinity};
+        } else {
+            return _affine_awaiter<awaiter_t>{
+                get_awaiter(static_cast<Awaitable&&>(a)), &affinity};
+        }
+    }
+
+    _affinity affinity;
+};
+
+template <typename T>
+struct [[nodiscard]] affine_task {
+  private:
+    using handle_t = std::coroutine_handle<affine_promise<T>>;
+    handle_t coro;
+
+    struct awaiter {
+        handle_t coro;
+        bool     await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        handle_t await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            coro.promise().affinity.home = current_scheduler::get();
+            coro.promise().continuation  = h;
+            coro.promise().stop          = get_stop_token(h);
+            coro.promise().started.mark();
+            coro.promise().stack_frame.set_parent(async_frame_of(h));
+            trace_suspend(h);
+            trace_resume(coro);
+            return coro;
+        }
+
+        T await_resume() {
+            if (coro.promise().result.index() == 2) {
+                std::rethrow_exception(
+                    std::get<2>(std::move(coro.promise().result)));
+            }
+
+            assert(coro.promise().result.index() == 1);
+
+            if constexpr (!std::is_void_v<T>) {
+                return std::get<1>(std::move(coro.promise().result));
+            }
+        }
+    };
+
+    friend struct affine_promise<T>;
+
+    explicit affine_task(handle_t h) noexcept : coro(h) {}
+
+  public:
+    using promise_type = affine_promise<T>;
+
+    affine_task(affine_task&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+
+    ~affine_task() {
+        if (coro)
+            coro.destroy();
+    }
+
+    awaiter operator co_await() && { return awaiter{coro}; }
+};
+
+template <typename T>
+affine_task<T> affine_promise<T>::get_return_object() noexcept {
+    return affine_task<T>{
+        std::coroutine_handle<affine_promise<T>>::from_promise(*this)};
+}
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_asyncevent.cpp                                         -*-C++-*-
+#include <coroexample/asyncevent.h>
@@ -0,0 +1,125 @@
+// coroexample_asyncevent.h                                           -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_ASYNCEVENT
+#define INCLUDED_COROEXAMPLE_ASYNCEVENT
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+
+#include <coroexample/inlineresumption.h>
+
+/////////////////////////////////////////////////
+// async_manual_reset_event
+//
+// An event that coroutines can wait for without blocking a thread:
+//
+//   co_await event;   // resumes once set() has been called
+//
+// The state is a single atomic pointer: the event's own address while it
+// is set, otherwise the head of an intrusive stack of waiting awaiters (or
+// null). Waiting on a set event and set() with no waiters are one atomic
+// operation each. set() resumes every waiter inline, on the calling
+// thread, within the thread's inline_resumption budget; reset() makes
+// later waits suspend again.
+
+struct async_manual_reset_event {
+  private:
+    struct awaiter {
+        const async_manual_reset_event* event;
+        awaiter*                        next{nullptr};
+        std::coroutine_handle<>         coro{};
+
+        bool await_ready() const noexcept { return event->is_set(); }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            coro            = h;
+            const void* set = event;
+            void*       old = event->state.load(std::memory_order_acquire);
+            do {
+                if (old == set) {
+                    return false;
+                }
+                next = static_cast<awaiter*>(old);
+            } while (!event->state.compare_exchange_weak(
+                old,
+                this,
+                std::memory_order_release,
+                std::memory_order_acquire));
+            return true;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    // 'this' when set, otherwise the most recent waiter.
+    mutable std::atomic<void*> state;
+
+  public:
+    explicit async_manual_reset_event(bool initially_set = false) noexcept
+        : state(initially_set ? static_cast<void*>(this) : nullptr) {}
+
+    async_manual_reset_event(const async_manual_reset_event&) = delete;
+    async_manual_reset_event&
+    operator=(const async_manual_reset_event&) = delete;
+
+    bool is_set() const noexcept {
+        return state.load(std::memory_order_acquire) == this;
+    }
+
+    void set() noexcept {
+        void* old = state.exchange(this, std::memory_order_acq_rel);
+        if (old == this) {
+            return;
+        }
+        auto* w = static_cast<awaiter*>(old);
+        while (w != nullptr) {
+            // Read 'next' first: resuming destroys the awaiter.
+            awaiter* next = w->next;
+            inline_resumption::resume(w->coro);
+            w = next;
+        }
+    }
+
+    // No effect unless the event is set.
+    void reset() noexcept {
+        void* old = this;
+        state.compare_exchange_strong(
+            old, nullptr, std::memory_order_relaxed);
+    }
+
+    awaiter operator co_await() const noexcept { return awaiter{this}; }
+};
+
+/////////////////////////////////////////////////
+// async_latch
+//
+// A single-use countdown that coroutines can wait on: `co_await latch`
+// resumes once count_down() has brought the count to zero.
+
+struct async_latch {
+  private:
+    std::atomic<std::ptrdiff_t> count;
+    async_manual_reset_event    event;
+
+  public:
+    explicit async_latch(std::ptrdiff_t initial) noexcept
+        : count(initial), event(initial <= 0) {}
+
+    // The last count_down() resumes the waiters on its own thread.
+    void count_down(std::ptrdiff_t n = 1) noexcept {
+        std::ptrdiff_t old = count.fetch_sub(n, std::memory_order_acq_rel);
+        assert(old >= n);
+        if (old == n) {
+            event.set();
+        }
+    }
+
+    bool try_wait() const noexcept { return event.is_set(); }
+
+    auto operator co_await() const noexcept {
+        return event.operator co_await();
+    }
+};
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_asyncmutex.cpp                                         -*-C++-*-
+#include <coroexample/asyncmutex.h>
@@ -0,0 +1,280 @@
+// coroexample_asyncmutex.h                                           -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_ASYNCMUTEX
+#define INCLUDED_COROEXAMPLE_ASYNCMUTEX
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <coroexample/inlineresumption.h>
+
+/////////////////////////////////////////////////
+// async_mutex
+//
+// A mutex for coroutines: a coroutine that finds it locked suspends
+// instead of blocking its thread, so the event loop worker it was running
+// on can get on with other work.
+//
+//   async_mutex_lock lock = co_await mutex.scoped_lock_async();
+//
+// The whole state is one atomic word, which is either `not_locked`,
+// `locked_no_waiters`, or the address of the most recently queued waiter;
+// waiters form an intrusive stack through nodes inside their awaiters, so
+// neither locking nor waiting allocates. Locking an unlocked mutex is one
+// compare-exchange. unlock() moves the stack into a FIFO list that only
+// the lock holder touches, so waiters get the lock in arrival order.
+//
+// The lock is handed straight to the next waiter, which is resumed from
+// inside unlock() on the unlocking thread. Alternatively, lock on a
+// scheduler - `co_await mutex.scoped_lock_async(loop)` - and a coroutine
+// that had to wait is instead rescheduled onto that scheduler when the
+// lock is handed to it, which keeps the unlocking coroutine running and
+// the waiter on its own loop. If that hop is cancelled, because stop was
+// requested for the waiter, the lock is passed on and the await throws
+// operation_cancelled.
+
+struct async_mutex;
+
+// Owns a lock on an async_mutex, and unlocks it on destruction.
+struct [[nodiscard]] async_mutex_lock {
+    async_mutex_lock() noexcept = default;
+    explicit async_mutex_lock(async_mutex& m) noexcept : mutex(&m) {}
+
+    async_mutex_lock(async_mutex_lock&& other) noexcept
+        : mutex(std::exchange(other.mutex, nullptr)) {}
+
+    async_mutex_lock& operator=(async_mutex_lock&& other) noexcept {
+        async_mutex_lock tmp{std::move(other)};
+        std::swap(mutex, tmp.mutex);
+        return *this;
+    }
+
+    ~async_mutex_lock();
+
+    bool owns_lock() const noexcept { return mutex != nullptr; }
+
+    void unlock() noexcept;
+
+  private:
+    async_mutex* mutex{nullptr};
+};
+
+struct async_mutex {
+  private:
+    struct lock_awaiter {
+        async_mutex*            mutex;
+        lock_awaiter*           next{nullptr};
+        std::coroutine_handle<> coro;
+
+        // If set, called instead of resuming 'coro' when the lock is
+        // handed over.
+        void (*handoff)(lock_awaiter*) noexcept {nullptr};
+
+        explicit lock_awaiter(async_mutex& m) noexcept : mutex(&m) {}
+
+        bool await_ready() noexcept { return mutex->try_lock(); }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            coro = h;
+            return mutex->lock_or_enqueue(this);
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    struct scoped_lock_awaiter : lock_awaiter {
+        using lock_awaiter::lock_awaiter;
+
+        async_mutex_lock await_resume() noexcept {
+            return async_mutex_lock{*this->mutex};
+        }
+    };
+
+    // An awaiter that, if it has to wait, resumes on 'sched' rather than
+    // on the unlocking thread.
+    template <typename Base, typename Scheduler>
+    struct rescheduling_awaiter : Base {
+        using schedule_awaitable =
+            decltype(std::declval<Scheduler&>().schedule());
+
+        Scheduler* sched;
+        bool       hopped{false};
+        alignas(schedule_awaitable) unsigned char hop[sizeof(
+            schedule_awaitable)];
+
+        rescheduling_awaiter(async_mutex& m, Scheduler& s) noexcept
+            : Base(m), sched(&s) {}
+
+        rescheduling_awaiter(const rescheduling_awaiter&) = delete;
+
+        ~rescheduling_awaiter() {
+            if (hopped) {
+                hop_awaitable().~schedule_awaitable();
+            }
+        }
+
+        schedule_awaitable& hop_awaitable() noexcept {
+            return *std::launder(reinterpret_cast<schedule_awaitable*>(hop));
+        }
+
+        // The hop is given the coroutine's own handle type, so that it
+        // can see the coroutine's stop token.
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            this->handoff = &reschedule<Promise>;
+            return Base::await_suspend(h);
+        }
+
+        // A hop that was cancelled throws from here, after giving back the
+        // lock it was handed.
+        decltype(auto) await_resume() {
+            if (hopped) {
+                try {
+                    hop_awaitable().await_resume();
+                } catch (...) {
+                    this->mutex->unlock();
+                    throw;
+                }
+            }
+            return Base::await_resume();
+        }
+
+        template <typename Promise>
+        static void reschedule(lock_awaiter* w) noexcept {
+            auto* self = static_cast<rescheduling_awaiter*>(w);
+            auto  h    = std::coroutine_handle<Promise>::from_address(
+                self->coro.address());
+            auto* a = ::new (static_cast<void*>(self->hop))
+                schedule_awaitable(self->sched->schedule());
+            self->hopped = true;
+
+            using result = decltype(a->await_suspend(h));
+            if constexpr (std::is_void_v<result>) {
+                a->await_suspend(h);
+            } else if constexpr (std::is_same_v<result, bool>) {
+                if (!a->await_suspend(h)) {
+                    inline_resumption::resume(h);
+                }
+            } else {
+                a->await_suspend(h).resume();
+            }
+        }
+    };
+
+    // Neither can be the address of a waiter, as awaiters are at least
+    // 2-aligned.
+    static constexpr std::uintptr_t not_locked        = 1;
+    static constexpr std::uintptr_t locked_no_waiters = 0;
+
+    std::atomic<std::uintptr_t> state{not_locked};
+
+    // Waiters in FIFO order, taken from 'state'. Only the lock holder
+    // touches this.
+    lock_awaiter* waiters{nullptr};
+
+    // Returns true if 'w' was queued, false if it took the lock.
+    bool lock_or_enqueue(lock_awaiter* w) noexcept {
+        std::uintptr_t old = state.load(std::memory_order_relaxed);
+        while (true) {
+            if (old == not_locked) {
+                if (state.compare_exchange_weak(old,
+                                                locked_no_waiters,
+                                                std::memory_order_acquire,
+                                                std::memory_order_relaxed)) {
+                    return false;
+                }
+            } else {
+                w->next = reinterpret_cast<lock_awaiter*>(old);
+                if (state.compare_exchange_weak(
+                        old,
+                        reinterpret_cast<std::uintptr_t>(w),
+                        std::memory_order_release,
+                        std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+    }
+
+  public:
+    async_mutex() noexcept = default;
+
+    async_mutex(const async_mutex&)            = delete;
+    async_mutex& operator=(const async_mutex&) = delete;
+
+    bool try_lock() noexcept {
+        std::uintptr_t old = not_locked;
+        return state.compare_exchange_strong(old,
+                                             locked_no_waiters,
+                                             std::memory_order_acquire,
+                                             std::memory_order_relaxed);
+    }
+
+    // co_await mutex.lock_async(); ... mutex.unlock();
+    lock_awaiter lock_async() noexcept { return lock_awaiter{*this}; }
+
+    // Resumes with an async_mutex_lock that unlocks on destruction.
+    scoped_lock_awaiter scoped_lock_async() noexcept {
+        return scoped_lock_awaiter{*this};
+    }
+
+    template <typename Scheduler>
+    rescheduling_awaiter<lock_awaiter, Scheduler>
+    lock_async(Scheduler& sched) noexcept {
+        return {*this, sched};
+    }
+
+    template <typename Scheduler>
+    rescheduling_awaiter<scoped_lock_awaiter, Scheduler>
+    scoped_lock_async(Scheduler& sched) noexcept {
+        return {*this, sched};
+    }
+
+    // Hands the lock to the next waiter, if there is one.
+    void unlock() noexcept {
+        lock_awaiter* w = waiters;
+        if (w == nullptr) {
+            std::uintptr_t old = locked_no_waiters;
+            if (state.compare_exchange_strong(old,
+                                              not_locked,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+                return;
+            }
+
+            // Take the stack of new waiters and reverse it into FIFO
+            // order.
+            old = state.exchange(locked_no_waiters, std::memory_order_acquire);
+            auto* next = reinterpret_cast<lock_awaiter*>(old);
+            do {
+                lock_awaiter* after = next->next;
+                next->next          = w;
+                w                   = next;
+                next                = after;
+            } while (next != nullptr);
+        }
+
+        // Read 'next' first: resuming destroys the awaiter.
+        waiters = w->next;
+        if (w->handoff != nullptr) {
+            w->handoff(w);
+        } else {
+            inline_resumption::resume(w->coro);
+        }
+    }
+};
+
+inline async_mutex_lock::~async_mutex_lock() {
+    if (mutex != nullptr) {
+        mutex->unlock();
+    }
+}
+
+inline void async_mutex_lock::unlock() noexcept {
+    std::exchange(mutex, nullptr)->unlock();
+}
+
+#endif
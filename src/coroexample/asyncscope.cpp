@@ -1,2 +1,26 @@
 // coroexample_asyncscope.cpp                                         -*-C++-*-
 #include <coroexample/asyncscope.h>
+
+#include <algorithm>
+#include <bit>
+#include <thread>
+
+_sharded_scope_ref_count::_sharded_scope_ref_count()
+    : mask(std::bit_ceil(std::max(std::thread::hardware_concurrency(), 1u)) -
+           1) {
+    shards = std::make_unique<shard[]>(mask + 1);
+}
+
+bool _sharded_scope_ref_count::start_join() noexcept {
+    folded.store(join_bias, std::memory_order_relaxed);
+    joining.store(true, std::memory_order_seq_cst);
+
+    std::int64_t sum = 0;
+    for (std::size_t i = 0; i <= mask; ++i) {
+        sum += shards[i].count.exchange(0, std::memory_order_seq_cst);
+    }
+
+    // Updaters that saw 'joining' may have folded their shards already.
+    std::int64_t delta = sum - join_bias;
+    return folded.fetch_add(delta, std::memory_order_acq_rel) != -delta;
+}
@@ -5,23 +5,259 @@
 #include <coroutine>
 #include <atomic>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <source_location>
+#include <stop_token>
+#include <type_traits>
+#include <utility>
 
+#include <coroexample/asyncsemaphore.h>
+#include <coroexample/asyncstacks.h>
+#include <coroexample/cancellation.h>
+#include <coroexample/frameallocator.h>
+#include <coroexample/framestats.h>
 #include <coroexample/generalhelper.h>
 #include <coroexample/helper.h>
+#include <coroexample/inlineresumption.h>
+#include <coroexample/inlinetask.h>
+#include <coroexample/tracing.h>
 
 ////////////////////////////////////////
 // async_scope
 //
 // Used to launch new tasks and then later wait until all tasks
 // have completed.
+//
+// `spawn_detached()` discards the result. `spawn_future()` starts the
+// task just as eagerly but returns an `async_scope::future<T>` which can
+// be co_awaited later for the result, or for the exception rethrown:
+//
+//   auto f = scope.spawn_future(fetch(key));
+//   ...
+//   value v = co_await std::move(f);
+//
+// The result is stored in the spawned coroutine's own promise, so the
+// future costs no allocation beyond the coroutine frame. The frame is
+// owned jointly by the running coroutine and the future, and is destroyed
+// by whichever of the two finishes with it last. A future may be dropped
+// without being awaited; the task still runs to completion and is still
+// waited for by join_async().
+//
+// By default an exception escaping a detached task terminates the
+// process, and so does one from a future that is dropped unawaited,
+// whether it is dropped before or after its task fails. A scope
+// constructed with `async_scope::collect_exceptions` instead records the
+// first such exception and rethrows it from join_async(); one from a
+// future dropped after join_async() has completed is rethrown by the next
+// join_async(). Cancellation is never reported.
+//
+// Each scope owns a std::stop_source, and every task spawned in it (and
+// every task those await) sees its token. `request_stop()` cancels them
+// all; tasks that end with `operation_cancelled` are treated as having
+// completed normally rather than as failures. A scope is a cancellation
+// root: it does not inherit the token of the coroutine that created it.
+//
+// A scope constructed with an `async_scope::concurrency_limit` bounds how
+// many tasks started with `spawn()` or `try_spawn()` are live at once, so
+// memory use under load is a configured bound rather than a function of
+// the arrival rate:
+//
+//   async_scope scope{async_scope::concurrency_limit{64}};
+//   while (auto req = co_await next_request()) {
+//       co_await scope.spawn(handle(*req)); // waits for a free slot
+//   }
+//
+// `co_await scope.spawn(a)` suspends the spawning coroutine while the
+// limit is reached; the task whose completion frees a slot resumes it,
+// from notify_task_finished(). `try_spawn(a)` never suspends and returns
+// false, leaving 'a' untouched, if no slot is free. Slots are an
+// async_semaphore, so claiming a free one is a single atomic RMW. Tasks
+// started with spawn_detached() or spawn_future() don't take a slot.
+//
+// With async stacks enabled (see asyncstacks.h), each spawned task's
+// chain ends in an entry naming the scope, and a coroutine in
+// join_async() is marked as joining it.
+//
+// Every spawn and every completion updates the scope's reference count,
+// which is a single atomic word. When many threads spawn into one scope
+// that word bounces between their caches, so `sharded_async_scope` has
+// the same interface but splits the count into cache-line sized shards,
+// one per thread (modulo the shard count). Until join_async() starts, a
+// spawn or completion only touches the calling thread's shard; joining
+// folds the shards into one count, and as before the task that takes it
+// to zero resumes the joiner. Joining costs a pass over the shards even
+// when there is nothing to wait for.
+
+// The reference count of an async_scope: twice the number of unfinished
+// tasks, plus 'joiner_flag' once a coroutine is waiting in join_async().
+struct _scope_ref_count {
+    static constexpr std::size_t joiner_flag   = 1;
+    static constexpr std::size_t ref_increment = 2;
+
+    std::atomic<std::size_t> count{0};
+
+    void add_ref() noexcept {
+        count.fetch_add(ref_increment, std::memory_order_relaxed);
+    }
+
+    // Drops a ref. Returns true if it was the last one and a coroutine is
+    // joining, which the caller must then resume.
+    bool release() noexcept {
+        std::size_t oldValue = count.load(std::memory_order_acquire);
+        assert(oldValue >= ref_increment);
+
+        // Only skip the decrement when this is the last ref and a joiner is
+        // already waiting; in every other case (including the last ref with
+        // no joiner yet) the count must drop so a later join sees zero.
+        if (oldValue != (joiner_flag + ref_increment)) {
+            oldValue =
+                count.fetch_sub(ref_increment, std::memory_order_acq_rel);
+        }
+        return oldValue == (joiner_flag + ref_increment);
+    }
+
+    // True if there is certainly nothing to wait for.
+    bool idle() const noexcept {
+        return count.load(std::memory_order_acquire) == 0;
+    }
+
+    // Marks a coroutine as joining. Returns false if no refs are left, so
+    // it doesn't have to wait.
+    bool start_join() noexcept {
+        return count.fetch_add(joiner_flag, std::memory_order_acq_rel) != 0;
+    }
+};
+
+// The reference count of a sharded_async_scope. Each shard holds the
+// number of tasks spawned minus the number finished by the threads that
+// map to it, which goes negative for a thread that mostly finishes tasks
+// that others spawned.
+//
+// start_join() sets 'joining', then moves every shard's count into
+// 'folded', which holds a large bias meanwhile so that a partial sum can't
+// read as zero. An add_ref() or release() that sees 'joining' folds its
+// own shard, as the joiner may already have passed it. Both sides use
+// sequentially consistent operations, so either the joiner's exchange
+// sees the update or the updater sees 'joining'; exchanging the shard
+// with zero makes sure each update is folded once. Once start_join() has
+// dropped the bias, the fold that brings 'folded' to zero is the last
+// completion.
+struct _sharded_scope_ref_count {
+    // One shard per hardware thread, rounded up to a power of two.
+    _sharded_scope_ref_count();
+
+    void add_ref() noexcept { update(1); }
+
+    bool release() noexcept { return update(-1); }
+
+    // The shards can't be read as one consistent snapshot, so joining
+    // always goes through start_join().
+    bool idle() const noexcept { return false; }
+
+    bool start_join() noexcept;
+
+  private:
+    struct alignas(64) shard {
+        std::atomic<std::int64_t> count{0};
+    };
+
+    static constexpr std::int64_t join_bias = std::int64_t{1} << 62;
+
+    // Threads are numbered in the order they first touch a sharded count.
+    static std::size_t thread_index() noexcept {
+        static std::atomic<std::size_t> next{0};
+        thread_local std::size_t        index =
+            next.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+
+    bool update(std::int64_t delta) noexcept {
+        std::atomic<std::int64_t>& c = shards[thread_index() & mask].count;
+        c.fetch_add(delta, std::memory_order_seq_cst);
+        if (!joining.load(std::memory_order_seq_cst)) [[likely]] {
+            return false;
+        }
+        return fold(c.exchange(0, std::memory_order_seq_cst));
+    }
+
+    // Adds 'delta' to 'folded'; returns true if that brought it to zero.
+    bool fold(std::int64_t delta) noexcept {
+        return delta != 0 &&
+               folded.fetch_add(delta, std::memory_order_acq_rel) == -delta;
+    }
+
+    std::unique_ptr<shard[]>  shards;
+    std::size_t               mask;
+    std::atomic<bool>         joining{false};
+    std::atomic<std::int64_t> folded{0};
+};
+
+// 'RefCount' is _scope_ref_count (async_scope) or _sharded_scope_ref_count
+// (sharded_async_scope).
+template <typename RefCount>
+struct basic_async_scope {
+  public:
+    template <typename T>
+    struct future;
 
-struct async_scope {
   private:
+    // Tags a detached task that holds one of the scope's slots.
+    struct slot_t {};
+
+    // Labels the async stacks entry of a coroutine running a spawned task.
+    static constexpr const char* spawned_label = "async_scope task";
+
+    template <typename Promise>
+    static void* frame_address(Promise& p) noexcept {
+        return std::coroutine_handle<Promise>::from_promise(p).address();
+    }
+
     struct detached_task {
-        struct promise_type {
-            async_scope& scope;
+        struct promise_type : stop_token_promise {
+            basic_async_scope&                scope;
+            bool                              holds_slot{false};
+            [[no_unique_address]] async_frame stack_frame;
+
+            // 'where' is the spawn_*_impl() instantiation.
+            promise_type(basic_async_scope&   scope,
+                         auto&,
+                         std::source_location where =
+                             std::source_location::current()) noexcept
+                : scope(scope),
+                  stack_frame(
+                      frame_address(*this), {}, spawned_label, &scope) {
+                stop = &scope.token;
+                note_frame_constructed(frame_address(*this), where);
+            }
 
-            promise_type(async_scope& scope, auto&) noexcept : scope(scope) {}
+            promise_type(basic_async_scope&   scope,
+                         slot_t,
+                         auto&,
+                         std::source_location where =
+                             std::source_location::current()) noexcept
+                : scope(scope),
+                  holds_slot(true),
+                  stack_frame(
+                      frame_address(*this), {}, spawned_label, &scope) {
+                stop = &scope.token;
+                note_frame_constructed(frame_address(*this), where);
+            }
+
+            // The global ones, noting the frame's size.
+            static void* operator new(std::size_t size) {
+                void* frame = ::operator new(size);
+                note_frame_allocation(frame, size);
+                return frame;
+            }
+
+            static void operator delete(void*       frame,
+                                        std::size_t size) noexcept {
+                ::operator delete(frame, size);
+            }
 
             detached_task get_return_object() noexcept { return {}; }
 
@@ -34,9 +270,10 @@ struct async_scope {
                 bool await_ready() noexcept { return false; }
                 void
                 await_suspend(std::coroutine_handle<promise_type> h) noexcept {
-                    async_scope& s = h.promise().scope;
+                    basic_async_scope& s    = h.promise().scope;
+                    bool               slot = h.promise().holds_slot;
                     h.destroy();
-                    s.notify_task_finished();
+                    s.notify_task_finished(slot);
                 }
                 void await_resume() noexcept {}
             };
@@ -45,8 +282,15 @@ struct async_scope {
 
             void return_void() noexcept {}
 
-            [[noreturn]] void unhandled_exception() noexcept {
-                std::terminate();
+            void unhandled_exception() noexcept {
+                std::exception_ptr e = std::current_exception();
+                if (is_cancellation(e)) {
+                    return;
+                }
+                if (!scope.collect) {
+                    std::terminate();
+                }
+                scope.record_exception(std::move(e));
             }
         };
     };
@@ -56,59 +300,304 @@ struct async_scope {
         co_await std::forward<A>(a);
     }
 
-    void add_ref() noexcept {
-        ref_count.fetch_add(ref_increment, std::memory_order_relaxed);
+    // Spawns a task that gives back its slot when it finishes.
+    template <typename A>
+    detached_task spawn_slotted_impl(slot_t, A a) {
+        co_await std::forward<A>(a);
     }
 
-    void notify_task_finished() noexcept {
-        std::size_t oldValue = ref_count.load(std::memory_order_acquire);
-        assert(oldValue >= ref_increment);
+    template <typename A>
+    void spawn_in_slot(A&& a) {
+        try {
+            spawn_slotted_impl(slot_t{}, std::forward<A>(a));
+        } catch (...) {
+            slots.release();
+            throw;
+        }
+    }
 
-        if (oldValue > (joiner_flag + ref_increment)) {
-            oldValue =
-                ref_count.fetch_sub(ref_increment, std::memory_order_acq_rel);
+    template <typename A>
+    struct spawn_awaiter {
+        using acquire_awaiter =
+            decltype(std::declval<async_semaphore&>().acquire());
+
+        basic_async_scope& scope;
+        A                  a;
+        acquire_awaiter    acquire;
+
+        bool await_ready() noexcept { return acquire.await_ready(); }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            return acquire.await_suspend(h);
         }
 
-        if (oldValue == (joiner_flag + ref_increment)) {
+        void await_resume() { scope.spawn_in_slot(std::move(a)); }
+    };
+
+    template <typename T>
+    struct future_promise : frame_allocating_promise,
+                            stop_token_promise,
+                            inline_task_result<T> {
+        enum state_t { running, awaiting, completed, abandoned };
+
+        basic_async_scope&                scope;
+        std::coroutine_handle<>           continuation;
+        std::atomic<state_t>              state{running};
+        [[no_unique_address]] async_frame stack_frame;
+
+        future_promise(basic_async_scope&   scope,
+                       auto&,
+                       std::source_location where =
+                           std::source_location::current()) noexcept
+            : scope(scope),
+              stack_frame(frame_address(*this), {}, spawned_label, &scope) {
+            stop = &scope.token;
+            note_frame_constructed(frame_address(*this), where);
+        }
+
+        future<T> get_return_object() noexcept {
+            return future<T>{
+                std::coroutine_handle<future_promise>::from_promise(*this)};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            scope.add_ref();
+            return {};
+        }
+
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<future_promise> h) noexcept {
+                future_promise&    p = h.promise();
+                basic_async_scope& s = p.scope;
+
+                // Once the state says completed the future may destroy the
+                // frame at any moment, so nothing in it is touched after
+                // the exchange unless the future is awaiting, when the
+                // coroutine awaiting it is suspended and so can't.
+                std::coroutine_handle<> next = std::noop_coroutine();
+                state_t prev = p.state.exchange(completed,
+                                                std::memory_order_acq_rel);
+                if (prev == awaiting) {
+                    next = p.continuation;
+                } else if (prev == abandoned) {
+                    p.report_unobserved();
+                    h.destroy();
+                }
+                s.notify_task_finished();
+                return next;
+            }
+            [[noreturn]] void await_resume() noexcept { std::terminate(); }
+        };
+
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        // For a completed task whose future was dropped: its exception is
+        // handled as a detached task's would be.
+        void report_unobserved() noexcept {
+            if (!this->exception || is_cancellation(this->exception)) {
+                return;
+            }
+            if (!scope.collect) {
+                std::terminate();
+            }
+            scope.record_exception(this->exception);
+        }
+    };
+
+    template <typename A>
+    future<std::decay_t<await_result_t<A>>> spawn_future_impl(A a) {
+        if constexpr (std::is_void_v<await_result_t<A>>) {
+            co_await std::move(a);
+        } else {
+            co_return co_await std::move(a);
+        }
+    }
+
+    void record_exception(std::exception_ptr e) noexcept {
+        if (!has_exception.exchange(true, std::memory_order_relaxed)) {
+            // Published to the joiner by notify_task_finished().
+            first_exception = std::move(e);
+        }
+    }
+
+    void add_ref() noexcept {
+        refs.add_ref();
+        trace_record(trace_kind::scope_spawn, this);
+    }
+
+    void notify_task_finished(bool release_slot = false) noexcept {
+        if (release_slot) {
+            // Before dropping our ref: a spawner resumed from here adds
+            // its task before a joiner can see the count reach zero.
+            slots.release();
+        }
+
+        if (refs.release()) {
             // last ref and there is a joining coroutine -> resume the
             // coroutien
-            joiner.resume();
+            inline_resumption::resume(joiner);
         }
     }
 
     struct join_awaiter {
-        async_scope& scope;
+        basic_async_scope&               scope;
+        [[no_unique_address]] async_wait wait{};
 
         bool await_ready() {
-            return scope.ref_count.load(std::memory_order_acquire) == 0;
+            return scope.refs.idle();
         }
 
-        bool await_suspend(std::coroutine_handle<> h) noexcept {
-            scope.joiner         = h;
-            std::size_t oldValue = scope.ref_count.fetch_add(
-                joiner_flag, std::memory_order_acq_rel);
-            return (oldValue != 0);
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            wait.begin(h, "joining async_scope", &scope);
+            scope.joiner = h;
+            return scope.refs.start_join();
         }
 
-        void await_resume() noexcept {}
+        void await_resume() {
+            wait.end();
+            trace_record(trace_kind::scope_join, &scope);
+            if (scope.first_exception) [[unlikely]] {
+                scope.has_exception.store(false, std::memory_order_relaxed);
+                std::rethrow_exception(
+                    std::exchange(scope.first_exception, nullptr));
+            }
+        }
     };
 
-    static constexpr std::size_t joiner_flag   = 1;
-    static constexpr std::size_t ref_increment = 2;
+    static constexpr std::ptrdiff_t unlimited =
+        std::numeric_limits<std::ptrdiff_t>::max();
 
-    std::atomic<std::size_t> ref_count{0};
-    std::coroutine_handle<>  joiner;
+    RefCount                refs;
+    std::coroutine_handle<> joiner;
+    bool                    collect{false};
+    std::atomic<bool>       has_exception{false};
+    std::exception_ptr      first_exception;
+    std::stop_source        source;
+    std::stop_token         token{source.get_token()};
+    async_semaphore         slots{unlimited};
 
   public:
+    template <typename T>
+    struct [[nodiscard]] future {
+      private:
+        using handle_t = std::coroutine_handle<future_promise<T>>;
+        handle_t coro;
+
+        struct awaiter {
+            handle_t coro;
+
+            bool await_ready() noexcept {
+                return coro.promise().state.load(std::memory_order_acquire) ==
+                       future_promise<T>::completed;
+            }
+
+            // Fails if the task completed after await_ready(), leaving the
+            // state completed so that ~future() frees the frame.
+            bool await_suspend(std::coroutine_handle<> h) noexcept {
+                future_promise<T>& p = coro.promise();
+                p.continuation       = h;
+                auto expected        = future_promise<T>::running;
+                return p.state.compare_exchange_strong(
+                    expected,
+                    future_promise<T>::awaiting,
+                    std::memory_order_acq_rel,
+                    std::memory_order_acquire);
+            }
+
+            T await_resume() { return coro.promise().get(); }
+        };
+
+        friend struct future_promise<T>;
+
+        explicit future(handle_t h) noexcept : coro(h) {}
+
+      public:
+        using promise_type = future_promise<T>;
+
+        future(future&& other) noexcept
+            : coro(std::exchange(other.coro, {})) {}
+
+        // Dropping a future whose task hasn't completed leaves the task to
+        // free its own frame when it does. That includes a future whose
+        // awaiting coroutine was destroyed while suspended.
+        ~future() {
+            if (coro && coro.promise().state.exchange(
+                            future_promise<T>::abandoned,
+                            std::memory_order_acq_rel) ==
+                            future_promise<T>::completed) {
+                coro.promise().report_unobserved();
+                coro.destroy();
+            }
+        }
+
+        awaiter operator co_await() && { return awaiter{coro}; }
+    };
+
+    struct collect_exceptions_t {};
+    static constexpr collect_exceptions_t collect_exceptions{};
+
+    struct concurrency_limit {
+        std::size_t max_tasks;
+    };
+
+    basic_async_scope() = default;
+    explicit basic_async_scope(collect_exceptions_t) : collect(true) {}
+    explicit basic_async_scope(concurrency_limit limit)
+        : slots(static_cast<std::ptrdiff_t>(limit.max_tasks)) {
+        assert(limit.max_tasks > 0);
+    }
+    basic_async_scope(concurrency_limit limit, collect_exceptions_t)
+        : collect(true), slots(static_cast<std::ptrdiff_t>(limit.max_tasks)) {
+        assert(limit.max_tasks > 0);
+    }
+
     template <typename A>
     requires decay_copyable<A> && awaitable<std::decay_t<A>>
     void spawn_detached(A&& a) {
         spawn_detached_impl(std::forward<A>(a));
     }
 
+    template <typename A>
+    requires decay_copyable<A> && awaitable<std::decay_t<A>>
+    future<std::decay_t<await_result_t<std::decay_t<A>>>>
+    spawn_future(A&& a) {
+        return spawn_future_impl<std::decay_t<A>>(std::forward<A>(a));
+    }
+
+    // co_await scope.spawn(a) - starts 'a' once a slot is free.
+    template <typename A>
+    requires decay_copyable<A> && awaitable<std::decay_t<A>>
+    spawn_awaiter<std::decay_t<A>> spawn(A&& a) {
+        return {*this, std::forward<A>(a), slots.acquire()};
+    }
+
+    // Starts 'a' and returns true if a slot is free; otherwise returns
+    // false without touching 'a'.
+    template <typename A>
+    requires decay_copyable<A> && awaitable<std::decay_t<A>>
+    bool try_spawn(A&& a) {
+        if (!slots.try_acquire()) {
+            return false;
+        }
+        spawn_in_slot(std::forward<A>(a));
+        return true;
+    }
+
+    // Asks every task spawned in this scope to stop.
+    void request_stop() noexcept { source.request_stop(); }
+
+    std::stop_token get_stop_token() const noexcept { return token; }
+
+    // Rethrows the first collected exception, if the scope collects them.
     [[nodiscard]] join_awaiter join_async() noexcept {
         return join_awaiter{*this};
     }
 };
 
+using async_scope         = basic_async_scope<_scope_ref_count>;
+using sharded_async_scope = basic_async_scope<_sharded_scope_ref_count>;
+
 #endif
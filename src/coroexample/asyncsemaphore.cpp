@@ -0,0 +1,2 @@
+// coroexample_asyncsemaphore.cpp                                     -*-C++-*-
+#include <coroexample/asyncsemaphore.h>
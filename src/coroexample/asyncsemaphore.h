@@ -0,0 +1,127 @@
+// coroexample_asyncsemaphore.h                                       -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_ASYNCSEMAPHORE
+#define INCLUDED_COROEXAMPLE_ASYNCSEMAPHORE
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <mutex>
+
+#include <coroexample/inlineresumption.h>
+
+/////////////////////////////////////////////////
+// async_semaphore
+//
+// A counting semaphore for coroutines: acquire() suspends, rather than
+// blocking the thread, while no permits are available. Useful to cap how
+// much concurrent work is in flight, e.g. how many coroutines are spawned
+// into an async_scope at once.
+//
+//   co_await sem.acquire();
+//   ... at most N coroutines here ...
+//   sem.release();
+//
+// The permit count is an atomic, so acquiring an available permit and
+// releasing one that nobody is waiting for are a single atomic RMW each.
+// The count goes negative while acquirers are short of permits; only then
+// do acquire() and release() meet under a mutex, where a releaser either
+// hands its permit to the first waiter (resuming it inline, through
+// inline_resumption) or, if that acquirer hasn't queued itself yet, leaves
+// the permit for it to pick up.
+// Waiters are queued FIFO through nodes in their awaiters.
+
+struct async_semaphore {
+  private:
+    struct acquire_awaiter {
+        async_semaphore*        sem;
+        acquire_awaiter*        next{nullptr};
+        std::coroutine_handle<> coro{};
+
+        bool await_ready() noexcept {
+            return sem->count.fetch_sub(1, std::memory_order_acquire) > 0;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            coro = h;
+            return sem->enqueue(this);
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::atomic<std::ptrdiff_t> count;
+
+    std::mutex       mut;
+    acquire_awaiter* head{nullptr};
+    acquire_awaiter* tail{nullptr};
+    std::ptrdiff_t   handed{0}; // released for acquirers not yet queued
+
+    // Returns true if 'w' was queued, false if it got a handed permit.
+    bool enqueue(acquire_awaiter* w) noexcept {
+        std::lock_guard lock{mut};
+        if (handed > 0) {
+            --handed;
+            return false;
+        }
+        if (head == nullptr) {
+            head = w;
+        } else {
+            tail->next = w;
+        }
+        tail = w;
+        return true;
+    }
+
+  public:
+    explicit async_semaphore(std::ptrdiff_t permits) noexcept
+        : count(permits) {
+        assert(permits >= 0);
+    }
+
+    async_semaphore(const async_semaphore&)            = delete;
+    async_semaphore& operator=(const async_semaphore&) = delete;
+
+    bool try_acquire() noexcept {
+        std::ptrdiff_t old = count.load(std::memory_order_relaxed);
+        while (old > 0) {
+            if (count.compare_exchange_weak(old,
+                                            old - 1,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    acquire_awaiter acquire() noexcept { return acquire_awaiter{this}; }
+
+    void release() noexcept {
+        if (count.fetch_add(1, std::memory_order_release) >= 0) {
+            return;
+        }
+
+        acquire_awaiter* w;
+        {
+            std::lock_guard lock{mut};
+            w = head;
+            if (w == nullptr) {
+                ++handed;
+                return;
+            }
+            head = w->next;
+            if (head == nullptr) {
+                tail = nullptr;
+            }
+        }
+        inline_resumption::resume(w->coro);
+    }
+
+    // Permits available, or minus the number of acquirers waiting.
+    std::ptrdiff_t available() const noexcept {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+// coroexample_asyncstacks.cpp                                        -*-C++-*-
+#include <coroexample/asyncstacks.h>
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+// The frames created by one thread. Lists are never freed, as frames can
+// outlive the thread that created them.
+struct _async_frame_list {
+    std::mutex          mut;
+    _async_frame<true>* head{nullptr};
+
+    void link(_async_frame<true>* f) noexcept {
+        std::lock_guard lock{mut};
+        f->next = head;
+        if (head != nullptr) {
+            head->prev = f;
+        }
+        head = f;
+    }
+
+    void unlink(_async_frame<true>* f) noexcept {
+        std::lock_guard lock{mut};
+        if (f->prev != nullptr) {
+            f->prev->next = f->next;
+        } else {
+            head = f->next;
+        }
+        if (f->next != nullptr) {
+            f->next->prev = f->prev;
+        }
+    }
+
+    // Requires the lock.
+    void copy_to(std::vector<const _async_frame<true>*>& frames,
+                 std::vector<async_frame_info>&          infos) const {
+        for (const _async_frame<true>* f = head; f != nullptr; f = f->next) {
+            frames.push_back(f);
+            infos.push_back(async_frame_info{
+                f->coro,
+                f->where,
+                f->label,
+                f->context,
+                f->waiting.load(std::memory_order_relaxed),
+                f->waiting_for.load(std::memory_order_relaxed)});
+        }
+    }
+};
+
+namespace {
+struct async_frame_registry {
+    std::mutex                                      mut;
+    std::vector<std::unique_ptr<_async_frame_list>> lists;
+
+    static async_frame_registry& get() noexcept {
+        static async_frame_registry registry;
+        return registry;
+    }
+
+    static _async_frame_list* local() noexcept {
+        thread_local _async_frame_list* list = nullptr;
+        if (list == nullptr) [[unlikely]] {
+            async_frame_registry& r = get();
+            std::lock_guard       lock{r.mut};
+            r.lists.push_back(std::make_unique<_async_frame_list>());
+            list = r.lists.back().get();
+        }
+        return list;
+    }
+};
+} // namespace
+
+_async_frame<true>::_async_frame(const void*          coro,
+                                 std::source_location where,
+                                 const char*          label,
+                                 const void*          context) noexcept
+    : coro(coro),
+      where(where),
+      label(label),
+      context(context),
+      owner(async_frame_registry::local()) {
+    owner->link(this);
+}
+
+_async_frame<true>::~_async_frame() { owner->unlink(this); }
+
+std::vector<async_stack> capture_async_stacks() {
+    if constexpr (!async_stacks_enabled) {
+        return {};
+    }
+
+    // Copy every entry out with all the lists locked, so that no frame
+    // that another one points to as its parent can go away meanwhile.
+    std::vector<const _async_frame<true>*> frames;
+    std::vector<async_frame_info>          infos;
+    std::vector<const void*>               parents;
+    {
+        async_frame_registry& r = async_frame_registry::get();
+        std::lock_guard       registry_lock{r.mut};
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(r.lists.size());
+        for (const std::unique_ptr<_async_frame_list>& l : r.lists) {
+            locks.emplace_back(l->mut);
+        }
+        for (const std::unique_ptr<_async_frame_list>& l : r.lists) {
+            l->copy_to(frames, infos);
+        }
+        for (const _async_frame<true>* f : frames) {
+            parents.push_back(f->parent.load(std::memory_order_relaxed));
+        }
+    }
+
+    std::unordered_map<const void*, std::size_t> index;
+    std::unordered_set<const void*>              awaited;
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        index.emplace(frames[i], i);
+        if (parents[i] != nullptr) {
+            awaited.insert(parents[i]);
+        }
+    }
+
+    std::vector<async_stack> stacks;
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        if (awaited.contains(frames[i])) {
+            continue;
+        }
+        async_stack& stack = stacks.emplace_back();
+        for (std::size_t j = i;;) {
+            stack.push_back(infos[j]);
+            auto it = index.find(parents[j]);
+            if (it == index.end()) {
+                break;
+            }
+            j = it->second;
+        }
+    }
+    return stacks;
+}
+
+void dump_async_stacks(std::ostream& out) {
+    std::vector<async_stack> stacks = capture_async_stacks();
+    for (std::size_t i = 0; i < stacks.size(); ++i) {
+        out << "async stack " << i + 1 << " (" << stacks[i].size()
+            << (stacks[i].size() == 1 ? " frame):\n" : " frames):\n");
+        for (std::size_t j = 0; j < stacks[i].size(); ++j) {
+            const async_frame_info& f = stacks[i][j];
+            out << "  #" << j << ' ' << f.coro << ' ';
+            if (f.label != nullptr) {
+                out << f.label << " in " << f.context;
+            } else {
+                out << f.where.function_name() << " at "
+                    << f.where.file_name() << ':' << f.where.line();
+            }
+            out << '\n';
+            if (f.waiting != nullptr) {
+                out << "     " << f.waiting;
+                if (f.waiting_for != nullptr) {
+                    out << ' ' << f.waiting_for;
+                }
+                out << '\n';
+            }
+        }
+    }
+}
+
+void dump_async_stacks_to_stderr() { dump_async_stacks(std::cerr); }
@@ -0,0 +1,175 @@
+// coroexample_asyncstacks.h                                          -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_ASYNCSTACKS
+#define INCLUDED_COROEXAMPLE_ASYNCSTACKS
+
+#include <atomic>
+#include <coroutine>
+#include <iosfwd>
+#include <source_location>
+#include <vector>
+
+// Set by the COROEXAMPLE_ENABLE_ASYNC_STACKS CMake option.
+#ifndef COROEXAMPLE_ASYNC_STACKS
+#define COROEXAMPLE_ASYNC_STACKS 0
+#endif
+
+/////////////////////////////////////////////////
+// Async stacks
+//
+// A debugger stopped in a stalled process only sees the threads' real
+// stacks, which end in an event loop's run(); the chains of suspended
+// coroutines, linked through their continuations, are invisible. With
+// COROEXAMPLE_ASYNC_STACKS set to 1, every live `task` frame (and every
+// task spawned into an async_scope) is kept in a registry, so that those
+// chains can be listed:
+//
+//   async stack 1 (3 frames):
+//     #0 0x5581f0 task<int> fetch(key) at server.cpp:40
+//        queued on manual_event_loop 0x7ffd10
+//     #1 0x5581a0 task<void> handle(request) at server.cpp:25
+//     #2 0x558150 async_scope task in 0x7ffd48
+//
+// Each entry is an `async_frame` member of the promise, which records the
+// coroutine's name and source location (captured as a default argument of
+// the promise's constructor, so at the coroutine's definition), the frame
+// awaiting it, and, while it is suspended in manual_event_loop or joining
+// an async_scope, what it is waiting for. Frames are linked into a list
+// per creating thread, so registering and unregistering a frame takes an
+// uncontended lock. `capture_async_stacks()` holds every list's lock only
+// while it copies the entries out, then pieces the chains together from
+// the copy: each frame that no other frame is awaiting starts a stack,
+// which continues through the frames awaiting it.
+//
+// `dump_async_stacks(out)` prints them; from gdb, use
+// `call dump_async_stacks_to_stderr()`.
+//
+// Otherwise async_frame and the wait markers kept in awaitables are empty
+// [[no_unique_address]] members, and the hooks do nothing.
+
+inline constexpr bool async_stacks_enabled = COROEXAMPLE_ASYNC_STACKS != 0;
+
+struct _async_frame_list;
+
+template <bool Enabled>
+struct _async_frame {
+    _async_frame(const void*,
+                 std::source_location,
+                 const char* = nullptr,
+                 const void* = nullptr) noexcept {}
+
+    void set_parent(const _async_frame*) noexcept {}
+    void set_waiting(const char*, const void*) noexcept {}
+    void clear_waiting() noexcept {}
+};
+
+template <>
+struct _async_frame<true> {
+    // 'label' and 'context' describe frames with no useful source
+    // location, such as the wrapper of a task spawned into a scope.
+    _async_frame(const void*          coro,
+                 std::source_location where,
+                 const char*          label   = nullptr,
+                 const void*          context = nullptr) noexcept;
+
+    _async_frame(const _async_frame&)            = delete;
+    _async_frame& operator=(const _async_frame&) = delete;
+
+    ~_async_frame();
+
+    void set_parent(const _async_frame* p) noexcept {
+        parent.store(p, std::memory_order_relaxed);
+    }
+
+    // 'what' must be a string literal.
+    void set_waiting(const char* what, const void* on) noexcept {
+        waiting_for.store(on, std::memory_order_relaxed);
+        waiting.store(what, std::memory_order_relaxed);
+    }
+
+    void clear_waiting() noexcept {
+        waiting.store(nullptr, std::memory_order_relaxed);
+    }
+
+    const void*                      coro;
+    std::source_location             where;
+    const char*                      label;
+    const void*                      context;
+    std::atomic<const _async_frame*> parent{nullptr}; // awaiting this one
+    std::atomic<const char*>         waiting{nullptr};
+    std::atomic<const void*>         waiting_for{nullptr};
+
+  private:
+    friend struct _async_frame_list;
+
+    _async_frame*      prev{nullptr};
+    _async_frame*      next{nullptr};
+    _async_frame_list* owner;
+};
+
+using async_frame = _async_frame<async_stacks_enabled>;
+
+// The async_frame of the coroutine 'h', or null if its promise has none.
+template <typename Promise>
+async_frame* async_frame_of(std::coroutine_handle<Promise> h) noexcept {
+    if constexpr (requires { h.promise().stack_frame; }) {
+        return &h.promise().stack_frame;
+    } else {
+        return nullptr;
+    }
+}
+
+// Kept by an awaitable to mark its coroutine as waiting on something
+// between await_suspend() and await_resume().
+template <bool Enabled>
+struct _async_wait {
+    template <typename Promise>
+    void begin(std::coroutine_handle<Promise>,
+               const char*,
+               const void*) noexcept {}
+    void end() noexcept {}
+};
+
+template <>
+struct _async_wait<true> {
+    async_frame* frame{nullptr};
+
+    template <typename Promise>
+    void begin(std::coroutine_handle<Promise> h,
+               const char*                    what,
+               const void*                    on) noexcept {
+        frame = async_frame_of(h);
+        if (frame != nullptr) {
+            frame->set_waiting(what, on);
+        }
+    }
+
+    void end() noexcept {
+        if (frame != nullptr) {
+            frame->clear_waiting();
+        }
+    }
+};
+
+using async_wait = _async_wait<async_stacks_enabled>;
+
+// A copy of one registered frame.
+struct async_frame_info {
+    const void*          coro;
+    std::source_location where;
+    const char*          label;
+    const void*          context;
+    const char*          waiting;     // null unless marked as waiting
+    const void*          waiting_for;
+};
+
+// Innermost frame first.
+using async_stack = std::vector<async_frame_info>;
+
+// Every live chain, or nothing unless async stacks are enabled.
+std::vector<async_stack> capture_async_stacks();
+
+void dump_async_stacks(std::ostream& out);
+
+void dump_async_stacks_to_stderr();
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_cancellation.cpp                                       -*-C++-*-
+#include <coroexample/cancellation.h>
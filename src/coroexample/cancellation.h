@@ -0,0 +1,89 @@
+// coroexample_cancellation.h                                         -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_CANCELLATION
+#define INCLUDED_COROEXAMPLE_CANCELLATION
+
+#include <coroutine>
+#include <exception>
+#include <stop_token>
+#include <type_traits>
+
+///////////////////////////////////////////////////
+// Cooperative cancellation
+//
+// Coroutines see a std::stop_token that flows implicitly from parent to
+// child: promise types that derive from `stop_token_promise` hold a pointer
+// to the token of whatever started them, and when a task is awaited its
+// promise is given the awaiting coroutine's pointer. The token itself is
+// owned by the root of the tree - e.g. an async_scope, or a when_any() that
+// cancels the losers - which outlives every coroutine that refers to it,
+// so passing it down costs a pointer copy per await and nothing else.
+//
+// Awaitables that can be cancelled (the manual_event_loop schedule and
+// timer awaitables) look up the token of the coroutine awaiting them in
+// await_suspend(). If stop has been requested, they complete by throwing
+// `operation_cancelled` from await_resume(); a pending timer is unlinked
+// from the timer queue as soon as stop is requested. Coroutines with no
+// token, or a token that can never be stopped, never register a stop
+// callback.
+//
+// Any coroutine can check for itself with:
+//
+//   std::stop_token st = co_await current_stop_token();
+
+struct operation_cancelled : std::exception {
+    const char* what() const noexcept override {
+        return "operation cancelled";
+    }
+};
+
+struct stop_token_promise {
+    // Null if the coroutine has no stop token.
+    const std::stop_token* stop{nullptr};
+};
+
+// The stop token of the coroutine 'h', or null if it has none.
+template <typename Promise>
+const std::stop_token*
+get_stop_token(std::coroutine_handle<Promise> h) noexcept {
+    if constexpr (std::is_base_of_v<stop_token_promise, Promise>) {
+        return h.promise().stop;
+    } else {
+        return nullptr;
+    }
+}
+
+// True if the coroutine 'h' has been asked to stop.
+template <typename Promise>
+bool stop_requested(std::coroutine_handle<Promise> h) noexcept {
+    const std::stop_token* st = get_stop_token(h);
+    return st != nullptr && st->stop_requested();
+}
+
+// Whether 'e' reports cancellation rather than failure.
+inline bool is_cancellation(const std::exception_ptr& e) noexcept {
+    try {
+        std::rethrow_exception(e);
+    } catch (const operation_cancelled&) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+struct current_stop_token {
+    const std::stop_token* stop{nullptr};
+
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        stop = get_stop_token(h);
+        return false;
+    }
+
+    std::stop_token await_resume() noexcept {
+        return stop != nullptr ? *stop : std::stop_token{};
+    }
+};
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_channel.cpp                                            -*-C++-*-
+#include <coroexample/channel.h>
@@ -0,0 +1,356 @@
+// coroexample_channel.h                                              -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_CHANNEL
+#define INCLUDED_COROEXAMPLE_CHANNEL
+
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <utility>
+
+#include <coroexample/inlineresumption.h>
+
+/////////////////////////////////////////////////
+// channel<T, Capacity>
+//
+// A bounded multi-producer/multi-consumer queue for connecting coroutines,
+// e.g. the stages of a pipeline:
+//
+//   channel<item, 64> ch;
+//
+//   co_await ch.send(std::move(x));              // suspends while full
+//   std::optional<item> y = co_await ch.receive(); // suspends while empty
+//
+// Elements live in a fixed ring buffer inside the channel. A coroutine
+// that has to wait is linked into an intrusive list through a node in its
+// awaiter, so neither sending, receiving nor waiting allocates.
+//
+// `send_n()` and `receive_n()` move a whole span per lock acquisition.
+// send_n() completes once every element has been accepted into the
+// buffer; receive_n() completes as soon as at least one element is
+// available, with as many as are buffered and fit.
+//
+// `close()` ends the stream: senders still waiting, and any later sends,
+// fail (send() returns false, send_n() the number accepted), while
+// receivers drain what is left in the buffer and then get an empty
+// optional, or zero from receive_n().
+//
+// A coroutine waiting in the channel is resumed on the thread whose send,
+// receive or close let it continue, from inside that call, after the
+// channel's lock has been released (or, if resumptions are already
+// nested too deeply on that thread, once they unwind; see
+// inlineresumption.h). To move work onto a particular scheduler,
+// `co_await sched.schedule()` after the channel operation.
+
+template <typename T, std::size_t Capacity>
+struct channel {
+    static_assert(Capacity > 0, "a channel needs room for one element");
+
+  private:
+    struct waiter {
+        waiter*                 next{nullptr};
+        std::coroutine_handle<> coro;
+    };
+
+    struct send_waiter : waiter {
+        T*          values{nullptr};
+        std::size_t size{0};
+        std::size_t sent{0};
+        bool        failed{false};
+    };
+
+    struct receive_waiter : waiter {
+        std::optional<T>* single{nullptr}; // receive()
+        T*                out{nullptr};    // receive_n()
+        std::size_t       capacity{0};
+        std::size_t       received{0};
+
+        void deliver(T&& value) {
+            if (single != nullptr) {
+                single->emplace(std::move(value));
+            } else {
+                out[received] = std::move(value);
+            }
+            ++received;
+        }
+    };
+
+    // Intrusive FIFO of waiters.
+    template <typename W>
+    struct waiter_list {
+        W* head{nullptr};
+        W* tail{nullptr};
+
+        void push(W* w) noexcept {
+            w->next = nullptr;
+            if (head == nullptr) {
+                head = w;
+            } else {
+                tail->next = w;
+            }
+            tail = w;
+        }
+
+        W* pop() noexcept {
+            W* front = head;
+            head     = static_cast<W*>(front->next);
+            if (head == nullptr) {
+                tail = nullptr;
+            }
+            return front;
+        }
+
+        waiter* take_all() noexcept {
+            waiter* all = head;
+            head = tail = nullptr;
+            return all;
+        }
+    };
+
+    std::mutex                  mut;
+    waiter_list<send_waiter>    senders;   // only while the buffer is full
+    waiter_list<receive_waiter> receivers; // only while it is empty
+    std::size_t                 first{0};
+    std::size_t                 count{0};
+    bool                        closed{false};
+
+    alignas(T) unsigned char storage[Capacity][sizeof(T)];
+
+    T* slot(std::size_t i) noexcept {
+        return std::launder(
+            reinterpret_cast<T*>(storage[(first + i) % Capacity]));
+    }
+
+    void push_value(T&& value) {
+        ::new (static_cast<void*>(storage[(first + count) % Capacity]))
+            T(std::move(value));
+        ++count;
+    }
+
+    T pop_value() {
+        T* p     = slot(0);
+        T  value = std::move(*p);
+        p->~T();
+        first = (first + 1) % Capacity;
+        --count;
+        return value;
+    }
+
+    // Moves elements from waiting senders into the buffer and from the
+    // buffer to waiting receivers until neither can make progress.
+    // Waiters that are now finished are linked onto 'done'. Requires the
+    // lock.
+    void transfer(waiter*& done) {
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            while (count > 0 && receivers.head != nullptr) {
+                receive_waiter* r = receivers.head;
+                while (count > 0 && r->received < r->capacity) {
+                    r->deliver(pop_value());
+                }
+                receivers.pop();
+                r->next  = done;
+                done     = r;
+                progress = true;
+            }
+            while (count < Capacity && senders.head != nullptr) {
+                send_waiter* s = senders.head;
+                while (count < Capacity && s->sent < s->size) {
+                    push_value(std::move(s->values[s->sent++]));
+                }
+                if (s->sent == s->size) {
+                    senders.pop();
+                    s->next = done;
+                    done    = s;
+                }
+                progress = true;
+            }
+        }
+    }
+
+    // Resumes everything on 'done' except 'self', which is still running.
+    static void resume_all(waiter* done, waiter* self) {
+        while (done != nullptr) {
+            // Read 'next' first: resuming destroys the awaiter.
+            waiter* next = done->next;
+            if (done != self) {
+                inline_resumption::resume(done->coro);
+            }
+            done = next;
+        }
+    }
+
+    // Returns true if the sender has to wait.
+    bool start_send(send_waiter* self) {
+        waiter* done = nullptr;
+        bool    wait;
+        {
+            std::lock_guard lock{mut};
+            if (closed) {
+                self->failed = true;
+                return false;
+            }
+            senders.push(self);
+            transfer(done);
+            wait = self->sent < self->size;
+        }
+        resume_all(done, self);
+        return wait;
+    }
+
+    // Returns true if the receiver has to wait.
+    bool start_receive(receive_waiter* self) {
+        waiter* done = nullptr;
+        bool    wait;
+        {
+            std::lock_guard lock{mut};
+            receivers.push(self);
+            transfer(done);
+            wait = self->received == 0;
+            if (wait && closed) {
+                // Closed and drained. Nothing else can be waiting: close()
+                // woke everyone, and later receivers never stay.
+                receivers.pop();
+                wait = false;
+            }
+        }
+        resume_all(done, self);
+        return wait;
+    }
+
+    struct send_awaitable {
+        channel*    ch;
+        T           value;
+        send_waiter node;
+
+        bool await_ready() noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> coro) {
+            node.coro   = coro;
+            node.values = std::addressof(value);
+            node.size   = 1;
+            return ch->start_send(&node);
+        }
+
+        bool await_resume() noexcept { return !node.failed; }
+    };
+
+    struct send_n_awaitable {
+        channel*    ch;
+        send_waiter node;
+
+        bool await_ready() noexcept { return node.size == 0; }
+
+        bool await_suspend(std::coroutine_handle<> coro) {
+            node.coro = coro;
+            return ch->start_send(&node);
+        }
+
+        std::size_t await_resume() noexcept { return node.sent; }
+    };
+
+    struct receive_awaitable {
+        channel*         ch;
+        std::optional<T> result;
+        receive_waiter   node;
+
+        bool await_ready() noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> coro) {
+            node.coro     = coro;
+            node.single   = std::addressof(result);
+            node.capacity = 1;
+            return ch->start_receive(&node);
+        }
+
+        std::optional<T> await_resume() { return std::move(result); }
+    };
+
+    struct receive_n_awaitable {
+        channel*       ch;
+        receive_waiter node;
+
+        bool await_ready() noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> coro) {
+            node.coro = coro;
+            return ch->start_receive(&node);
+        }
+
+        std::size_t await_resume() noexcept { return node.received; }
+    };
+
+  public:
+    channel() = default;
+
+    channel(const channel&)            = delete;
+    channel& operator=(const channel&) = delete;
+
+    ~channel() {
+        for (std::size_t i = 0; i < count; ++i) {
+            std::destroy_at(slot(i));
+        }
+    }
+
+    static constexpr std::size_t capacity() noexcept { return Capacity; }
+
+    // Resumes with false if the channel was closed before 'value' could
+    // be accepted.
+    send_awaitable send(T value) {
+        return send_awaitable{this, std::move(value), {}};
+    }
+
+    // Moves from 'values' and resumes with how many were accepted, which
+    // is less than values.size() only if the channel was closed. 'values'
+    // must stay alive until then.
+    send_n_awaitable send_n(std::span<T> values) noexcept {
+        send_n_awaitable a{this, {}};
+        a.node.values = values.data();
+        a.node.size   = values.size();
+        return a;
+    }
+
+    // Resumes with the next element, or an empty optional once the
+    // channel is closed and empty.
+    receive_awaitable receive() noexcept {
+        return receive_awaitable{this, std::nullopt, {}};
+    }
+
+    // Resumes with the number of elements assigned to the front of 'out':
+    // at least one, or zero once the channel is closed and empty. 'out'
+    // must not be empty, as zero would then be ambiguous.
+    receive_n_awaitable receive_n(std::span<T> out) noexcept {
+        assert(!out.empty());
+        receive_n_awaitable a{this, {}};
+        a.node.out      = out.data();
+        a.node.capacity = out.size();
+        return a;
+    }
+
+    // Fails waiting and future sends and wakes waiting receivers once the
+    // buffer is drained. Elements already buffered can still be received.
+    void close() {
+        waiter* failed;
+        waiter* drained;
+        {
+            std::lock_guard lock{mut};
+            closed = true;
+            failed = senders.take_all();
+            for (waiter* w = failed; w != nullptr; w = w->next) {
+                static_cast<send_waiter*>(w)->failed = true;
+            }
+            // Receivers only wait on an empty buffer, and nothing can be
+            // sent any more.
+            drained = receivers.take_all();
+        }
+        resume_all(failed, nullptr);
+        resume_all(drained, nullptr);
+    }
+};
+
+#endif
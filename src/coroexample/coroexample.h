@@ -83,6 +83,23 @@
 
 // And some other helpers:
 // - `lazy_task` - useful for improving coroutine allocation-elision
+// - `frame_pool` / `frame_arena` - coroutine frame allocation strategies
+// - `inline_task` - a task with a fast path for synchronous completion
+// - `affine_task` - a task that resumes on its own scheduler after awaits
+// - `generator` / `async_generator` - lazily produced sequences
+// - `when_all` / `when_any` - concurrent fan-out of several awaitables
+// - `channel` - bounded queue with suspending send/receive
+// - `async_mutex` / `async_semaphore` / `async_manual_reset_event` /
+//   `async_latch` - synchronisation that suspends instead of blocking
+// - `operation_cancelled` / `current_stop_token` - cooperative cancellation
+// - `inline_resumption` - bounds nested resumption of released waiters
+// - `sharded_async_scope` - an async_scope for spawning from many threads
+// - `nursery` - an async_scope with child stats and a join deadline
+// - `static_thread_pool` - NUMA-aware pool that owns and pins its workers
+// - `single_consumer_event_loop` - lock-free loop for one run() thread
+// - `latency_histogram` / `write_chrome_trace` - optional hot-path tracing
+// - `print_frame_sizes` / `frames_over_budget` - optional frame size report
+// - `dump_async_stacks` - optional listing of suspended task chains
 // - `scope_guard`
 //
 //
@@ -95,9 +112,30 @@
 /////////////////////////////////////////////////////////////////////////
 
 #include <coroexample/generalhelper.h>
+#include <coroexample/tracing.h>
+#include <coroexample/asyncstacks.h>
 #include <coroexample/helper.h>
+#include <coroexample/cancellation.h>
+#include <coroexample/frameallocator.h>
+#include <coroexample/framestats.h>
+#include <coroexample/inlineresumption.h>
 #include <coroexample/task.h>
+#include <coroexample/currentscheduler.h>
+#include <coroexample/affinetask.h>
+#include <coroexample/inlinetask.h>
+#include <coroexample/generator.h>
 #include <coroexample/asyncscope.h>
+#include <coroexample/nursery.h>
 #include <coroexample/syncwait.h>
+#include <coroexample/whenall.h>
+#include <coroexample/channel.h>
+#include <coroexample/asyncmutex.h>
+#include <coroexample/asyncsemaphore.h>
+#include <coroexample/asyncevent.h>
+#include <coroexample/timerqueue.h>
 #include <coroexample/manualeventloop.h>
+#include <coroexample/singleconsumereventloop.h>
+#include <coroexample/iouringeventloop.h>
 #include <coroexample/lazytask.h>
+#include <coroexample/workstealingscheduler.h>
+#include <coroexample/staticthreadpool.h>
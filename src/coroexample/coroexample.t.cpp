@@ -2,6 +2,1594 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 TEST(CoroexampleTest, TestGTest) { ASSERT_EQ(1, 1); }
 
 TEST(CoroexampleTest, Breathing) {}
+
+namespace {
+template <typename Scheduler>
+task<int> on_scheduler(Scheduler& sched, std::atomic<int>& count, int i) {
+    co_await sched.schedule();
+    count.fetch_add(1, std::memory_order_relaxed);
+    co_return i;
+}
+
+template <typename Scheduler>
+task<void> count_on(Scheduler& sched, std::atomic<int>& count) {
+    co_await on_scheduler(sched, count, 0);
+}
+
+template <typename Scheduler>
+task<void> fan_out(Scheduler& sched, std::atomic<int>& count, int n) {
+    co_await sched.schedule();
+
+    async_scope scope;
+    for (int i = 0; i < n; ++i) {
+        scope.spawn_detached(count_on(sched, count));
+    }
+    co_await scope.join_async();
+}
+} // namespace
+
+TEST(WorkStealingSchedulerTest, ForeignThreadSchedule) {
+    work_stealing_scheduler sched{2};
+    std::jthread            t1{[&](std::stop_token st) { sched.run(st); }};
+    std::jthread            t2{[&](std::stop_token st) { sched.run(st); }};
+
+    std::atomic<int> count{0};
+    EXPECT_EQ(42, sync_wait(on_scheduler(sched, count, 42)));
+    EXPECT_EQ(1, count.load());
+}
+
+TEST(WorkStealingSchedulerTest, FanOutRunsEveryTaskOnce) {
+    constexpr int             workers = 4;
+    work_stealing_scheduler   sched{workers};
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back([&](std::stop_token st) { sched.run(st); });
+    }
+
+    std::atomic<int> count{0};
+    sync_wait(fan_out(sched, count, 10000));
+    EXPECT_EQ(10000, count.load());
+}
+
+TEST(WorkStealingSchedulerTest, RunningMoreWorkersThanSlotsThrows) {
+    work_stealing_scheduler sched{1};
+    std::stop_source        stopped;
+    stopped.request_stop();
+
+    sched.run(stopped.get_token());
+    EXPECT_THROW(sched.run(stopped.get_token()), std::logic_error);
+}
+
+namespace {
+task<int> chain_f(int i) { co_return i; }
+
+task<int> chain_g(int i) {
+    int x = co_await chain_f(i);
+    co_return x + 1;
+}
+
+task<int> chain_h(int i) {
+    int x = co_await chain_g(i);
+    co_return x + 1;
+}
+
+task<int> arena_child(std::allocator_arg_t,
+                      std::pmr::polymorphic_allocator<>,
+                      int i) {
+    co_return i * 2;
+}
+
+task<int> arena_parent(std::allocator_arg_t,
+                       std::pmr::polymorphic_allocator<> alloc,
+                       int                               i) {
+    co_return co_await arena_child(std::allocator_arg, alloc, i) + 1;
+}
+} // namespace
+
+TEST(FrameAllocatorTest, WarmPoolAvoidsHeap) {
+    EXPECT_EQ(3, sync_wait(chain_h(1)));
+
+    frame_allocator_stats before = frame_pool::stats();
+    EXPECT_EQ(3, sync_wait(chain_h(1)));
+    frame_allocator_stats after = frame_pool::stats();
+
+    EXPECT_EQ(before.pool_misses, after.pool_misses);
+    EXPECT_EQ(before.oversize, after.oversize);
+    // Up to three frames, fewer if the compiler elided any of them.
+    EXPECT_LE(after.pool_hits - before.pool_hits, 3u);
+    EXPECT_EQ(after.pool_hits - before.pool_hits,
+              after.deallocations - before.deallocations);
+}
+
+TEST(FrameAllocatorTest, ArenaAllocatesWholeTree) {
+    alignas(std::max_align_t) std::byte buffer[4096];
+    frame_arena                         arena{buffer};
+
+    frame_allocator_stats before = frame_pool::stats();
+    EXPECT_EQ(5, sync_wait(arena_parent(std::allocator_arg, &arena, 2)));
+    frame_allocator_stats after = frame_pool::stats();
+
+    EXPECT_EQ(before.resource_allocs + 2, after.resource_allocs);
+    EXPECT_EQ(before.pool_hits, after.pool_hits);
+    EXPECT_EQ(before.pool_misses, after.pool_misses);
+    EXPECT_GT(arena.used(), 0u);
+    EXPECT_EQ(0u, arena.overflow_count());
+
+    arena.reset();
+    EXPECT_EQ(0u, arena.used());
+}
+
+namespace {
+struct no_default {
+    explicit no_default(int v) : v(v) {}
+    int v;
+};
+
+inline_task<no_default> inline_leaf(int i) { co_return no_default{i}; }
+
+inline_task<int> inline_sum(int n) {
+    int total = 0;
+    for (int i = 0; i < n; ++i) {
+        total += (co_await inline_leaf(1)).v;
+    }
+    co_return total;
+}
+
+inline_task<int> inline_on_loop(manual_event_loop& loop, int i) {
+    co_await loop.schedule();
+    co_return i;
+}
+
+inline_task<int> inline_await_loop(manual_event_loop& loop, int i) {
+    co_return co_await inline_on_loop(loop, i) + 1;
+}
+
+inline_task<void> inline_throws() {
+    throw std::runtime_error("inline");
+    co_return;
+}
+} // namespace
+
+TEST(InlineTaskTest, SynchronousCompletionDoesNotGrowStack) {
+    EXPECT_EQ(1'000'000, sync_wait(inline_sum(1'000'000)));
+}
+
+TEST(InlineTaskTest, AsynchronousCompletion) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    EXPECT_EQ(8, sync_wait(inline_await_loop(loop, 7)));
+}
+
+TEST(InlineTaskTest, ExceptionPropagates) {
+    EXPECT_THROW(sync_wait(inline_throws()), std::runtime_error);
+}
+
+namespace {
+task<void> wake_after(manual_event_loop&        loop,
+                      std::chrono::milliseconds delay,
+                      int                       id,
+                      std::mutex&               mut,
+                      std::vector<int>&         order) {
+    co_await loop.schedule_after(delay);
+    std::lock_guard lock{mut};
+    order.push_back(id);
+}
+
+task<void> sleep_all(manual_event_loop& loop,
+                     std::mutex&        mut,
+                     std::vector<int>&  order) {
+    using namespace std::chrono_literals;
+    async_scope scope;
+    scope.spawn_detached(wake_after(loop, 30ms, 3, mut, order));
+    scope.spawn_detached(wake_after(loop, 10ms, 1, mut, order));
+    scope.spawn_detached(wake_after(loop, 20ms, 2, mut, order));
+    co_await scope.join_async();
+}
+} // namespace
+
+TEST(TimerQueueTest, PopsInDeadlineOrderAndRemoves) {
+    using namespace std::chrono_literals;
+    auto                    base = timer_node::clock::now();
+    std::vector<timer_node> nodes(64);
+    timer_queue             queue;
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i].deadline = base + std::chrono::milliseconds((i * 37) % 64);
+        queue.push(&nodes[i]);
+    }
+    for (std::size_t i = 0; i < nodes.size(); i += 3) {
+        queue.remove(&nodes[i]);
+    }
+
+    auto last = base - 1ms;
+    int  n    = 0;
+    while (!queue.empty()) {
+        timer_node* node = queue.pop();
+        EXPECT_LE(last, node->deadline);
+        EXPECT_NE(0u, (node - nodes.data()) % 3);
+        last = node->deadline;
+        ++n;
+    }
+    EXPECT_EQ(42, n);
+}
+
+TEST(ManualEventLoopTest, ScheduleAfterWakesInDeadlineOrder) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    std::mutex       mut;
+    std::vector<int> order;
+    auto             start = manual_event_loop::clock::now();
+    sync_wait(sleep_all(loop, mut, order));
+
+    EXPECT_GE(manual_event_loop::clock::now() - start,
+              std::chrono::milliseconds(30));
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), order);
+}
+
+namespace {
+task<std::size_t> pipe_round_trip(io_uring_event_loop& loop,
+                                  int                  rd,
+                                  int                  wr,
+                                  std::string&         out) {
+    co_await loop.schedule();
+
+    const char msg[] = "hello";
+    co_await loop.write(wr, std::as_bytes(std::span{msg, 5}));
+
+    char        buf[16];
+    std::size_t n =
+        co_await loop.read(rd, std::as_writable_bytes(std::span{buf}));
+    out.assign(buf, n);
+    co_return n;
+}
+
+task<void> socket_echo(io_uring_event_loop& loop, std::string& out) {
+    co_await loop.schedule();
+
+    int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    ::listen(listener, 1);
+    socklen_t len = sizeof(addr);
+    ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len);
+
+    int client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    async_scope scope;
+    int         server = -1;
+    scope.spawn_detached([](io_uring_event_loop& loop,
+                            int                  listener,
+                            int&                 server) -> task<void> {
+        server = co_await loop.accept(listener);
+    }(loop, listener, server));
+
+    co_await loop.connect(
+        client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    co_await scope.join_async();
+
+    const char msg[] = "ping";
+    co_await loop.send(client, std::as_bytes(std::span{msg, 4}));
+    char        buf[16];
+    std::size_t n =
+        co_await loop.recv(server, std::as_writable_bytes(std::span{buf}));
+    out.assign(buf, n);
+
+    ::close(server);
+    ::close(client);
+    ::close(listener);
+}
+
+task<void> write_byte(io_uring_event_loop& loop, int wr) {
+    const char c = 'x';
+    co_await loop.write(wr, std::as_bytes(std::span{&c, 1}));
+}
+
+// Starts more writes than the ring has room for without suspending in
+// between, so that submitting them has to make space.
+task<void> write_bytes(io_uring_event_loop& loop, int wr, int count) {
+    co_await loop.schedule();
+    async_scope scope;
+    for (int i = 0; i < count; ++i) {
+        scope.spawn_detached(write_byte(loop, wr));
+    }
+    co_await scope.join_async();
+}
+
+task<void> read_bad_fd(io_uring_event_loop& loop) {
+    co_await loop.schedule();
+    char buf[4];
+    co_await loop.read(-1, std::as_writable_bytes(std::span{buf}));
+}
+} // namespace
+
+TEST(IoUringEventLoopTest, PipeReadWrite) {
+    io_uring_event_loop loop;
+    std::jthread        thd{[&](std::stop_token st) { loop.run(st); }};
+
+    int fds[2];
+    ASSERT_EQ(0, ::pipe(fds));
+    std::string out;
+    EXPECT_EQ(5u, sync_wait(pipe_round_trip(loop, fds[0], fds[1], out)));
+    EXPECT_EQ("hello", out);
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+TEST(IoUringEventLoopTest, LoopbackAcceptConnectSendRecv) {
+    io_uring_event_loop loop;
+    std::jthread        thd{[&](std::stop_token st) { loop.run(st); }};
+
+    std::string out;
+    sync_wait(socket_echo(loop, out));
+    EXPECT_EQ("ping", out);
+}
+
+TEST(IoUringEventLoopTest, MoreOperationsThanRingEntries) {
+    io_uring_event_loop loop{4};
+    std::jthread        thd{[&](std::stop_token st) { loop.run(st); }};
+
+    int fds[2];
+    ASSERT_EQ(0, ::pipe(fds));
+    sync_wait(write_bytes(loop, fds[1], 64));
+
+    char    buf[128];
+    ssize_t n = ::read(fds[0], buf, sizeof(buf));
+    EXPECT_EQ(64, n);
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+TEST(IoUringEventLoopTest, ErrorsThrowSystemError) {
+    io_uring_event_loop loop;
+    std::jthread        thd{[&](std::stop_token st) { loop.run(st); }};
+
+    EXPECT_THROW(sync_wait(read_bad_fd(loop)), std::system_error);
+}
+
+TEST(ManualEventLoopTest, RunBatchedResumesEverything) {
+    manual_event_loop loop;
+    std::atomic<int>  count{0};
+    {
+        std::jthread t1{[&](std::stop_token st) { loop.run_batched(st); }};
+        std::jthread t2{[&](std::stop_token st) { loop.run_batched(st); }};
+        sync_wait(fan_out(loop, count, 1000));
+    }
+    EXPECT_EQ(1000, count.load());
+
+    // One schedule() for fan_out itself plus one per child.
+    manual_event_loop::loop_stats stats = loop.stats();
+    EXPECT_EQ(1001u, stats.batch_items);
+    EXPECT_GE(stats.batches, 1u);
+    EXPECT_LE(stats.wakeups, stats.sleeps + 1);
+}
+
+namespace {
+task<std::string> delayed_string(manual_event_loop&        loop,
+                                 std::chrono::milliseconds delay,
+                                 std::string               s) {
+    co_await loop.schedule_after(delay);
+    co_return s;
+}
+
+task<int> delayed_int(manual_event_loop&        loop,
+                      std::chrono::milliseconds delay,
+                      int                       i) {
+    co_await loop.schedule_after(delay);
+    co_return i;
+}
+
+task<void> delayed_throw(manual_event_loop&        loop,
+                         std::chrono::milliseconds delay) {
+    co_await loop.schedule_after(delay);
+    throw std::runtime_error("when_all child");
+}
+
+task<int> gather_on(work_stealing_scheduler& sched,
+                    std::atomic<int>&        count,
+                    int                      n) {
+    std::vector<task<int>> tasks;
+    for (int i = 0; i < n; ++i) {
+        tasks.push_back(on_scheduler(sched, count, i));
+    }
+    std::vector<int> results = co_await when_all(std::move(tasks));
+
+    int sum = 0;
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(i, results[i]);
+        sum += results[i];
+    }
+    co_return sum;
+}
+} // namespace
+
+TEST(WhenAllTest, VariadicMixedResults) {
+    using namespace std::chrono_literals;
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    auto [s, v, i] = sync_wait(when_all(delayed_string(loop, 20ms, "a"),
+                                        loop.schedule(),
+                                        chain_f(7)));
+    EXPECT_EQ("a", s);
+    EXPECT_EQ(std::monostate{}, v);
+    EXPECT_EQ(7, i);
+
+    // Everything completes synchronously: no suspension at all.
+    auto [x, y] = sync_wait(when_all(chain_f(1), chain_f(2)));
+    EXPECT_EQ(3, x + y);
+}
+
+TEST(WhenAllTest, RangeFanOutOnWorkStealingScheduler) {
+    constexpr int             workers = 4;
+    work_stealing_scheduler   sched{workers};
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back([&](std::stop_token st) { sched.run(st); });
+    }
+
+    std::atomic<int> count{0};
+    EXPECT_EQ(1000 * 999 / 2, sync_wait(gather_on(sched, count, 1000)));
+    EXPECT_EQ(1000, count.load());
+    EXPECT_TRUE(sync_wait(when_all(std::vector<task<int>>{})).empty());
+}
+
+TEST(WhenAllTest, ExceptionRethrownAfterAllComplete) {
+    using namespace std::chrono_literals;
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    auto start = manual_event_loop::clock::now();
+    EXPECT_THROW(sync_wait(when_all(delayed_throw(loop, 1ms),
+                                    delayed_int(loop, 30ms, 1))),
+                 std::runtime_error);
+    EXPECT_GE(manual_event_loop::clock::now() - start, 30ms);
+}
+
+TEST(WhenAnyTest, ReturnsFirstToComplete) {
+    using namespace std::chrono_literals;
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    auto winner = sync_wait(when_any(delayed_int(loop, 30ms, 1),
+                                     delayed_string(loop, 1ms, "fast")));
+    ASSERT_EQ(1u, winner.index());
+    EXPECT_EQ("fast", std::get<1>(winner));
+
+    std::vector<task<int>> tasks;
+    tasks.push_back(delayed_int(loop, 30ms, 10));
+    tasks.push_back(delayed_int(loop, 20ms, 20));
+    tasks.push_back(delayed_int(loop, 1ms, 30));
+    when_any_result<int> first = sync_wait(when_any(std::move(tasks)));
+    EXPECT_EQ(2u, first.index);
+    EXPECT_EQ(30, first.value);
+}
+
+namespace {
+task<int> speculate(manual_event_loop& loop, std::atomic<int>& count) {
+    using namespace std::chrono_literals;
+    async_scope scope;
+
+    auto slow  = scope.spawn_future(delayed_int(loop, 20ms, 1));
+    auto fast  = scope.spawn_future(chain_f(2)); // completes synchronously
+    auto fails = scope.spawn_future(delayed_throw(loop, 1ms));
+    {
+        // Dropped unawaited: must still run and be joined.
+        auto dropped = scope.spawn_future(count_on(loop, count));
+    }
+
+    int sum = co_await std::move(fast);
+    sum += co_await std::move(slow);
+    EXPECT_THROW(co_await std::move(fails), std::runtime_error);
+
+    co_await scope.join_async();
+    co_return sum;
+}
+
+task<void> collect_first(manual_event_loop& loop) {
+    using namespace std::chrono_literals;
+    async_scope scope{async_scope::collect_exceptions};
+    scope.spawn_detached(delayed_throw(loop, 1ms));
+    scope.spawn_detached(delayed_int(loop, 10ms, 1));
+    {
+        auto dropped = scope.spawn_future(delayed_throw(loop, 5ms));
+    }
+    co_await scope.join_async();
+}
+} // namespace
+
+TEST(AsyncScopeTest, SpawnFutureDeliversResultsAndExceptions) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    std::atomic<int> count{0};
+    EXPECT_EQ(3, sync_wait(speculate(loop, count)));
+    EXPECT_EQ(1, count.load());
+}
+
+TEST(AsyncScopeTest, JoinRethrowsCollectedException) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    EXPECT_THROW(sync_wait(collect_first(loop)), std::runtime_error);
+}
+
+namespace {
+task<int> hop_and_return(manual_event_loop& loop, int i) {
+    co_await loop.schedule();
+    co_return i;
+}
+
+// Each future is awaited on one loop thread while its task may be
+// completing on the other.
+task<int> await_racing_futures(manual_event_loop& loop, int n) {
+    async_scope scope;
+    int         sum = 0;
+    for (int i = 0; i < n; ++i) {
+        auto f = scope.spawn_future(hop_and_return(loop, 1));
+        sum += co_await std::move(f);
+    }
+    co_await scope.join_async();
+    co_return sum;
+}
+
+task<int> wait_then_return(async_manual_reset_event& event,
+                           std::shared_ptr<int>      owned) {
+    co_await event;
+    co_return *owned;
+}
+
+task<void> drop_failed_future() {
+    async_scope scope{async_scope::collect_exceptions};
+    {
+        // Fails synchronously, so it has completed when dropped.
+        auto dropped = scope.spawn_future(inline_throws());
+    }
+    co_await scope.join_async();
+}
+} // namespace
+
+TEST(AsyncScopeTest, FutureAwaitedWhileCompletingOnAnotherThread) {
+    manual_event_loop loop;
+    std::jthread      thd1{[&](std::stop_token st) { loop.run(st); }};
+    std::jthread      thd2{[&](std::stop_token st) { loop.run(st); }};
+
+    EXPECT_EQ(10000, sync_wait(await_racing_futures(loop, 10000)));
+}
+
+TEST(AsyncScopeTest, FutureCompletingBeforeItsAwaiterSuspendsIsFreed) {
+    auto                     owned = std::make_shared<int>(7);
+    async_manual_reset_event event;
+    async_scope              scope;
+    {
+        auto f = scope.spawn_future(wait_then_return(event, owned));
+
+        // Stepped by hand, so that the task completes between await_ready()
+        // and await_suspend().
+        auto a = std::move(f).operator co_await();
+        ASSERT_FALSE(a.await_ready());
+        event.set();
+        EXPECT_FALSE(a.await_suspend(std::noop_coroutine()));
+        EXPECT_EQ(7, a.await_resume());
+    }
+    // The future's frame, and with it the task's, has been destroyed.
+    EXPECT_EQ(1, owned.use_count());
+    sync_wait(scope.join_async());
+}
+
+TEST(AsyncScopeTest, FutureDroppedAfterFailingReportsItsException) {
+    EXPECT_THROW(sync_wait(drop_failed_future()), std::runtime_error);
+}
+
+namespace {
+task<void> sleep_then_count(manual_event_loop& loop,
+                            std::atomic<int>&  cancelled) {
+    using namespace std::chrono_literals;
+    try {
+        // The stop token reaches this nested task from the scope.
+        co_await delayed_int(loop, 10s, 0);
+    } catch (const operation_cancelled&) {
+        cancelled.fetch_add(1, std::memory_order_relaxed);
+        throw;
+    }
+}
+
+task<void> cancel_scope(manual_event_loop& loop,
+                        std::atomic<int>&  cancelled) {
+    async_scope scope;
+    for (int i = 0; i < 10; ++i) {
+        scope.spawn_detached(sleep_then_count(loop, cancelled));
+    }
+    co_await loop.schedule();
+    scope.request_stop();
+    co_await scope.join_async();
+
+    // Stopped before suspending: schedule() doesn't enqueue at all.
+    async_scope stopped;
+    stopped.request_stop();
+    auto f = stopped.spawn_future(loop.schedule());
+    EXPECT_THROW(co_await std::move(f), operation_cancelled);
+    co_await stopped.join_async();
+}
+
+task<bool> has_stop_token() {
+    std::stop_token st = co_await current_stop_token();
+    co_return st.stop_possible();
+}
+} // namespace
+
+TEST(CancellationTest, RequestStopUnlinksPendingTimers) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    std::atomic<int> cancelled{0};
+    auto             start = manual_event_loop::clock::now();
+    sync_wait(cancel_scope(loop, cancelled));
+    EXPECT_LT(manual_event_loop::clock::now() - start,
+              std::chrono::seconds(5));
+    EXPECT_EQ(10, cancelled.load());
+}
+
+TEST(CancellationTest, WhenAnyCancelsLosers) {
+    using namespace std::chrono_literals;
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    auto start  = manual_event_loop::clock::now();
+    auto winner = sync_wait(when_any(delayed_int(loop, 10s, 1),
+                                     delayed_int(loop, 1ms, 2),
+                                     has_stop_token()));
+    EXPECT_LT(manual_event_loop::clock::now() - start, 5s);
+    // has_stop_token() completes synchronously, so it wins.
+    ASSERT_EQ(2u, winner.index());
+    EXPECT_TRUE(std::get<2>(winner));
+
+    // No token outside a scope or when_any.
+    EXPECT_FALSE(sync_wait(has_stop_token()));
+}
+
+namespace {
+using priority = manual_event_loop::priority;
+
+task<void> record_on(manual_event_loop& loop,
+                     priority           p,
+                     std::vector<int>&  order,
+                     int                id) {
+    co_await loop.schedule(p);
+    order.push_back(id); // only one loop thread
+}
+
+// Queues everything before any worker runs, then drains it on one thread.
+std::vector<int>
+drain_in_order(std::vector<std::pair<priority, int>> items) {
+    manual_event_loop loop;
+    std::vector<int>  order;
+    async_scope       scope;
+    for (auto [p, id] : items) {
+        scope.spawn_detached(record_on(loop, p, order, id));
+    }
+    std::jthread thd{[&](std::stop_token st) { loop.run(st); }};
+    sync_wait(scope.join_async());
+    return order;
+}
+} // namespace
+
+TEST(ManualEventLoopTest, HigherLanesRunFirst) {
+    std::vector<std::pair<priority, int>> items;
+    for (int i = 0; i < 100; ++i) {
+        items.emplace_back(priority::low, 200 + i);
+    }
+    items.emplace_back(priority::normal, 100);
+    items.emplace_back(priority::high, 0);
+    items.emplace_back(priority::high, 1);
+
+    std::vector<int> order = drain_in_order(items);
+    ASSERT_EQ(103u, order.size());
+    EXPECT_EQ((std::vector<int>{0, 1, 100, 200, 201}),
+              std::vector<int>(order.begin(), order.begin() + 5));
+}
+
+TEST(ManualEventLoopTest, LowerLanesAreNotStarved) {
+    constexpr int limit = manual_event_loop::starvation_limit;
+
+    std::vector<std::pair<priority, int>> items;
+    items.emplace_back(priority::low, -1);
+    for (int i = 0; i < 4 * limit; ++i) {
+        items.emplace_back(priority::high, i);
+    }
+
+    std::vector<int> order = drain_in_order(items);
+    auto             pos   = std::find(order.begin(), order.end(), -1);
+    ASSERT_NE(order.end(), pos);
+    EXPECT_EQ(limit - 1, pos - order.begin());
+}
+
+TEST(StaticThreadPoolTest, ParsesCpuLists) {
+    EXPECT_EQ((std::vector<unsigned>{0, 1, 2, 3, 8, 10, 11}),
+              cpu_topology::parse_cpu_list("0-3,8,10-11\n"));
+    EXPECT_TRUE(cpu_topology::parse_cpu_list("").empty());
+
+    cpu_topology topology = cpu_topology::detect();
+    EXPECT_FALSE(topology.nodes.empty());
+    EXPECT_GT(topology.cpu_count(), 0u);
+}
+
+namespace {
+task<std::vector<std::size_t>> hop_nodes(static_thread_pool& pool) {
+    std::vector<std::size_t> nodes;
+    co_await pool.schedule_on(1);
+    nodes.push_back(pool.current_node());
+    co_await pool.schedule();
+    nodes.push_back(pool.current_node());
+    co_await pool.schedule_on(0);
+    nodes.push_back(pool.current_node());
+    co_return nodes;
+}
+} // namespace
+
+TEST(StaticThreadPoolTest, ScheduleStaysOnCurrentNode) {
+    // Two nodes sharing a CPU, so this runs anywhere.
+    static_thread_pool pool{cpu_topology{{{0}, {0}}},
+                            4,
+                            static_thread_pool::pinning::none};
+    EXPECT_EQ(2u, pool.node_count());
+    EXPECT_EQ(static_thread_pool::no_node, pool.current_node());
+    EXPECT_EQ((std::vector<std::size_t>{1, 1, 0}),
+              sync_wait(hop_nodes(pool)));
+
+    std::atomic<int> count{0};
+    sync_wait(fan_out(pool, count, 100));
+    EXPECT_EQ(100, count.load());
+}
+
+TEST(SingleConsumerEventLoopTest, ManyProducersOneConsumer) {
+    constexpr int producers = 4;
+    constexpr int per_thread = 2000;
+
+    single_consumer_event_loop loop;
+    std::jthread     consumer{[&](std::stop_token st) { loop.run(st); }};
+    std::atomic<int> count{0};
+    async_scope      scope;
+    {
+        std::vector<std::jthread> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < per_thread; ++i) {
+                    scope.spawn_detached(count_on(loop, count));
+                }
+            });
+        }
+    }
+    sync_wait(scope.join_async());
+    EXPECT_EQ(producers * per_thread, count.load());
+
+    // The consumer can schedule onto its own loop, too.
+    sync_wait(fan_out(loop, count, 100));
+    EXPECT_EQ(producers * per_thread + 100, count.load());
+}
+
+namespace {
+struct pinned {
+    int value;
+    explicit pinned(int v) : value(v) {}
+    pinned(const pinned&) = delete;
+};
+
+generator<pinned> yield_pinned(const pinned*& last, int& produced) {
+    pinned p{1};
+    last = &p;
+    ++produced;
+    co_yield p;
+    ++produced;
+    co_yield pinned{2}; // a temporary lives until the consumer moves on
+}
+} // namespace
+
+TEST(GeneratorTest, YieldsLazilyWithoutCopying) {
+    const pinned*     last     = nullptr;
+    int               produced = 0;
+    generator<pinned> gen      = yield_pinned(last, produced);
+    EXPECT_EQ(0, produced);
+
+    auto it = gen.begin();
+    EXPECT_EQ(1, produced);
+    EXPECT_EQ(last, &*it);
+    EXPECT_EQ(1, (*it).value);
+    ++it;
+    EXPECT_EQ(2, produced);
+    EXPECT_EQ(2, (*it).value);
+    ++it;
+    EXPECT_TRUE(it == gen.end());
+}
+
+namespace {
+generator<int> yield_const(const int& last) {
+    const int first = 1;
+    co_yield first;
+    co_yield last;
+}
+} // namespace
+
+TEST(GeneratorTest, YieldsConstLvaluesByCopy) {
+    const int        last = 2;
+    generator<int>   gen  = yield_const(last);
+    std::vector<int> values;
+    for (auto it = gen.begin(); it != gen.end(); ++it) {
+        EXPECT_NE(&last, &*it);
+        values.push_back(*it);
+    }
+    EXPECT_EQ((std::vector<int>{1, 2}), values);
+}
+
+namespace {
+async_generator<std::string> lines(manual_event_loop& loop, int n) {
+    for (int i = 0; i < n; ++i) {
+        co_await loop.schedule();
+        co_yield "line " + std::to_string(i);
+    }
+    throw std::runtime_error("truncated");
+}
+
+struct header {
+    const std::string title{"title"};
+};
+
+async_generator<std::string> header_lines(const header& h) {
+    co_yield h.title; // a const member
+}
+
+task<std::string> first_header_line(const header& h) {
+    auto gen = header_lines(h);
+    auto it  = co_await gen.begin();
+    co_return *it;
+}
+
+task<std::vector<std::string>> read_lines(manual_event_loop& loop,
+                                          std::string&       error) {
+    std::vector<std::string> out;
+    auto                     gen = lines(loop, 3);
+    try {
+        for (auto it = co_await gen.begin(); it != gen.end(); co_await ++it) {
+            out.push_back(std::move(*it));
+        }
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    co_return out;
+}
+} // namespace
+
+TEST(AsyncGeneratorTest, YieldsConstLvaluesByCopy) {
+    header h;
+    EXPECT_EQ("title", sync_wait(first_header_line(h)));
+}
+
+TEST(AsyncGeneratorTest, StreamsAcrossAwaitsAndRethrows) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    std::string error;
+    EXPECT_EQ((std::vector<std::string>{"line 0", "line 1", "line 2"}),
+              sync_wait(read_lines(loop, error)));
+    EXPECT_EQ("truncated", error);
+}
+
+namespace {
+using int_channel = channel<int, 4>;
+
+task<void> send_range(manual_event_loop& loop, int_channel& ch, int n) {
+    co_await loop.schedule();
+    for (int i = 0; i < n; ++i) {
+        EXPECT_TRUE(co_await ch.send(i));
+    }
+    ch.close();
+}
+
+task<std::vector<int>> receive_all(manual_event_loop& loop, int_channel& ch) {
+    co_await loop.schedule();
+    std::vector<int> out;
+    while (std::optional<int> v = co_await ch.receive()) {
+        out.push_back(*v);
+    }
+    co_return out;
+}
+
+task<void> send_batch(int_channel& ch, std::vector<int>& values) {
+    EXPECT_EQ(values.size(), co_await ch.send_n(values));
+    ch.close();
+}
+
+task<std::vector<int>> receive_batches(int_channel& ch) {
+    std::vector<int> out;
+    int              buffer[3];
+    while (std::size_t n = co_await ch.receive_n(buffer)) {
+        EXPECT_LE(n, 3u);
+        out.insert(out.end(), buffer, buffer + n);
+    }
+    co_return out;
+}
+} // namespace
+
+TEST(ChannelTest, PipelineAcrossThreadsKeepsOrder) {
+    manual_event_loop loop;
+    std::jthread      t1{[&](std::stop_token st) { loop.run(st); }};
+    std::jthread      t2{[&](std::stop_token st) { loop.run(st); }};
+
+    int_channel ch;
+    auto [ignored, received] =
+        sync_wait(when_all(send_range(loop, ch, 1000), receive_all(loop, ch)));
+    (void)ignored;
+    std::vector<int> expected(1000);
+    std::iota(expected.begin(), expected.end(), 0);
+    EXPECT_EQ(expected, received);
+}
+
+TEST(ChannelTest, BatchesAndClose) {
+    int_channel      ch;
+    std::vector<int> values{0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    auto [ignored, received] =
+        sync_wait(when_all(send_batch(ch, values), receive_batches(ch)));
+    (void)ignored;
+    EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}), received);
+
+    // Closed: sends fail and receives see the end of the stream.
+    EXPECT_FALSE(sync_wait(ch.send(1)));
+    EXPECT_FALSE(sync_wait(ch.receive()).has_value());
+}
+
+namespace {
+task<void> locked_increment(manual_event_loop& loop,
+                            async_mutex&       mutex,
+                            int&               counter,
+                            bool               reschedule) {
+    co_await loop.schedule();
+    async_mutex_lock lock;
+    if (reschedule) {
+        lock = co_await mutex.scoped_lock_async(loop);
+    } else {
+        lock = co_await mutex.scoped_lock_async();
+    }
+    int value = counter;
+    co_await loop.schedule(); // let others queue up behind the lock
+    counter = value + 1;
+}
+
+task<void> lock_on(manual_event_loop& loop,
+                   async_mutex&       mutex,
+                   bool&              cancelled) {
+    try {
+        async_mutex_lock lock = co_await mutex.scoped_lock_async(loop);
+    } catch (const operation_cancelled&) {
+        cancelled = true;
+    }
+}
+
+// Its schedule() transfers straight back to the awaiting coroutine.
+struct inline_scheduler {
+    struct schedule_awaitable {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> h) noexcept {
+            return h;
+        }
+        void await_resume() noexcept {}
+    };
+
+    schedule_awaitable schedule() noexcept { return {}; }
+};
+
+task<void> lock_inline(inline_scheduler& sched,
+                       async_mutex&      mutex,
+                       bool&             locked) {
+    async_mutex_lock lock = co_await mutex.scoped_lock_async(sched);
+    locked                = true;
+}
+
+task<void> limited(manual_event_loop& loop,
+                   async_semaphore&   sem,
+                   std::atomic<int>&  in_flight,
+                   std::atomic<int>&  peak) {
+    co_await loop.schedule();
+    co_await sem.acquire();
+    int now = in_flight.fetch_add(1) + 1;
+    int old = peak.load();
+    while (old < now && !peak.compare_exchange_weak(old, now)) {
+    }
+    co_await loop.schedule();
+    in_flight.fetch_sub(1);
+    sem.release();
+}
+
+task<void> wait_then_count(async_latch& latch, std::atomic<int>& count) {
+    co_await latch;
+    count.fetch_add(1);
+}
+} // namespace
+
+TEST(AsyncMutexTest, SerialisesCriticalSections) {
+    manual_event_loop         loop;
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&](std::stop_token st) { loop.run(st); });
+    }
+
+    async_mutex mutex;
+    int         counter = 0;
+    async_scope scope;
+    for (int i = 0; i < 200; ++i) {
+        scope.spawn_detached(locked_increment(loop, mutex, counter, i % 2));
+    }
+    sync_wait(scope.join_async());
+    EXPECT_EQ(200, counter);
+    EXPECT_TRUE(mutex.try_lock());
+    mutex.unlock();
+}
+
+TEST(AsyncMutexTest, CancelledHopReleasesTheLock) {
+    manual_event_loop loop;
+    async_mutex       mutex;
+    ASSERT_TRUE(mutex.try_lock());
+
+    bool        cancelled = false;
+    async_scope scope;
+    scope.spawn_detached(lock_on(loop, mutex, cancelled));
+    scope.request_stop();
+
+    // Hands the lock to the waiter, whose hop onto 'loop' is cancelled.
+    mutex.unlock();
+    EXPECT_TRUE(cancelled);
+    EXPECT_TRUE(mutex.try_lock());
+    mutex.unlock();
+    sync_wait(scope.join_async());
+}
+
+TEST(AsyncMutexTest, HopReturningAHandleResumesIt) {
+    inline_scheduler sched;
+    async_mutex      mutex;
+    ASSERT_TRUE(mutex.try_lock());
+
+    bool        locked = false;
+    async_scope scope;
+    scope.spawn_detached(lock_inline(sched, mutex, locked));
+    EXPECT_FALSE(locked);
+
+    mutex.unlock();
+    EXPECT_TRUE(locked);
+    EXPECT_TRUE(mutex.try_lock());
+    mutex.unlock();
+    sync_wait(scope.join_async());
+}
+
+TEST(AsyncSemaphoreTest, CapsConcurrency) {
+    manual_event_loop         loop;
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&](std::stop_token st) { loop.run(st); });
+    }
+
+    async_semaphore  sem{3};
+    std::atomic<int> in_flight{0};
+    std::atomic<int> peak{0};
+    async_scope      scope;
+    for (int i = 0; i < 100; ++i) {
+        scope.spawn_detached(limited(loop, sem, in_flight, peak));
+    }
+    sync_wait(scope.join_async());
+    EXPECT_LE(peak.load(), 3);
+    EXPECT_EQ(3, sem.available());
+}
+
+TEST(AsyncEventTest, LatchReleasesWaitersOnce) {
+    async_latch      latch{2};
+    std::atomic<int> count{0};
+    async_scope      scope;
+    scope.spawn_detached(wait_then_count(latch, count));
+    scope.spawn_detached(wait_then_count(latch, count));
+    latch.count_down();
+    EXPECT_EQ(0, count.load());
+    latch.count_down();
+    EXPECT_EQ(2, count.load());
+    EXPECT_TRUE(latch.try_wait());
+    sync_wait(scope.join_async());
+
+    async_manual_reset_event event;
+    event.set();
+    sync_wait(event); // already set
+    event.reset();
+    EXPECT_FALSE(event.is_set());
+}
+
+namespace {
+task<void> tracked(manual_event_loop& loop,
+                   std::atomic<int>&  in_flight,
+                   std::atomic<int>&  peak) {
+    int now = in_flight.fetch_add(1) + 1;
+    int old = peak.load();
+    while (old < now && !peak.compare_exchange_weak(old, now)) {
+    }
+    co_await loop.schedule();
+    in_flight.fetch_sub(1);
+}
+
+task<void> spawn_many(manual_event_loop& loop,
+                      async_scope&       scope,
+                      std::atomic<int>&  in_flight,
+                      std::atomic<int>&  peak) {
+    co_await loop.schedule();
+    for (int i = 0; i < 100; ++i) {
+        co_await scope.spawn(tracked(loop, in_flight, peak));
+    }
+}
+
+task<void> wait_for(async_manual_reset_event& event) { co_await event; }
+} // namespace
+
+TEST(AsyncScopeTest, SpawnWaitsForAFreeSlot) {
+    manual_event_loop         loop;
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&](std::stop_token st) { loop.run(st); });
+    }
+
+    async_scope      scope{async_scope::concurrency_limit{3}};
+    std::atomic<int> in_flight{0};
+    std::atomic<int> peak{0};
+    sync_wait(spawn_many(loop, scope, in_flight, peak));
+    sync_wait(scope.join_async());
+    EXPECT_LE(peak.load(), 3);
+    EXPECT_EQ(0, in_flight.load());
+}
+
+TEST(AsyncScopeTest, TrySpawnRejectsWhenFull) {
+    async_scope              scope{async_scope::concurrency_limit{1}};
+    async_manual_reset_event event;
+    EXPECT_TRUE(scope.try_spawn(wait_for(event)));
+    EXPECT_FALSE(scope.try_spawn(wait_for(event)));
+
+    // Unlimited spawns don't count against the limit.
+    scope.spawn_detached(wait_for(event));
+
+    event.set();
+    EXPECT_TRUE(scope.try_spawn(wait_for(event)));
+    sync_wait(scope.join_async());
+}
+
+TEST(TracingTest, HistogramPercentilesAreWithinABucket) {
+    latency_histogram h;
+    for (std::uint64_t v = 1; v <= 10'000; ++v) {
+        h.record(v);
+    }
+    EXPECT_EQ(10'000u, h.count());
+    EXPECT_EQ(10'000u, h.max());
+    EXPECT_DOUBLE_EQ(5'000.5, h.mean());
+
+    // Buckets are 1/16 of a power of two wide.
+    std::uint64_t p50 = h.value_at_percentile(50);
+    EXPECT_GE(p50, 5'000u);
+    EXPECT_LE(p50, 5'000u + 5'000u / 16);
+    EXPECT_EQ(10'000u, h.value_at_percentile(100));
+
+    h.reset();
+    EXPECT_EQ(0u, h.count());
+    EXPECT_EQ(0u, h.value_at_percentile(50));
+}
+
+TEST(TracingTest, ChromeTracePairsResumeWithSuspend) {
+    std::ostringstream discard;
+    write_chrome_trace(discard);
+
+    int           frame = 0;
+    trace_buffer& local = trace_buffer::local();
+    local.push({1'000, 0, &frame, trace_kind::resume});
+    local.push({3'500, 0, &frame, trace_kind::suspend});
+    local.push({9'000, 2'000, &frame, trace_kind::queue_wait});
+    local.push({9'250, 0, &frame, trace_kind::suspend});
+
+    std::ostringstream out;
+    write_chrome_trace(out);
+    std::string json = out.str();
+    EXPECT_NE(std::string::npos,
+              json.find(R"("ph":"X","pid":1,"tid":)" +
+                        std::to_string(local.thread_index()) +
+                        R"(,"ts":1.000,"dur":2.500)"));
+    EXPECT_NE(std::string::npos, json.find(R"("ph":"b")"));
+    EXPECT_NE(std::string::npos, json.find(R"("ts":7.000,"cat":"queue")"));
+    EXPECT_NE(std::string::npos, json.find(R"("ts":9.000,"dur":0.250)"));
+
+    // A full buffer drops new events rather than overwrite old ones.
+    auto buffer = std::make_unique<trace_buffer>(0);
+    for (std::size_t i = 0; i < trace_buffer::capacity + 3; ++i) {
+        buffer->push({i, 0, nullptr, trace_kind::resume});
+    }
+    std::uint64_t last = 0;
+    buffer->drain([&](const trace_event& e) { last = e.timestamp; });
+    EXPECT_EQ(trace_buffer::capacity - 1, last);
+    EXPECT_EQ(3u, buffer->dropped());
+}
+
+TEST(TracingTest, LoopRecordsQueueLatencyOnlyWhenEnabled) {
+    latency_histogram& latency = trace_histograms::global().queue_latency;
+    std::uint64_t      before  = latency.count();
+    {
+        manual_event_loop loop;
+        std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+        sync_wait(inline_await_loop(loop, 1));
+    }
+    EXPECT_EQ(tracing_enabled, latency.count() > before);
+}
+
+namespace {
+task<int> queued_leaf(manual_event_loop& loop) {
+    co_await loop.schedule();
+    co_return 1;
+}
+
+task<void> awaits_queued_leaf(manual_event_loop& loop) {
+    co_await queued_leaf(loop);
+}
+} // namespace
+
+TEST(AsyncStacksTest, ListsTheChainAwaitingAQueuedTask) {
+    manual_event_loop loop;
+    async_scope       scope;
+    scope.spawn_detached(awaits_queued_leaf(loop));
+
+    // Nothing runs the loop yet, so the leaf stays queued.
+    std::vector<async_stack> stacks = capture_async_stacks();
+    auto queued = std::find_if(stacks.begin(), stacks.end(), [&](auto& s) {
+        return s.front().waiting_for == &loop;
+    });
+    if (!async_stacks_enabled) {
+        EXPECT_TRUE(stacks.empty());
+    } else {
+        ASSERT_NE(stacks.end(), queued);
+        ASSERT_EQ(3u, queued->size());
+        EXPECT_STREQ("queued on manual_event_loop", (*queued)[0].waiting);
+        EXPECT_NE(nullptr,
+                  std::strstr((*queued)[0].where.function_name(),
+                              "queued_leaf"));
+        EXPECT_NE(nullptr,
+                  std::strstr((*queued)[1].where.function_name(),
+                              "awaits_queued_leaf"));
+        EXPECT_EQ(&scope, (*queued)[2].context);
+    }
+
+    std::jthread thd{[&](std::stop_token st) { loop.run(st); }};
+    sync_wait(scope.join_async());
+}
+
+namespace {
+task<std::thread::id> thread_after_hop(manual_event_loop& loop) {
+    co_await loop.schedule();
+    co_return std::this_thread::get_id();
+}
+
+task<std::unique_ptr<int>> hop_then_nested_wait(manual_event_loop& loop,
+                                                manual_event_loop& other) {
+    co_await loop.schedule();
+    // Blocks this thread, which is inside sync_wait(loop, ...) already.
+    co_return std::make_unique<int>(sync_wait(inline_await_loop(other, 1)));
+}
+} // namespace
+
+TEST(SyncWaitTest, DrivesTheLoopOnTheCallingThread) {
+    manual_event_loop loop;
+    EXPECT_EQ(std::this_thread::get_id(),
+              sync_wait(loop, thread_after_hop(loop)));
+
+    // Completed from another thread while this one waits for work.
+    async_manual_reset_event event;
+    std::jthread             setter{[&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        event.set();
+    }};
+    sync_wait(loop, wait_for(event));
+}
+
+TEST(SyncWaitTest, NestedWaitsUseTheirOwnWaker) {
+    manual_event_loop loop;
+    manual_event_loop other;
+    std::jthread      thd{[&](std::stop_token st) { other.run(st); }};
+
+    std::unique_ptr<int> result =
+        sync_wait(loop, hop_then_nested_wait(loop, other));
+    ASSERT_NE(nullptr, result);
+    EXPECT_EQ(2, *result);
+}
+
+namespace {
+struct thread_ids {
+    std::thread::id before;
+    std::thread::id child;
+    std::thread::id after;
+};
+
+// Awaits a plain task that finishes on 'other', which may be 'loop'.
+affine_task<thread_ids> affine_across(manual_event_loop& loop,
+                                      manual_event_loop& other) {
+    co_await loop.schedule();
+    thread_ids ids;
+    ids.before = std::this_thread::get_id();
+    ids.child  = co_await thread_after_hop(other);
+    ids.after  = std::this_thread::get_id();
+    co_return ids;
+}
+} // namespace
+
+TEST(AffineTaskTest, ReturnsToItsLoopAfterAForeignCompletion) {
+    manual_event_loop loop;
+    manual_event_loop other;
+    std::jthread      other_thd{[&](std::stop_token st) { other.run(st); }};
+    {
+        std::jthread thd{
+            [&](std::stop_token st) { loop.run_batched(st, 0); }};
+        thread_ids ids = sync_wait(affine_across(loop, other));
+        EXPECT_NE(ids.before, ids.child);
+        EXPECT_EQ(ids.before, ids.after);
+    }
+    // The first hop onto the loop, and the one back from 'other'.
+    EXPECT_EQ(2u, loop.stats().batch_items);
+}
+
+namespace {
+// Hops onto a loop like its schedule(), but then reports cancellation.
+struct cancelled_schedule {
+    using scheduler_type = manual_event_loop;
+
+    decltype(std::declval<manual_event_loop&>().schedule()) inner;
+
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        return inner.await_suspend(h);
+    }
+
+    void await_resume() {
+        inner.await_resume();
+        throw operation_cancelled{};
+    }
+};
+
+// After a cancelled hop onto 'other', awaits a task that completes inline.
+affine_task<thread_ids> affine_cancelled_hop(manual_event_loop& loop,
+                                             manual_event_loop& other) {
+    co_await loop.schedule();
+    thread_ids ids;
+    ids.before = std::this_thread::get_id();
+    try {
+        co_await cancelled_schedule{other.schedule()};
+    } catch (const operation_cancelled&) {
+        ids.child = std::this_thread::get_id();
+    }
+    co_await chain_f(0);
+    ids.after = std::this_thread::get_id();
+    co_return ids;
+}
+} // namespace
+
+TEST(AffineTaskTest, CancelledHopKeepsItsLoop) {
+    manual_event_loop loop;
+    manual_event_loop other;
+    std::jthread      other_thd{[&](std::stop_token st) { other.run(st); }};
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    thread_ids ids = sync_wait(affine_cancelled_hop(loop, other));
+    EXPECT_NE(ids.before, ids.child);
+    EXPECT_EQ(ids.before, ids.after);
+}
+
+TEST(AffineTaskTest, SkipsTheHopWhenAlreadyOnItsLoop) {
+    manual_event_loop loop;
+    {
+        std::jthread thd{
+            [&](std::stop_token st) { loop.run_batched(st, 0); }};
+        thread_ids ids = sync_wait(affine_across(loop, loop));
+        EXPECT_EQ(ids.before, ids.after);
+    }
+    // The task's hop and the child's, but none to bring the task back.
+    EXPECT_EQ(2u, loop.stats().batch_items);
+}
+
+namespace {
+// Waits for 'in', then sets 'out', which resumes the next relay inside
+// this one's set() unless the budget is spent.
+task<void> relay(async_manual_reset_event& in,
+                 async_manual_reset_event& out,
+                 unsigned&                 max_depth) {
+    co_await in;
+    max_depth = std::max(max_depth, inline_resumption::depth());
+    out.set();
+}
+} // namespace
+
+TEST(InlineResumptionTest, LongCascadeStaysWithinTheBudget) {
+    // Deep enough to overflow the stack if every link nested.
+    constexpr std::size_t relays = 200000;
+
+    std::vector<async_manual_reset_event> events(relays + 1);
+    unsigned                              max_depth = 0;
+    std::size_t before = inline_resumption::deferrals();
+
+    async_scope scope;
+    for (std::size_t i = 0; i < relays; ++i) {
+        scope.spawn_detached(relay(events[i], events[i + 1], max_depth));
+    }
+    events[0].set();
+    EXPECT_TRUE(events[relays].is_set());
+    sync_wait(scope.join_async());
+
+    EXPECT_EQ(inline_resumption::budget(), max_depth);
+    EXPECT_GT(inline_resumption::deferrals(), before);
+    EXPECT_EQ(0u, inline_resumption::depth());
+}
+
+TEST(InlineResumptionTest, ShortChainsResumeInline) {
+    std::vector<async_manual_reset_event> events(4);
+    unsigned                              max_depth = 0;
+    std::size_t before = inline_resumption::deferrals();
+
+    async_scope scope;
+    for (std::size_t i = 0; i < 3; ++i) {
+        scope.spawn_detached(relay(events[i], events[i + 1], max_depth));
+    }
+    events[0].set();
+    sync_wait(scope.join_async());
+
+    EXPECT_EQ(3u, max_depth);
+    EXPECT_EQ(before, inline_resumption::deferrals());
+}
+
+TEST(ShardedAsyncScopeTest, JoinsTasksSpawnedFromManyThreads) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    sharded_async_scope empty;
+    sync_wait(empty.join_async()); // nothing to wait for
+
+    constexpr int       spawners = 4;
+    constexpr int       each     = 500;
+    std::atomic<int>    count{0};
+    sharded_async_scope scope;
+    {
+        std::vector<std::jthread> threads;
+        for (int t = 0; t < spawners; ++t) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < each; ++i) {
+                    scope.spawn_detached(count_on(loop, count));
+                }
+            });
+        }
+    }
+    // Most tasks are still queued on 'loop', so their references are
+    // dropped from its thread after the join has folded the shards.
+    sync_wait(scope.join_async());
+    EXPECT_EQ(spawners * each, count.load());
+}
+
+TEST(ShardedAsyncScopeTest, DeliversFuturesAndExceptions) {
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    sharded_async_scope scope{sharded_async_scope::collect_exceptions};
+    auto                value = scope.spawn_future(chain_f(2));
+    scope.spawn_detached(delayed_throw(loop, std::chrono::milliseconds(1)));
+    EXPECT_EQ(2, sync_wait(std::move(value)));
+    EXPECT_THROW(sync_wait(scope.join_async()), std::runtime_error);
+}
+
+TEST(NurseryTest, CountsChildrenAndCancelsTheDeadline) {
+    using namespace std::chrono_literals;
+    manual_event_loop loop;
+    std::atomic<int>  count{0};
+    nursery           children;
+    for (int i = 0; i < 10; ++i) {
+        children.spawn_detached(count_on(loop, count));
+    }
+    auto value = children.spawn_future(chain_f(3)); // completes at once
+
+    // Nothing has run the queue yet, so all 11 were live at once.
+    std::jthread thd{[&](std::stop_token st) { loop.run(st); }};
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(sync_wait(children.join_async_for(loop, 1h)));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 10s);
+    EXPECT_EQ(3, sync_wait(std::move(value)));
+    EXPECT_EQ(10, count.load());
+
+    nursery_stats s = children.stats();
+    EXPECT_EQ(0u, s.live);
+    EXPECT_EQ(11u, s.spawned);
+    EXPECT_EQ(11u, s.completed);
+    EXPECT_EQ(11u, s.peak_live);
+    EXPECT_GE(s.child_time, s.longest_child);
+    EXPECT_EQ(0u, s.stragglers);
+}
+
+TEST(NurseryTest, DeadlineCancelsStragglers) {
+    using namespace std::chrono_literals;
+    manual_event_loop loop;
+    std::jthread      thd{[&](std::stop_token st) { loop.run(st); }};
+
+    std::atomic<int> count{0};
+    std::atomic<int> cancelled{0};
+    nursery          children;
+    children.spawn_detached(count_on(loop, count));
+    children.spawn_detached(sleep_then_count(loop, cancelled));
+
+    EXPECT_FALSE(sync_wait(children.join_async_for(loop, 20ms)));
+    EXPECT_EQ(1, count.load());
+    EXPECT_EQ(1, cancelled.load());
+
+    nursery_stats s = children.stats();
+    EXPECT_EQ(0u, s.live);
+    EXPECT_EQ(2u, s.completed);
+    EXPECT_EQ(1u, s.stragglers);
+    EXPECT_GE(s.longest_child, 20ms);
+}
+
+namespace {
+// 'buffer' lives across the await, so it is part of the frame.
+task<int> big_frame(int i) {
+    std::array<unsigned char, 4096> buffer{};
+    buffer[static_cast<std::size_t>(i)] = 1;
+    int x = co_await chain_f(i);
+    co_return buffer[static_cast<std::size_t>(x)] + x;
+}
+} // namespace
+
+TEST(FrameStatsTest, ReportsSizesAndFlagsFramesOverBudget) {
+    std::size_t saved = frame_budget();
+    set_frame_budget(1024);
+    EXPECT_EQ(2, sync_wait(big_frame(1)));
+
+    auto named = [](const char* name) {
+        return [name](const frame_size_info& info) {
+            return std::strstr(info.where.function_name(), name) != nullptr;
+        };
+    };
+    std::vector<frame_size_info> sizes = capture_frame_sizes();
+    std::vector<frame_size_info> over  = frames_over_budget();
+    std::ostringstream           report;
+    print_frame_sizes(report);
+    set_frame_budget(saved);
+
+    if (!frame_stats_enabled) {
+        EXPECT_TRUE(sizes.empty());
+        EXPECT_TRUE(over.empty());
+        return;
+    }
+    auto big = std::find_if(over.begin(), over.end(), named("big_frame"));
+    ASSERT_NE(over.end(), big);
+    EXPECT_GT(big->size, 4096u);
+    EXPECT_EQ(0u, big->elided);
+    EXPECT_NE(std::string::npos, report.str().find("OVER BUDGET"));
+
+    // Small enough either way, whether or not it was merged into
+    // big_frame()'s frame.
+    auto leaf = std::find_if(sizes.begin(), sizes.end(), named("chain_f"));
+    ASSERT_NE(sizes.end(), leaf);
+    EXPECT_EQ(0u, leaf->over_budget);
+}
@@ -0,0 +1,2 @@
+// coroexample_currentscheduler.cpp                                   -*-C++-*-
+#include <coroexample/currentscheduler.h>
@@ -0,0 +1,121 @@
+// coroexample_currentscheduler.h                                     -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_CURRENTSCHEDULER
+#define INCLUDED_COROEXAMPLE_CURRENTSCHEDULER
+
+#include <coroutine>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/////////////////////////////////////////////////
+// current_scheduler
+//
+// Which scheduler, if any, the calling thread is running work for. Each
+// scheduler's run loop (manual_event_loop's run(), run_batched() and
+// run_until(), and the run loops of the other schedulers) marks its
+// thread with a `current_scheduler_scope` for as long as it runs, so
+// that code resumed from the loop can compare `current_scheduler::get()`
+// against a scheduler it recorded earlier.
+//
+// Along with the scheduler, the thread records how to get a coroutine
+// back onto it: `reschedule(scheduler, hop, h)` awaits the scheduler's
+// schedule() on behalf of 'h', constructing the awaitable in 'hop', which
+// must then be kept alive until 'h' has been resumed. affine_task uses
+// this to return to its scheduler after an operation completes on a
+// foreign thread.
+
+struct scheduler_hop {
+    static constexpr std::size_t capacity = 64;
+
+    scheduler_hop() = default;
+
+    scheduler_hop(const scheduler_hop&)            = delete;
+    scheduler_hop& operator=(const scheduler_hop&) = delete;
+
+    ~scheduler_hop() { reset(); }
+
+    // Destroys the awaitable from the last hop, if there is one.
+    void reset() noexcept {
+        if (destroy != nullptr) {
+            destroy(storage);
+            destroy = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[capacity];
+    void (*destroy)(void*) noexcept {nullptr};
+};
+
+struct current_scheduler {
+    // Returns the coroutine to transfer to: 'h' itself if it could not be
+    // queued, and so should be resumed by the caller.
+    using reschedule_fn =
+        std::coroutine_handle<>(void*                   scheduler,
+                                scheduler_hop&          hop,
+                                std::coroutine_handle<> h) noexcept;
+
+    void*          scheduler{nullptr};
+    reschedule_fn* reschedule{nullptr};
+
+    // Null 'scheduler' if the calling thread isn't in a scheduler's run
+    // loop.
+    static current_scheduler get() noexcept { return current; }
+
+  private:
+    template <typename Scheduler>
+    friend struct current_scheduler_scope;
+
+    template <typename Scheduler>
+    static std::coroutine_handle<>
+    reschedule_on(void*                   scheduler,
+                  scheduler_hop&          hop,
+                  std::coroutine_handle<> h) noexcept {
+        using schedule_awaitable =
+            decltype(std::declval<Scheduler&>().schedule());
+        static_assert(sizeof(schedule_awaitable) <= scheduler_hop::capacity &&
+                          alignof(schedule_awaitable) <=
+                              alignof(std::max_align_t),
+                      "schedule() awaitable does not fit in a scheduler_hop");
+
+        hop.reset();
+        auto* a = ::new (static_cast<void*>(hop.storage)) schedule_awaitable(
+            static_cast<Scheduler*>(scheduler)->schedule());
+        hop.destroy = [](void* p) noexcept {
+            std::launder(static_cast<schedule_awaitable*>(p))
+                ->~schedule_awaitable();
+        };
+        using result = decltype(a->await_suspend(h));
+        if constexpr (std::is_void_v<result>) {
+            a->await_suspend(h);
+            return std::noop_coroutine();
+        } else if constexpr (std::is_same_v<result, bool>) {
+            return a->await_suspend(h) ? std::noop_coroutine() : h;
+        } else {
+            return a->await_suspend(h);
+        }
+    }
+
+    static thread_local current_scheduler current;
+};
+
+inline thread_local current_scheduler current_scheduler::current{};
+
+// Marks the calling thread as running work for 'sched' until the scope
+// ends, restoring whatever it was running work for before.
+template <typename Scheduler>
+struct current_scheduler_scope {
+    current_scheduler saved;
+
+    explicit current_scheduler_scope(Scheduler& sched) noexcept
+        : saved(std::exchange(
+              current_scheduler::current,
+              current_scheduler{
+                  &sched, &current_scheduler::reschedule_on<Scheduler>})) {}
+
+    current_scheduler_scope(const current_scheduler_scope&) = delete;
+
+    ~current_scheduler_scope() { current_scheduler::current = saved; }
+};
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_frameallocator.cpp                                     -*-C++-*-
+#include <coroexample/frameallocator.h>
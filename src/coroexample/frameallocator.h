@@ -0,0 +1,332 @@
+// coroexample_frameallocator.h                                       -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_FRAMEALLOCATOR
+#define INCLUDED_COROEXAMPLE_FRAMEALLOCATOR
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <span>
+
+#include <coroexample/framestats.h>
+#include <coroexample/tracing.h>
+
+///////////////////////////////////////////////////
+// Coroutine frame allocation
+//
+// Coroutine frames are allocated through the promise type's operator new,
+// if it has one. `frame_allocating_promise` is a base class for promise
+// types that provides:
+//
+// - a default operator new that takes frames from `frame_pool`, a
+//   per-thread cache of freed frames bucketed by size class, so that
+//   repeatedly calling the same coroutines stops going to malloc once the
+//   cache is warm; and
+//
+// - an operator new that is chosen when the coroutine's leading parameters
+//   are `std::allocator_arg_t, std::pmr::polymorphic_allocator<>` (or
+//   something convertible to it, such as a `std::pmr::memory_resource*`),
+//   which allocates the frame from that memory resource instead:
+//
+//     task<int> handler(std::allocator_arg_t,
+//                       std::pmr::polymorphic_allocator<> alloc,
+//                       int arg);
+//
+//     frame_arena arena{buffer};
+//     co_await handler(std::allocator_arg, &arena, 42);
+//
+// The allocator is not propagated implicitly; to carve a whole coroutine
+// tree out of one arena, pass it down to the child coroutines as well.
+//
+// The memory resource used (or null for the pool) is stored in a small
+// trailer after the frame so that operator delete, which is only given the
+// pointer and size, can return the memory to the right place.
+//
+// A coroutine frees its frame through the usual operator delete, even when
+// a placement operator new allocated it. GCC 12's -Wmismatched-new-delete
+// pairs the two by name, and a template operator new never matches, so
+// the library turns that warning off for GCC (see CMakeLists.txt).
+
+struct frame_allocator_stats {
+    std::size_t pool_hits{0};       // served from the thread's cache
+    std::size_t pool_misses{0};     // size class empty, went to the heap
+    std::size_t oversize{0};        // too big to pool, went to the heap
+    std::size_t resource_allocs{0}; // from a user-supplied resource
+    std::size_t deallocations{0};
+};
+
+struct frame_pool {
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t class_count = 32; // frames up to 2KiB
+    static constexpr std::size_t max_cached  = 256; // per size class
+
+    static void* allocate(std::size_t size) {
+        state&      s   = local;
+        std::size_t cls = size_class(size);
+        if (cls >= class_count) {
+            ++s.stats.oversize;
+            return ::operator new(size);
+        }
+
+        if (free_block* block = s.heads[cls]) {
+            s.heads[cls] = block->next;
+            --s.lengths[cls];
+            ++s.stats.pool_hits;
+            return block;
+        }
+
+        ++s.stats.pool_misses;
+        return ::operator new((cls + 1) * granularity);
+    }
+
+    static void deallocate(void* p, std::size_t size) noexcept {
+        state&      s   = local;
+        std::size_t cls = size_class(size);
+        ++s.stats.deallocations;
+        if (cls >= class_count) {
+            ::operator delete(p, size);
+            return;
+        }
+
+        if (s.draining || s.lengths[cls] >= max_cached) {
+            ::operator delete(p, (cls + 1) * granularity);
+            return;
+        }
+
+        // Threads that only ever free frames (e.g. event loop workers
+        // destroying frames allocated elsewhere) still need draining.
+        if (!s.drainer_registered) [[unlikely]] {
+            register_drainer(s);
+        }
+
+        free_block* block = ::new (p) free_block{s.heads[cls]};
+        s.heads[cls]      = block;
+        ++s.lengths[cls];
+    }
+
+    // Counters for the calling thread.
+    static frame_allocator_stats& stats() noexcept { return local.stats; }
+
+  private:
+    struct free_block {
+        free_block* next;
+    };
+
+    // Trivially destructible so it is usable for the whole life of the
+    // thread, including while other thread_locals are being destroyed.
+    struct state {
+        free_block*           heads[class_count];
+        std::size_t           lengths[class_count];
+        bool                  draining;
+        bool                  drainer_registered;
+        frame_allocator_stats stats;
+    };
+
+    // Returns the cached blocks to the heap when the thread exits.
+    struct drainer {
+        ~drainer() {
+            state& s   = local;
+            s.draining = true;
+            for (std::size_t cls = 0; cls < class_count; ++cls) {
+                while (free_block* block = s.heads[cls]) {
+                    s.heads[cls] = block->next;
+                    ::operator delete(block, (cls + 1) * granularity);
+                }
+                s.lengths[cls] = 0;
+            }
+        }
+    };
+
+    static inline thread_local state local;
+
+    static void register_drainer(state& s) noexcept {
+        static thread_local drainer d;
+        (void)d;
+        s.drainer_registered = true;
+    }
+
+    static constexpr std::size_t size_class(std::size_t size) noexcept {
+        return (size - 1) / granularity;
+    }
+};
+
+////////////////////////////////////////////////
+// frame_arena
+//
+// A bump allocator over a caller-supplied buffer, for allocating a group of
+// coroutine frames that all die together. Deallocation of arena memory is a
+// no-op; the whole buffer is reclaimed by `reset()` once every frame
+// allocated from it has been destroyed.
+//
+// Allocation is a single atomic fetch_add, so frames can be created from
+// whichever worker thread the coroutine tree happens to be running on.
+// Requests that do not fit are passed to the upstream resource.
+
+class frame_arena : public std::pmr::memory_resource {
+    std::byte*                 buffer;
+    std::size_t                capacity;
+    std::pmr::memory_resource* upstream;
+    std::atomic<std::size_t>   offset{0};
+    std::atomic<std::size_t>   overflow{0};
+
+    static constexpr std::size_t alignment =
+        __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    bool owns(void* p) const noexcept {
+        auto* b = static_cast<std::byte*>(p);
+        return b >= buffer && b < buffer + capacity;
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t align) override {
+        if (align <= alignment) {
+            std::size_t rounded = (bytes + alignment - 1) & ~(alignment - 1);
+            std::size_t start =
+                offset.fetch_add(rounded, std::memory_order_relaxed);
+            if (start + rounded <= capacity) {
+                return buffer + start;
+            }
+        }
+        overflow.fetch_add(1, std::memory_order_relaxed);
+        return upstream->allocate(bytes, align);
+    }
+
+    void
+    do_deallocate(void* p, std::size_t bytes, std::size_t align) override {
+        if (!owns(p)) {
+            upstream->deallocate(p, bytes, align);
+        }
+    }
+
+    bool do_is_equal(
+        const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+  public:
+    explicit frame_arena(
+        std::span<std::byte>       storage,
+        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : upstream(upstream) {
+        void*       p     = storage.data();
+        std::size_t space = storage.size();
+        buffer   = static_cast<std::byte*>(std::align(alignment, 1, p, space));
+        capacity = buffer != nullptr ? space : 0;
+    }
+
+    frame_arena(const frame_arena&)            = delete;
+    frame_arena& operator=(const frame_arena&) = delete;
+
+    // Bytes of the buffer handed out so far.
+    std::size_t used() const noexcept {
+        std::size_t n = offset.load(std::memory_order_relaxed);
+        return n < capacity ? n : capacity;
+    }
+
+    // Number of allocations that did not fit and went upstream.
+    std::size_t overflow_count() const noexcept {
+        return overflow.load(std::memory_order_relaxed);
+    }
+
+    // Reclaims the whole buffer. Every frame allocated from the arena must
+    // already have been destroyed.
+    void reset() noexcept { offset.store(0, std::memory_order_relaxed); }
+};
+
+////////////////////////////////////////////////
+// frame_allocating_promise
+//
+// Base class providing the promise operator new/delete described above.
+
+struct frame_allocating_promise {
+  private:
+    struct trailer {
+        std::pmr::memory_resource* resource;
+    };
+
+    static constexpr std::size_t trailer_offset(std::size_t size) noexcept {
+        return (size + alignof(trailer) - 1) & ~(alignof(trailer) - 1);
+    }
+
+    static constexpr std::size_t total_size(std::size_t size) noexcept {
+        return trailer_offset(size) + sizeof(trailer);
+    }
+
+    static trailer* get_trailer(void* frame, std::size_t size) noexcept {
+        return reinterpret_cast<trailer*>(static_cast<std::byte*>(frame) +
+                                          trailer_offset(size));
+    }
+
+    static void* allocate(std::size_t                size,
+                          std::pmr::memory_resource* resource) {
+        void* frame;
+        if (resource == nullptr) {
+            frame = frame_pool::allocate(total_size(size));
+        } else {
+            ++frame_pool::stats().resource_allocs;
+            frame = resource->allocate(total_size(size));
+        }
+        ::new (get_trailer(frame, size)) trailer{resource};
+        trace_frame_create(frame, size);
+        note_frame_allocation(frame, size);
+        return frame;
+    }
+
+  public:
+    static void* operator new(std::size_t size) {
+        return allocate(size, nullptr);
+    }
+
+    template <typename... Args>
+    static void* operator new(std::size_t                       size,
+                              std::allocator_arg_t,
+                              std::pmr::polymorphic_allocator<> alloc,
+                              Args&...) {
+        return allocate(size, alloc.resource());
+    }
+
+    // Member function coroutines see the object as their first argument.
+    template <typename Self, typename... Args>
+    static void* operator new(std::size_t                       size,
+                              Self&,
+                              std::allocator_arg_t,
+                              std::pmr::polymorphic_allocator<> alloc,
+                              Args&...) {
+        return allocate(size, alloc.resource());
+    }
+
+    static void operator delete(void* frame, std::size_t size) noexcept {
+        trace_frame_destroy(frame);
+        std::pmr::memory_resource* resource =
+            get_trailer(frame, size)->resource;
+        if (resource == nullptr) {
+            frame_pool::deallocate(frame, total_size(size));
+        } else {
+            resource->deallocate(frame, total_size(size));
+        }
+    }
+
+    // Counterparts of the allocator_arg_t overloads of operator new. Like
+    // the one above they're given the frame's size, so they can free
+    // through the trailer too.
+    template <typename... Args>
+    static void operator delete(void*       frame,
+                                std::size_t size,
+                                std::allocator_arg_t,
+                                const std::pmr::polymorphic_allocator<>&,
+                                const Args&...) noexcept {
+        operator delete(frame, size);
+    }
+
+    template <typename Self, typename... Args>
+    static void operator delete(void*       frame,
+                                std::size_t size,
+                                const Self&,
+                                std::allocator_arg_t,
+                                const std::pmr::polymorphic_allocator<>&,
+                                const Args&...) noexcept {
+        operator delete(frame, size);
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+// coroexample_framestats.cpp                                         -*-C++-*-
+#include <coroexample/framestats.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+namespace {
+std::atomic<std::size_t> budget{COROEXAMPLE_FRAME_BUDGET};
+
+// The allocation the next promise constructed on this thread may sit in.
+struct pending_frame {
+    const void* frame{nullptr};
+    std::size_t size{0};
+};
+
+thread_local pending_frame pending;
+
+// Frames are tallied by the identity of their source location's strings,
+// which is stable within a translation unit; capture_frame_sizes() merges
+// equal locations from different ones.
+struct frame_key {
+    const char*   file;
+    const char*   function;
+    std::uint32_t line;
+    std::uint32_t column;
+
+    bool operator==(const frame_key&) const = default;
+};
+
+struct frame_key_hash {
+    std::size_t operator()(const frame_key& k) const noexcept {
+        return std::hash<const void*>{}(k.function) ^
+               (std::size_t{k.line} << 16 | k.column);
+    }
+};
+
+// The frames created by one thread. Tables are never freed, so that the
+// frames of threads that have exited are still reported.
+struct frame_table {
+    std::mutex                                                     mut;
+    std::unordered_map<frame_key, frame_size_info, frame_key_hash> entries;
+};
+
+struct frame_registry {
+    std::mutex                                mut;
+    std::vector<std::unique_ptr<frame_table>> tables;
+
+    static frame_registry& get() noexcept {
+        static frame_registry registry;
+        return registry;
+    }
+
+    static frame_table& local() {
+        thread_local frame_table* table = nullptr;
+        if (table == nullptr) [[unlikely]] {
+            frame_registry& r = get();
+            std::lock_guard lock{r.mut};
+            r.tables.push_back(std::make_unique<frame_table>());
+            table = r.tables.back().get();
+        }
+        return *table;
+    }
+};
+
+bool same_location(const frame_size_info& a, const frame_size_info& b) {
+    auto equal = [](const char* x, const char* y) {
+        return x == y || (x != nullptr && y != nullptr && !std::strcmp(x, y));
+    };
+    return a.where.line() == b.where.line() &&
+           a.where.column() == b.where.column() &&
+           equal(a.where.file_name(), b.where.file_name()) &&
+           equal(a.where.function_name(), b.where.function_name());
+}
+} // namespace
+
+void _frame_sizes::allocated(const void* frame, std::size_t size) noexcept {
+    pending = pending_frame{frame, size};
+}
+
+void _frame_sizes::constructed(const void*          frame,
+                               std::source_location where) noexcept {
+    std::size_t size = 0;
+    if (pending.frame == frame) {
+        size    = pending.size;
+        pending = pending_frame{};
+    }
+    std::size_t limit = budget.load(std::memory_order_relaxed);
+
+    try {
+        frame_table&    table = frame_registry::local();
+        std::lock_guard lock{table.mut};
+        frame_size_info& info =
+            table.entries
+                .try_emplace(frame_key{where.file_name(),
+                                       where.function_name(),
+                                       where.line(),
+                                       where.column()},
+                             frame_size_info{where, 0, 0, 0, 0})
+                .first->second;
+        ++info.frames;
+        if (size == 0) {
+            ++info.elided;
+        } else {
+            info.size = std::max(info.size, size);
+            if (limit != 0 && size > limit) {
+                ++info.over_budget;
+            }
+        }
+    } catch (...) {
+        // Out of memory: the frame just goes uncounted.
+    }
+}
+
+std::size_t frame_budget() noexcept {
+    return budget.load(std::memory_order_relaxed);
+}
+
+void set_frame_budget(std::size_t bytes) noexcept {
+    budget.store(bytes, std::memory_order_relaxed);
+}
+
+std::vector<frame_size_info> capture_frame_sizes() {
+    if constexpr (!frame_stats_enabled) {
+        return {};
+    }
+
+    std::vector<frame_size_info> merged;
+    {
+        frame_registry& r = frame_registry::get();
+        std::lock_guard registry_lock{r.mut};
+        for (const std::unique_ptr<frame_table>& t : r.tables) {
+            std::lock_guard lock{t->mut};
+            for (const auto& [key, info] : t->entries) {
+                auto it = std::find_if(
+                    merged.begin(), merged.end(), [&](auto& m) {
+                        return same_location(m, info);
+                    });
+                if (it == merged.end()) {
+                    merged.push_back(info);
+                } else {
+                    it->size = std::max(it->size, info.size);
+                    it->frames += info.frames;
+                    it->elided += info.elided;
+                    it->over_budget += info.over_budget;
+                }
+            }
+        }
+    }
+
+    std::sort(merged.begin(), merged.end(), [](auto& a, auto& b) {
+        return a.size > b.size;
+    });
+    return merged;
+}
+
+std::vector<frame_size_info> frames_over_budget() {
+    std::vector<frame_size_info> over = capture_frame_sizes();
+    std::erase_if(over, [](auto& info) { return info.over_budget == 0; });
+    return over;
+}
+
+void print_frame_sizes(std::ostream& out) {
+    std::size_t limit = frame_budget();
+    out << "frame sizes";
+    if (limit != 0) {
+        out << " (budget " << limit << " bytes)";
+    }
+    out << ":\n     bytes   frames   elided  coroutine\n";
+    for (const frame_size_info& info : capture_frame_sizes()) {
+        out << std::setw(10) << info.size << std::setw(9) << info.frames
+            << std::setw(9) << info.elided << "  "
+            << info.where.function_name() << '\n'
+            << std::setw(35) << "at " << info.where.file_name() << ':'
+            << info.where.line();
+        if (info.over_budget != 0) {
+            out << "  OVER BUDGET";
+        }
+        out << '\n';
+    }
+}
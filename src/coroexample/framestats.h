@@ -0,0 +1,101 @@
+// coroexample_framestats.h                                           -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_FRAMESTATS
+#define INCLUDED_COROEXAMPLE_FRAMESTATS
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <source_location>
+#include <vector>
+
+// Set by the COROEXAMPLE_ENABLE_FRAME_STATS CMake option.
+#ifndef COROEXAMPLE_FRAME_STATS
+#define COROEXAMPLE_FRAME_STATS 0
+#endif
+
+// Set by the COROEXAMPLE_FRAME_BUDGET CMake cache variable; 0 for none.
+#ifndef COROEXAMPLE_FRAME_BUDGET
+#define COROEXAMPLE_FRAME_BUDGET 0
+#endif
+
+/////////////////////////////////////////////////
+// Frame sizes
+//
+// The size of a coroutine's frame is only known to the compiler, which
+// passes it to the promise's operator new, and whether a child's frame
+// was merged into its caller's (see lazytask.h) depends on the build.
+// With COROEXAMPLE_FRAME_STATS set to 1, the frames of task, affine_task,
+// inline_task and async_scope's spawned tasks are tallied per coroutine:
+//
+//   frame sizes (budget 200 bytes):
+//        bytes   frames   elided  coroutine
+//          232      110        0  task<int> f(int, manual_event_loop&)
+//                                   at main.cpp:10  OVER BUDGET
+//          120      110        0  task<void> h(int, manual_event_loop&)
+//                                   at main.cpp:25
+//
+// `frame_allocating_promise` (and the promise of async_scope's detached
+// tasks, which uses the global operator new) notes each frame's address
+// and size on the allocating thread, and the promise's constructor, which
+// runs next in that frame and knows the coroutine's source location,
+// picks them up. A promise whose frame no allocation was noted for had
+// its frame elided into the caller's, and is counted as such. Frames are
+// tallied per creating thread, under a lock only that thread and
+// `capture_frame_sizes()` take.
+//
+// Whether a coroutine is elided or how big its frame is can only be seen
+// at run time, so the budget is checked there: frames larger than
+// `frame_budget()` bytes, set with `set_frame_budget()` or from
+// COROEXAMPLE_FRAME_BUDGET, are counted as over budget, which the report
+// flags and `frames_over_budget()` lists, for a test to assert on.
+//
+// Otherwise the hooks do nothing and the report is empty.
+
+inline constexpr bool frame_stats_enabled = COROEXAMPLE_FRAME_STATS != 0;
+
+struct _frame_sizes {
+    static void allocated(const void* frame, std::size_t size) noexcept;
+    static void constructed(const void*          frame,
+                            std::source_location where) noexcept;
+};
+
+// Called with each frame as it is allocated.
+inline void note_frame_allocation(const void* frame,
+                                  std::size_t size) noexcept {
+    if constexpr (frame_stats_enabled) {
+        _frame_sizes::allocated(frame, size);
+    }
+}
+
+// Called by the promise constructor of the coroutine whose frame starts at
+// 'frame'.
+inline void note_frame_constructed(const void*          frame,
+                                   std::source_location where) noexcept {
+    if constexpr (frame_stats_enabled) {
+        _frame_sizes::constructed(frame, where);
+    }
+}
+
+struct frame_size_info {
+    std::source_location where;
+    std::size_t          size;        // largest allocated; 0 if all elided
+    std::uint64_t        frames;      // constructed
+    std::uint64_t        elided;      // of those, merged into the caller's
+    std::uint64_t        over_budget; // allocated larger than the budget
+};
+
+// 0 for no budget.
+std::size_t frame_budget() noexcept;
+
+void set_frame_budget(std::size_t bytes) noexcept;
+
+// One entry per coroutine, largest frame first; nothing unless frame
+// stats are enabled.
+std::vector<frame_size_info> capture_frame_sizes();
+
+// The entries with any frame over budget.
+std::vector<frame_size_info> frames_over_budget();
+
+void print_frame_sizes(std::ostream& out);
+
+#endif
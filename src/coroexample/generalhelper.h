@@ -11,6 +11,15 @@
 
 #define FORCE_INLINE __attribute__((always_inline))
 
+// Hint to the CPU that we are in a spin-wait loop.
+FORCE_INLINE inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
 template <typename T>
 concept decay_copyable = std::constructible_from<std::decay_t<T>, T>;
 
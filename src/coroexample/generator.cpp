@@ -0,0 +1,2 @@
+// coroexample_generator.cpp                                          -*-C++-*-
+#include <coroexample/generator.h>
@@ -0,0 +1,330 @@
+// coroexample_generator.h                                            -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_GENERATOR
+#define INCLUDED_COROEXAMPLE_GENERATOR
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include <coroexample/cancellation.h>
+#include <coroexample/frameallocator.h>
+
+///////////////////////////////////////////////////
+// generator<T> / async_generator<T> - lazily produced sequences
+//
+// A generator coroutine hands out a sequence of values with `co_yield`,
+// running only when the consumer asks for the next element:
+//
+//   generator<int> iota(int n) {
+//       for (int i = 0; i < n; ++i) co_yield i;
+//   }
+//
+//   for (int i : iota(10)) { ... }
+//
+// An `async_generator` may also `co_await` between yields, and is consumed
+// from a coroutine. C++20 has no `for co_await`, so the loop is spelled
+// out, awaiting begin() and each increment:
+//
+//   async_generator<row> rows(connection& c);
+//
+//   auto gen = rows(c);
+//   for (auto it = co_await gen.begin(); it != gen.end(); co_await ++it) {
+//       process(*it);
+//   }
+//
+// `co_yield x` does not copy or move 'x'. As with sync_wait()'s
+// yield_value(), the promise just records its address, and the producer
+// stays suspended inside the co_yield expression - so even a temporary
+// is still alive - until the consumer advances the iterator. Dereferencing
+// the iterator yields a reference to the producer's object; it is valid
+// until the next increment. Back-pressure follows: the producer never runs
+// ahead of the consumer by more than one element. The exception is a
+// const lvalue yielded by a generator of a non-const value type, which
+// the consumer may modify through the reference: that is copied, into
+// the co_yield's awaiter, as std::generator does.
+//
+// The async_generator producer resumes the consumer by symmetric transfer
+// at each co_yield, and inherits the stop token of the coroutine that
+// advances it. Frames come from `frame_allocating_promise`.
+//
+// An exception that escapes the producer is rethrown from begin() or from
+// the increment that resumed it, and ends the sequence.
+
+template <typename T>
+struct generator;
+
+template <typename T>
+struct async_generator;
+
+template <typename T>
+struct _generator_promise_base : frame_allocating_promise {
+    using value_type = std::remove_cvref_t<T>;
+    using reference  = std::conditional_t<std::is_reference_v<T>, T, T&>;
+    using pointer    = std::add_pointer_t<reference>;
+    using yielded    = std::remove_reference_t<reference>;
+
+    // Whether a const lvalue can be yielded: one that can't be referenced
+    // as 'yielded' is copied, unless T is itself a reference.
+    static constexpr bool copies_const_lvalues =
+        !std::is_reference_v<T> && !std::is_const_v<yielded> &&
+        std::is_copy_constructible_v<value_type>;
+
+    // Wraps the awaiter of a co_yield, holding the copy of a const lvalue
+    // for the consumer to refer to until the generator is resumed.
+    template <typename Awaiter>
+    struct yield_copy : Awaiter {
+        value_type copy;
+
+        template <typename Promise>
+        auto await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            h.promise().value = std::addressof(copy);
+            return Awaiter::await_suspend(h);
+        }
+    };
+
+    pointer            value{nullptr};
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept {
+        exception = std::current_exception();
+    }
+
+    void rethrow_if_failed() {
+        if (exception) [[unlikely]] {
+            std::rethrow_exception(std::exchange(exception, nullptr));
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// generator<T>
+
+template <typename T>
+struct [[nodiscard]] generator {
+    struct promise_type : _generator_promise_base<T> {
+        using base = _generator_promise_base<T>;
+
+        generator get_return_object() noexcept {
+            return generator{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        // A generator can't suspend other than at co_yield.
+        template <typename A>
+        void await_transform(A&&) = delete;
+
+        std::suspend_always yield_value(typename base::yielded& v) noexcept {
+            this->value = std::addressof(v);
+            return {};
+        }
+
+        std::suspend_always yield_value(typename base::yielded&& v) noexcept {
+            this->value = std::addressof(v);
+            return {};
+        }
+
+        auto yield_value(const typename base::yielded& v)
+        requires base::copies_const_lvalues
+        {
+            using awaiter = typename base::template yield_copy<
+                std::suspend_always>;
+            return awaiter{{}, v};
+        }
+    };
+
+  private:
+    using handle_t = std::coroutine_handle<promise_type>;
+    handle_t coro;
+
+    explicit generator(handle_t h) noexcept : coro(h) {}
+
+  public:
+    using value_type = typename promise_type::value_type;
+    using reference  = typename promise_type::reference;
+
+    struct iterator {
+        using iterator_concept = std::input_iterator_tag;
+        using difference_type  = std::ptrdiff_t;
+        using value_type       = generator::value_type;
+
+        handle_t coro;
+
+        reference operator*() const noexcept {
+            return static_cast<reference>(*coro.promise().value);
+        }
+
+        iterator& operator++() {
+            coro.resume();
+            coro.promise().rethrow_if_failed();
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        friend bool operator==(const iterator&       it,
+                               std::default_sentinel_t) noexcept {
+            return it.coro.done();
+        }
+    };
+
+    generator(generator&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+
+    ~generator() {
+        if (coro)
+            coro.destroy();
+    }
+
+    iterator begin() {
+        coro.resume();
+        coro.promise().rethrow_if_failed();
+        return iterator{coro};
+    }
+
+    std::default_sentinel_t end() const noexcept { return {}; }
+};
+
+////////////////////////////////////////////////////////////////
+// async_generator<T>
+
+template <typename T>
+struct async_generator_promise : _generator_promise_base<T>,
+                                 stop_token_promise {
+    using base = _generator_promise_base<T>;
+
+    // The coroutine waiting for the next element.
+    std::coroutine_handle<> consumer;
+
+    async_generator<T> get_return_object() noexcept;
+
+    struct yield_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<async_generator_promise> h) noexcept {
+            return h.promise().consumer;
+        }
+        void await_resume() noexcept {}
+    };
+
+    yield_awaiter final_suspend() noexcept { return {}; }
+
+    yield_awaiter yield_value(typename base::yielded& v) noexcept {
+        this->value = std::addressof(v);
+        return {};
+    }
+
+    yield_awaiter yield_value(typename base::yielded&& v) noexcept {
+        this->value = std::addressof(v);
+        return {};
+    }
+
+    auto yield_value(const typename base::yielded& v)
+    requires base::copies_const_lvalues
+    {
+        return typename base::template yield_copy<yield_awaiter>{{}, v};
+    }
+};
+
+template <typename T>
+struct [[nodiscard]] async_generator {
+    using promise_type = async_generator_promise<T>;
+    using value_type   = typename promise_type::value_type;
+    using reference    = typename promise_type::reference;
+
+  private:
+    using handle_t = std::coroutine_handle<promise_type>;
+    handle_t coro;
+
+    friend promise_type;
+
+    explicit async_generator(handle_t h) noexcept : coro(h) {}
+
+  public:
+    struct iterator;
+
+  private:
+    // Resumes the producer until its next co_yield, or until it finishes.
+    template <typename Result>
+    struct advance_awaiter {
+        handle_t  coro;
+        iterator* it; // null for begin()
+
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        handle_t await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            coro.promise().consumer = h;
+            coro.promise().stop     = get_stop_token(h);
+            return coro;
+        }
+
+        Result await_resume() {
+            coro.promise().rethrow_if_failed();
+            if constexpr (std::is_same_v<Result, iterator&>) {
+                return *it;
+            } else {
+                return iterator{coro};
+            }
+        }
+    };
+
+  public:
+    struct iterator {
+        using iterator_concept = std::input_iterator_tag;
+        using difference_type  = std::ptrdiff_t;
+        using value_type       = async_generator::value_type;
+
+        handle_t coro;
+
+        reference operator*() const noexcept {
+            return static_cast<reference>(*coro.promise().value);
+        }
+
+        std::add_pointer_t<reference> operator->() const noexcept {
+            return coro.promise().value;
+        }
+
+        // co_await ++it
+        advance_awaiter<iterator&> operator++() noexcept {
+            return {coro, this};
+        }
+
+        friend bool operator==(const iterator&       it,
+                               std::default_sentinel_t) noexcept {
+            return it.coro.done();
+        }
+    };
+
+    async_generator(async_generator&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+
+    ~async_generator() {
+        if (coro)
+            coro.destroy();
+    }
+
+    // co_await gen.begin()
+    advance_awaiter<iterator> begin() noexcept {
+        return {coro, nullptr};
+    }
+
+    std::default_sentinel_t end() const noexcept { return {}; }
+};
+
+template <typename T>
+async_generator<T> async_generator_promise<T>::get_return_object() noexcept {
+    return async_generator<T>{
+        std::coroutine_handle<async_generator_promise>::from_promise(*this)};
+}
+
+#endif
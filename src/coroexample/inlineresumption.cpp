@@ -0,0 +1,31 @@
+// coroexample_inlineresumption.cpp                                   -*-C++-*-
+#include <coroexample/inlineresumption.h>
+
+#include <algorithm>
+
+void inline_resumption::defer(state& s, std::coroutine_handle<> h) noexcept {
+    try {
+        if (s.deferred.capacity() == 0) {
+            s.deferred.reserve(std::max(s.budget, default_budget));
+        }
+        s.deferred.push_back(h);
+    } catch (...) {
+        // Out of memory: go deeper than the budget rather than lose 'h'.
+        ++s.depth;
+        h.resume();
+        --s.depth;
+        return;
+    }
+    ++s.deferred_total;
+}
+
+void inline_resumption::drain(state& s) noexcept {
+    // Coroutines resumed here may defer more, which go on the end.
+    for (std::size_t i = 0; i < s.deferred.size(); ++i) {
+        std::coroutine_handle<> h = s.deferred[i];
+        s.depth                   = 1;
+        h.resume();
+    }
+    s.depth = 0;
+    s.deferred.clear();
+}
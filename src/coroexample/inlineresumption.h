@@ -0,0 +1,86 @@
+// coroexample_inlineresumption.h                                     -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_INLINERESUMPTION
+#define INCLUDED_COROEXAMPLE_INLINERESUMPTION
+
+#include <coroutine>
+#include <cstddef>
+#include <vector>
+
+#include <coroexample/generalhelper.h>
+
+/////////////////////////////////////////////////
+// inline_resumption
+//
+// The synchronisation primitives resume the coroutines they release on
+// the releasing thread, from inside set(), unlock(), release() or the
+// final_awaiter of a scope's last task. That is the fast path, but if the
+// resumed coroutine releases the next one in turn, and so on, each link
+// of the chain is a nested call: a relay of a million tasks through as
+// many events recurses a million frames deep on one worker's stack.
+// Symmetric transfer doesn't help, as set() can wake several waiters and
+// has to get control back after each.
+//
+// So those resumptions go through `inline_resumption::resume(h)`, which
+// counts how deeply they are nested on the calling thread. Under the
+// thread's budget, it resumes 'h' there and then. At the budget, it
+// appends 'h' to a per-thread list instead, and the outermost resume()
+// on the thread resumes the deferred coroutines in order once its own
+// call returns, each starting again from a depth of one. The stack is
+// then bounded by the budget, and a completion is never sent through a
+// scheduler's queue, which the releasing thread might not even be
+// running.
+//
+// The list is a vector kept for the thread's lifetime, reserved a chunk
+// at a time from the first deferral, so deferring only allocates while
+// it grows to the longest cascade the thread has seen. If it can't grow,
+// the coroutine is resumed there and then, nesting past the budget,
+// rather than lost or left to abort the releasing set() or unlock().
+
+struct inline_resumption {
+    static constexpr unsigned default_budget = 64;
+
+    // Resumes 'h' now, unless budget() resumptions are already nested on
+    // this thread, in which case the outermost of them resumes it later.
+    FORCE_INLINE static void resume(std::coroutine_handle<> h) noexcept {
+        state& s = local;
+        if (s.depth >= s.budget) [[unlikely]] {
+            defer(s, h);
+            return;
+        }
+        ++s.depth;
+        h.resume();
+        if (--s.depth == 0 && !s.deferred.empty()) [[unlikely]] {
+            drain(s);
+        }
+    }
+
+    // How many resume() calls are in progress on this thread.
+    static unsigned depth() noexcept { return local.depth; }
+
+    static unsigned budget() noexcept { return local.budget; }
+
+    // Sets the calling thread's budget; at least 1.
+    static void set_budget(unsigned n) noexcept {
+        local.budget = n > 0 ? n : 1;
+    }
+
+    // Resumptions this thread has had to defer.
+    static std::size_t deferrals() noexcept { return local.deferred_total; }
+
+  private:
+    struct state {
+        unsigned                             depth{0};
+        unsigned                             budget{default_budget};
+        std::size_t                          deferred_total{0};
+        std::vector<std::coroutine_handle<>> deferred;
+    };
+
+    static void defer(state& s, std::coroutine_handle<> h) noexcept;
+    static void drain(state& s) noexcept;
+
+    static thread_local state local;
+};
+
+inline thread_local inline_resumption::state inline_resumption::local{};
+
+#endif
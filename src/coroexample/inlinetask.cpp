@@ -0,0 +1,2 @@
+// coroexample_inlinetask.cpp                                         -*-C++-*-
+#include <coroexample/inlinetask.h>
@@ -0,0 +1,181 @@
+// coroexample_inlinetask.h                                           -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_INLINETASK
+#define INCLUDED_COROEXAMPLE_INLINETASK
+
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <new>
+#include <source_location>
+#include <utility>
+
+#include <coroexample/cancellation.h>
+#include <coroexample/frameallocator.h>
+#include <coroexample/framestats.h>
+
+///////////////////////////////////////////////////
+// inline_task<T> - task with a synchronous-completion fast path
+//
+// Like task<T> this is lazily started, but awaiting it resumes the child
+// coroutine directly from await_suspend() rather than by symmetric
+// transfer. If the child runs to completion without suspending, the
+// awaiting coroutine is never suspended at all: await_suspend() returns
+// false and execution continues straight into await_resume().
+//
+// If the child does suspend, whichever of the awaiter and the child's
+// final_suspend gets to the `ready` flag second is responsible for
+// resuming the parent, and the child does so by symmetric transfer. The
+// inline resume() only ever nests as deep as the chain of synchronously
+// completing calls, so loops of synchronously completing awaits do not
+// grow the stack.
+//
+// The result is held in a union alongside an exception_ptr rather than in
+// a std::variant, so the happy path of await_resume() is a null test on
+// the exception_ptr followed by a move of the value.
+
+template <typename T>
+struct inline_task;
+
+template <typename T>
+struct inline_task_result {
+    union {
+        T value;
+    };
+    std::exception_ptr exception;
+    bool               has_value{false};
+
+    inline_task_result() noexcept {}
+    ~inline_task_result() {
+        if (has_value) {
+            value.~T();
+        }
+    }
+
+    template <typename U>
+    requires std::convertible_to<U, T>
+    void
+    return_value(U&& v) noexcept(std::is_nothrow_constructible_v<T, U>) {
+        ::new (static_cast<void*>(std::addressof(value)))
+            T(std::forward<U>(v));
+        has_value = true;
+    }
+
+    void unhandled_exception() noexcept {
+        exception = std::current_exception();
+    }
+
+    T get() {
+        if (exception) [[unlikely]] {
+            std::rethrow_exception(std::move(exception));
+        }
+        return std::move(value);
+    }
+};
+
+template <>
+struct inline_task_result<void> {
+    std::exception_ptr exception;
+
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept {
+        exception = std::current_exception();
+    }
+
+    void get() {
+        if (exception) [[unlikely]] {
+            std::rethrow_exception(std::move(exception));
+        }
+    }
+};
+
+template <typename T>
+struct inline_task_promise : frame_allocating_promise,
+                             stop_token_promise,
+                             inline_task_result<T> {
+    inline_task_promise(std::source_location where =
+                            std::source_location::current()) noexcept {
+        note_frame_constructed(
+            std::coroutine_handle<inline_task_promise>::from_promise(*this)
+                .address(),
+            where);
+    }
+
+    inline_task<T> get_return_object() noexcept;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<inline_task_promise> h) noexcept {
+            inline_task_promise& p = h.promise();
+            if (p.ready.exchange(true, std::memory_order_acq_rel)) {
+                // The awaiter has already suspended the parent.
+                return p.continuation;
+            }
+            // Completed synchronously; return to the awaiter's resume().
+            return std::noop_coroutine();
+        }
+        [[noreturn]] void await_resume() noexcept { std::terminate(); }
+    };
+
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    std::coroutine_handle<> continuation;
+    std::atomic<bool>       ready{false};
+};
+
+template <typename T>
+struct [[nodiscard]] inline_task {
+  private:
+    using handle_t = std::coroutine_handle<inline_task_promise<T>>;
+    handle_t coro;
+
+    struct awaiter {
+        handle_t coro;
+        bool     await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            inline_task_promise<T>& p = coro.promise();
+            p.continuation            = h;
+            p.stop                    = get_stop_token(h);
+            coro.resume();
+            if (p.ready.load(std::memory_order_acquire)) {
+                // Child finished before we got here: don't suspend.
+                return false;
+            }
+            return !p.ready.exchange(true, std::memory_order_acq_rel);
+        }
+
+        T await_resume() { return coro.promise().get(); }
+    };
+
+    friend struct inline_task_promise<T>;
+
+    explicit inline_task(handle_t h) noexcept : coro(h) {}
+
+  public:
+    using promise_type = inline_task_promise<T>;
+
+    inline_task(inline_task&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+
+    ~inline_task() {
+        if (coro)
+            coro.destroy();
+    }
+
+    awaiter operator co_await() && { return awaiter{coro}; }
+};
+
+template <typename T>
+inline_task<T> inline_task_promise<T>::get_return_object() noexcept {
+    return inline_task<T>{
+        std::coroutine_handle<inline_task_promise<T>>::from_promise(*this)};
+}
+
+#endif
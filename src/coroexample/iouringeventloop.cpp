@@ -0,0 +1,320 @@
+// coroexample_iouringeventloop.cpp                                   -*-C++-*-
+#include <coroexample/iouringeventloop.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+int io_uring_setup(unsigned entries, io_uring_params* params) noexcept {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int      fd,
+                   unsigned to_submit,
+                   unsigned min_complete,
+                   unsigned flags) noexcept {
+    return static_cast<int>(::syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+unsigned load_acquire(unsigned* p) noexcept {
+    return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+}
+
+void store_release(unsigned* p, unsigned v) noexcept {
+    std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+}
+
+void* map_ring(int fd, std::size_t size, off_t offset) {
+    void* p = ::mmap(nullptr,
+                     size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     fd,
+                     offset);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::system_category(), "mmap");
+    }
+    return p;
+}
+
+template <typename T>
+T* at(void* base, unsigned offset) noexcept {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+} // namespace
+
+io_uring_event_loop::io_uring_event_loop(unsigned entries) {
+    io_uring_params params{};
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        throw std::system_error(
+            errno, std::system_category(), "io_uring_setup");
+    }
+
+    // The destructor won't run if we throw, so clean up by hand.
+    try {
+        sq_ring_size =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size = cq_ring_size =
+                std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = map_ring(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = map_ring(ring_fd, cq_ring_size, IORING_OFF_CQ_RING);
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes      = static_cast<io_uring_sqe*>(
+            map_ring(ring_fd, sqes_size, IORING_OFF_SQES));
+
+        sq_head       = at<unsigned>(sq_ring, params.sq_off.head);
+        sq_tail       = at<unsigned>(sq_ring, params.sq_off.tail);
+        sq_array      = at<unsigned>(sq_ring, params.sq_off.array);
+        sq_mask       = *at<unsigned>(sq_ring, params.sq_off.ring_mask);
+        sq_entries    = *at<unsigned>(sq_ring, params.sq_off.ring_entries);
+        sq_local_tail = *sq_tail;
+
+        cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+        cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+        cq_mask = *at<unsigned>(cq_ring, params.cq_off.ring_mask);
+        cqes    = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+        wake_fd = ::eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            throw std::system_error(
+                errno, std::system_category(), "eventfd");
+        }
+    } catch (...) {
+        close();
+        throw;
+    }
+
+    wake_op = make_op(
+        IORING_OP_READ, wake_fd, &wake_value, sizeof(wake_value), 0);
+}
+
+io_uring_event_loop::~io_uring_event_loop() { close(); }
+
+void io_uring_event_loop::close() noexcept {
+    if (wake_fd >= 0) {
+        ::close(wake_fd);
+    }
+    if (sqes != nullptr) {
+        ::munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+        ::munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+        ::munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0) {
+        ::close(ring_fd);
+    }
+}
+
+void io_uring_event_loop::wake() noexcept {
+    // Coalesce wake-ups: only the first one after the loop last consumed
+    // the eventfd needs to write to it.
+    if (!notified.exchange(true, std::memory_order_acq_rel)) {
+        std::uint64_t one = 1;
+        [[maybe_unused]] ssize_t n = ::write(wake_fd, &one, sizeof(one));
+    }
+}
+
+void io_uring_event_loop::enqueue(queue_item* item) noexcept {
+    item->next = nullptr;
+    {
+        std::lock_guard lock{mut};
+        if (ready_head == nullptr) {
+            ready_head = item;
+        } else {
+            ready_tail->next = item;
+        }
+        ready_tail = item;
+    }
+    if (!on_loop_thread()) {
+        wake();
+    }
+}
+
+void io_uring_event_loop::start(io_operation* op) noexcept {
+    if (on_loop_thread()) {
+        push_sqe(op);
+        return;
+    }
+
+    op->next = nullptr;
+    {
+        std::lock_guard lock{mut};
+        if (inbox_head == nullptr) {
+            inbox_head = op;
+        } else {
+            inbox_tail->next = op;
+        }
+        inbox_tail = op;
+    }
+    wake();
+}
+
+void io_uring_event_loop::push_sqe(io_operation* op) noexcept {
+    // Ring full: hand what we have to the kernel to make room. EBUSY (the
+    // completion queue has overflowed) and EAGAIN mean it won't take any
+    // until completions are consumed, which may resume coroutines that
+    // start more operations.
+    while (sq_local_tail - load_acquire(sq_head) == sq_entries) {
+        int err = submit(0);
+        if (err == EBUSY || err == EAGAIN) {
+            reap_completions();
+        } else if (err != 0) {
+            op->result = -err;
+            op->next   = nullptr;
+            if (failed_head == nullptr) {
+                failed_head = op;
+            } else {
+                failed_tail->next = op;
+            }
+            failed_tail = op;
+            return;
+        }
+    }
+
+    unsigned      index = sq_local_tail & sq_mask;
+    io_uring_sqe* sqe   = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op->opcode;
+    sqe->fd        = op->fd;
+    sqe->addr      = op->addr;
+    sqe->len       = op->len;
+    sqe->off       = op->off;
+    sqe->rw_flags  = static_cast<__kernel_rwf_t>(op->op_flags);
+    sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+
+    sq_array[index] = index;
+    ++sq_local_tail;
+    ++to_submit;
+}
+
+int io_uring_event_loop::submit(unsigned wait_for) noexcept {
+    if (to_submit == 0 && wait_for == 0) {
+        return 0;
+    }
+    store_release(sq_tail, sq_local_tail);
+
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        int n = io_uring_enter(ring_fd, to_submit, wait_for, flags);
+        if (n >= 0) {
+            to_submit -= static_cast<unsigned>(n);
+            return 0;
+        }
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+}
+
+void io_uring_event_loop::reap_completions() noexcept {
+    // The head is read afresh each time, as a coroutine resumed here may
+    // find the submission ring full and reap completions itself.
+    unsigned head;
+    while ((head = *cq_head) != load_acquire(cq_tail)) {
+        io_uring_cqe& cqe = cqes[head & cq_mask];
+        auto* op          = reinterpret_cast<io_operation*>(cqe.user_data);
+        op->result        = cqe.res;
+        // Release the slot before resuming, which may queue more SQEs.
+        store_release(cq_head, head + 1);
+
+        if (op == &wake_op) {
+            notified.store(false, std::memory_order_release);
+            wake_armed = false;
+        } else {
+            op->coro.resume();
+        }
+    }
+}
+
+bool io_uring_event_loop::resume_failed() noexcept {
+    bool any = false;
+    while (failed_head != nullptr) {
+        io_operation* op = std::exchange(failed_head, nullptr);
+        failed_tail      = nullptr;
+        while (op != nullptr) {
+            io_operation* next = op->next;
+            any                = true; // so the loop doesn't block
+            if (op == &wake_op) {
+                wake_armed = false; // re-armed on the next pass
+            } else {
+                op->coro.resume();
+            }
+            op = next;
+        }
+    }
+    return any;
+}
+
+bool io_uring_event_loop::drain_ready() noexcept {
+    queue_item*   ready;
+    io_operation* inbox;
+    {
+        std::lock_guard lock{mut};
+        ready      = ready_head;
+        inbox      = inbox_head;
+        ready_head = ready_tail = nullptr;
+        inbox_head = inbox_tail = nullptr;
+    }
+
+    bool any = ready != nullptr;
+    while (inbox != nullptr) {
+        io_operation* next = inbox->next;
+        push_sqe(inbox);
+        inbox = next;
+    }
+    while (ready != nullptr) {
+        queue_item* next = ready->next;
+        ready->coro.resume();
+        ready = next;
+    }
+    // Including any that failed while the ready ones ran.
+    return resume_failed() || any;
+}
+
+void io_uring_event_loop::run(std::stop_token st) {
+    io_uring_event_loop* saved = std::exchange(current, this);
+    std::stop_callback   cb{st, [this]() noexcept {
+                             notified.store(false, std::memory_order_relaxed);
+                             wake();
+                         }};
+    current_scheduler_scope on_loop{*this};
+
+    while (!st.stop_requested()) {
+        if (!wake_armed) {
+            push_sqe(&wake_op);
+            wake_armed = true;
+        }
+        // Coroutines resumed here may have scheduled more work, so only
+        // block in the kernel once a pass finds nothing ready.
+        int err = drain_ready() ? submit(0) : submit(1);
+        if (err != 0 && err != EBUSY && err != EAGAIN) {
+            throw std::system_error(
+                err, std::system_category(), "io_uring_enter");
+        }
+        // After EBUSY or EAGAIN this is what lets the kernel carry on.
+        reap_completions();
+    }
+
+    current = saved;
+}
@@ -0,0 +1,264 @@
+// coroexample_iouringeventloop.h                                     -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_IOURINGEVENTLOOP
+#define INCLUDED_COROEXAMPLE_IOURINGEVENTLOOP
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <system_error>
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <coroexample/currentscheduler.h>
+
+/////////////////////////////////////////////////
+// io_uring_event_loop
+//
+// A single-threaded event loop that multiplexes coroutines over Linux
+// io_uring, so that a coroutine can be resumed when an I/O operation
+// completes:
+//
+//   std::size_t n = co_await loop.read(fd, buffer);
+//
+// It offers the same `co_await loop.schedule()` as `manual_event_loop`,
+// plus awaitables for read/write, recv/send and accept/connect. Each
+// awaitable carries its own operation state, so operations never
+// allocate; the address of that state is the io_uring user_data, and
+// completions resume the awaiting coroutine directly.
+//
+// Exactly one thread calls `run()`. Operations started on that thread
+// write their SQE straight into the submission ring; all SQEs queued
+// while resuming coroutines are handed to the kernel by the single
+// io_uring_enter() call that also waits for the next completion.
+// Operations and schedule() calls from other threads go through a
+// mutex-protected inbox and wake the loop through an eventfd.
+//
+// Failed operations throw std::system_error from await_resume(). So do
+// operations that can't be submitted because io_uring_enter() fails for a
+// reason other than the kernel wanting its completions consumed first
+// (EBUSY or EAGAIN), which the loop does before trying again.
+//
+// The ring is driven with the raw system calls, so there is no dependency
+// on liburing.
+
+struct io_uring_event_loop {
+  private:
+    struct queue_item {
+        queue_item*             next;
+        std::coroutine_handle<> coro;
+    };
+
+    struct io_operation {
+        io_uring_event_loop*    loop;
+        io_operation*           next{nullptr};
+        std::coroutine_handle<> coro;
+        int                     result{0};
+
+        std::uint8_t  opcode;
+        int           fd;
+        std::uint64_t addr{0};
+        std::uint32_t len{0};
+        std::uint64_t off{0};
+        std::uint32_t op_flags{0};
+
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            coro = h;
+            loop->start(this);
+        }
+
+      protected:
+        int checked_result() const {
+            if (result < 0) {
+                throw std::system_error(-result, std::system_category());
+            }
+            return result;
+        }
+    };
+
+    struct transfer_awaitable : io_operation {
+        std::size_t await_resume() {
+            return static_cast<std::size_t>(checked_result());
+        }
+    };
+
+    struct accept_awaitable : io_operation {
+        int await_resume() { return checked_result(); }
+    };
+
+    struct connect_awaitable : io_operation {
+        void await_resume() { checked_result(); }
+    };
+
+    struct schedule_awaitable {
+        using scheduler_type = io_uring_event_loop;
+
+        io_uring_event_loop* loop;
+        queue_item           item;
+
+        explicit schedule_awaitable(io_uring_event_loop& loop) noexcept
+            : loop(&loop) {}
+
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> coro) noexcept {
+            item.coro = coro;
+            loop->enqueue(&item);
+        }
+        void await_resume() noexcept {}
+    };
+
+    int ring_fd{-1};
+    int wake_fd{-1};
+
+    // Submission ring.
+    void*         sq_ring{nullptr};
+    std::size_t   sq_ring_size{0};
+    unsigned*     sq_head;
+    unsigned*     sq_tail;
+    unsigned*     sq_array;
+    unsigned      sq_mask;
+    unsigned      sq_entries;
+    io_uring_sqe* sqes{nullptr};
+    std::size_t   sqes_size{0};
+    unsigned      sq_local_tail{0}; // SQEs written but not yet published
+    unsigned      to_submit{0};
+
+    // Completion ring.
+    void*         cq_ring{nullptr};
+    std::size_t   cq_ring_size{0};
+    unsigned*     cq_head;
+    unsigned*     cq_tail;
+    unsigned      cq_mask;
+    io_uring_cqe* cqes;
+
+    std::mutex        mut;
+    queue_item*       ready_head{nullptr};
+    queue_item*       ready_tail{nullptr};
+    io_operation*     inbox_head{nullptr};
+    io_operation*     inbox_tail{nullptr};
+    std::atomic<bool> notified{false};
+
+    // Operations the kernel couldn't be given, to be completed with the
+    // error by the run loop. Only touched on the loop thread.
+    io_operation* failed_head{nullptr};
+    io_operation* failed_tail{nullptr};
+
+    io_operation  wake_op;
+    std::uint64_t wake_value{0};
+    bool          wake_armed{false};
+
+    static inline thread_local io_uring_event_loop* current{nullptr};
+
+    bool on_loop_thread() const noexcept { return current == this; }
+
+    void close() noexcept;
+    void wake() noexcept;
+    void enqueue(queue_item* item) noexcept;
+    void start(io_operation* op) noexcept;
+    void push_sqe(io_operation* op) noexcept;
+    int  submit(unsigned wait_for) noexcept;
+    void reap_completions() noexcept;
+    bool resume_failed() noexcept;
+    bool drain_ready() noexcept;
+
+    io_operation make_op(std::uint8_t  opcode,
+                         int           fd,
+                         const void*   addr,
+                         std::uint32_t len,
+                         std::uint64_t off) noexcept {
+        io_operation op;
+        op.loop   = this;
+        op.opcode = opcode;
+        op.fd     = fd;
+        op.addr   = reinterpret_cast<std::uint64_t>(addr);
+        op.len    = len;
+        op.off    = off;
+        return op;
+    }
+
+  public:
+    // Throws std::system_error if io_uring is unavailable.
+    explicit io_uring_event_loop(unsigned entries = 256);
+    ~io_uring_event_loop();
+
+    io_uring_event_loop(const io_uring_event_loop&)            = delete;
+    io_uring_event_loop& operator=(const io_uring_event_loop&) = delete;
+
+    schedule_awaitable schedule() noexcept {
+        return schedule_awaitable{*this};
+    }
+
+    // Reads at the file's current position when 'offset' is -1.
+    transfer_awaitable read(int                  fd,
+                            std::span<std::byte> buffer,
+                            std::int64_t         offset = -1) noexcept {
+        return {make_op(IORING_OP_READ,
+                        fd,
+                        buffer.data(),
+                        static_cast<std::uint32_t>(buffer.size()),
+                        static_cast<std::uint64_t>(offset))};
+    }
+
+    transfer_awaitable write(int                        fd,
+                             std::span<const std::byte> buffer,
+                             std::int64_t offset = -1) noexcept {
+        return {make_op(IORING_OP_WRITE,
+                        fd,
+                        buffer.data(),
+                        static_cast<std::uint32_t>(buffer.size()),
+                        static_cast<std::uint64_t>(offset))};
+    }
+
+    transfer_awaitable
+    recv(int fd, std::span<std::byte> buffer, int flags = 0) noexcept {
+        transfer_awaitable op{
+            make_op(IORING_OP_RECV,
+                    fd,
+                    buffer.data(),
+                    static_cast<std::uint32_t>(buffer.size()),
+                    0)};
+        op.op_flags = static_cast<std::uint32_t>(flags);
+        return op;
+    }
+
+    transfer_awaitable
+    send(int fd, std::span<const std::byte> buffer, int flags = 0) noexcept {
+        transfer_awaitable op{
+            make_op(IORING_OP_SEND,
+                    fd,
+                    buffer.data(),
+                    static_cast<std::uint32_t>(buffer.size()),
+                    0)};
+        op.op_flags = static_cast<std::uint32_t>(flags);
+        return op;
+    }
+
+    // Resumes with the accepted socket. 'addr'/'addrlen' may be null.
+    accept_awaitable accept(int        fd,
+                            sockaddr*  addr    = nullptr,
+                            socklen_t* addrlen = nullptr,
+                            int        flags   = 0) noexcept {
+        accept_awaitable op{make_op(IORING_OP_ACCEPT,
+                                    fd,
+                                    addr,
+                                    0,
+                                    reinterpret_cast<std::uint64_t>(addrlen))};
+        op.op_flags = static_cast<std::uint32_t>(flags);
+        return op;
+    }
+
+    connect_awaitable
+    connect(int fd, const sockaddr* addr, socklen_t addrlen) noexcept {
+        return {make_op(IORING_OP_CONNECT, fd, addr, 0, addrlen)};
+    }
+
+    // Drives the ring on the calling thread until 'st' is signalled.
+    void run(std::stop_token st);
+};
+
+#endif
@@ -2,9 +2,23 @@
 #ifndef INCLUDED_COROEXAMPLE_MANUALEVENTLOOP
 #define INCLUDED_COROEXAMPLE_MANUALEVENTLOOP
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <coroutine>
+#include <cstddef>
+#include <cstdint>
 #include <mutex>
+#include <optional>
+#include <stop_token>
+#include <utility>
+
+#include <coroexample/asyncstacks.h>
+#include <coroexample/cancellation.h>
+#include <coroexample/currentscheduler.h>
+#include <coroexample/generalhelper.h>
+#include <coroexample/timerqueue.h>
+#include <coroexample/tracing.h>
 
 /////////////////////////////////////////////////
 // manual_event_loop
@@ -13,84 +27,488 @@
 //
 // Uses mutex/condition_variable for synchronisation and supports
 // multiple work threads running tasks.
+//
+// Coroutines can also wait for a point in time with
+// `co_await loop.schedule_at(tp)` or `co_await loop.schedule_after(d)`.
+// Pending timers are kept in an intrusive timer_queue; when one expires it
+// is moved onto the run queue. Idle workers wait on the condition variable
+// only until the earliest deadline.
+//
+// The loop tracks how many workers are parked on the condition variable and
+// only notifies it when one of them hasn't been signalled yet, so pushing
+// onto a queue that busy workers are draining doesn't make a futex call.
+//
+// `run_until(done)` runs work on the calling thread until a flag is set;
+// `sync_wait(loop, t)` uses it to keep the waiting thread busy.
+//
+// `run_batched()` is an alternative to `run()` for bursty workloads: it
+// takes the whole pending list in one lock acquisition and resumes it
+// without touching the lock again, and it spins briefly on an atomic flag
+// before parking. `stats()` reports wakeups, sleeps, spins and batch sizes.
+//
+// Work is queued on one of a few priority lanes, chosen with
+// `co_await loop.schedule(priority::high)` (the default is
+// `priority::normal`, and timers take an optional priority too). Workers
+// always take from the highest non-empty lane, except that a lane which
+// has been passed over `starvation_limit` times while non-empty is served
+// next, so background work keeps making progress under a constant stream
+// of high-priority work. Each lane is FIFO and, as before, intrusive, so
+// scheduling at any priority is allocation-free. run_batched() takes the
+// whole of the chosen lane as one batch.
+//
+// The awaitables are cancellable through the awaiting coroutine's stop
+// token (see cancellation.h). schedule() completes immediately with
+// `operation_cancelled` if stop was already requested; once queued it is
+// about to run anyway, so it is not unlinked. A timer registers a stop
+// callback which unlinks it from the timer queue and moves it straight to
+// the run queue, so it resumes on a loop thread with
+// `operation_cancelled` instead of waiting out its deadline. Awaiters with
+// no stoppable token register no callback.
+//
+// With tracing enabled (see tracing.h), run() and run_batched() record how
+// long each coroutine waited in the queue. With async stacks enabled (see
+// asyncstacks.h), a task waiting in the loop's queue or for one of its
+// timers is marked as such.
+//
+// Threads in run(), run_batched() or run_until() are marked as running
+// work for the loop (see currentscheduler.h), which is how an affine_task
+// tells whether it has been resumed somewhere else.
 
 struct manual_event_loop {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    enum class priority : unsigned char { high, normal, low };
+
+    static constexpr std::size_t lane_count = 3;
+
+    // Times a non-empty lane may be passed over before it is served.
+    static constexpr unsigned starvation_limit = 64;
+
+    struct loop_stats {
+        std::size_t wakeups{0};     // notifications sent to parked workers
+        std::size_t sleeps{0};      // times a worker parked on the cv
+        std::size_t spins{0};       // idle spin phases (run_batched only)
+        std::size_t spin_hits{0};   // spin phases that found work
+        std::size_t batches{0};     // batches taken by run_batched
+        std::size_t batch_items{0}; // items resumed by run_batched
+        std::size_t promotions{0};  // lanes served to prevent starvation
+    };
+
+    // Spin iterations before a run_batched() worker parks.
+    static constexpr int default_spin_count = 2000;
+
   private:
     struct queue_item {
         queue_item*             next;
-        std::coroutine_handle<> coro;
+        std::coroutine_handle<>           coro;
+        priority                          lane{priority::normal};
+        [[no_unique_address]] trace_stamp enqueued;
+    };
+
+    struct lane {
+        queue_item* head{nullptr};
+        queue_item* tail{nullptr};
+        unsigned    passed_over{0}; // times skipped while non-empty
+    };
+
+    struct timer_item : timer_node {
+        queue_item item;
+        bool       pending{false};   // in 'timers'; guarded by 'mut'
+        bool       cancelled{false}; // guarded by 'mut' until resumed
     };
 
     std::mutex              mut;
     std::condition_variable cv;
-    queue_item*             head{nullptr};
-    queue_item*             tail{nullptr};
+    lane                    lanes[lane_count];
+    timer_queue             timers;
+    std::size_t             sleepers{0};  // parked on the cv
+    std::size_t             signalled{0}; // of those, already notified
+    loop_stats              counters;
 
-    void enqueue(queue_item* item) noexcept {
-        std::lock_guard lock{mut};
+    // Mirrors has_items() so spinning workers can poll without the lock.
+    std::atomic<bool> non_empty{false};
+
+    bool has_items() const noexcept {
+        for (const lane& l : lanes) {
+            if (l.head != nullptr) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void push_item(queue_item* item) noexcept {
+        lane& l    = lanes[static_cast<std::size_t>(item->lane)];
         item->next = nullptr;
-        if (head == nullptr) {
-            head = item;
+        item->enqueued.mark();
+        if (l.head == nullptr) {
+            l.head = item;
+            non_empty.store(true, std::memory_order_relaxed);
         } else {
-            tail->next = item;
+            l.tail->next = item;
         }
-        tail = item;
-        cv.notify_one();
+        l.tail = item;
     }
 
-    queue_item* pop_item() noexcept {
-        queue_item* front = head;
-        if (head != nullptr) {
-            head = front->next;
-            if (head == nullptr) {
-                tail = nullptr;
+    // The lane to serve next: the highest non-empty one, unless a lower
+    // non-empty lane has now been passed over too often. Requires
+    // has_items().
+    lane& pick_lane() noexcept {
+        std::size_t first = 0;
+        while (lanes[first].head == nullptr) {
+            ++first;
+        }
+        lane* chosen = &lanes[first];
+        for (std::size_t i = first + 1; i < lane_count; ++i) {
+            lane& l = lanes[i];
+            if (l.head != nullptr && ++l.passed_over >= starvation_limit &&
+                chosen == &lanes[first]) {
+                chosen = &l;
+                ++counters.promotions;
             }
         }
+        chosen->passed_over = 0;
+        return *chosen;
+    }
+
+    void update_non_empty() noexcept {
+        if (!has_items()) {
+            non_empty.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void notify_locked() noexcept {
+        // Each parked worker needs at most one notification; a burst of
+        // pushes while it is waking up shouldn't signal it again.
+        if (sleepers > signalled) {
+            ++signalled;
+            ++counters.wakeups;
+            cv.notify_one();
+        }
+    }
+
+    void enqueue(queue_item* item) noexcept {
+        std::lock_guard lock{mut};
+        push_item(item);
+        notify_locked();
+    }
+
+    void enqueue_timer(timer_item*            timer,
+                       const std::stop_token* stop) noexcept {
+        std::lock_guard lock{mut};
+        if (stop != nullptr && stop->stop_requested()) {
+            // Stop may have been requested before the stop callback could
+            // see the timer as pending.
+            timer->cancelled = true;
+            push_item(&timer->item);
+            notify_locked();
+            return;
+        }
+        timer->pending = true;
+        timers.push(timer);
+        if (timers.top() == timer) {
+            // New earliest deadline; wake a worker to shorten its wait.
+            notify_locked();
+        }
+    }
+
+    void cancel_timer(timer_item* timer) noexcept {
+        std::lock_guard lock{mut};
+        if (!timer->pending) {
+            // Already expired, or not yet enqueued (enqueue_timer() will
+            // see the stop request).
+            return;
+        }
+        timers.remove(timer);
+        timer->pending   = false;
+        timer->cancelled = true;
+        push_item(&timer->item);
+        notify_locked();
+    }
+
+    // Moves every timer whose deadline has passed onto the run queue.
+    void fire_expired_timers() noexcept {
+        if (timers.empty()) {
+            return;
+        }
+        clock::time_point now = clock::now();
+        while (!timers.empty() && timers.top()->deadline <= now) {
+            auto* timer    = static_cast<timer_item*>(timers.pop());
+            timer->pending = false;
+            push_item(&timer->item);
+        }
+    }
+
+    // Requires has_items().
+    queue_item* pop_item() noexcept {
+        lane&       l     = pick_lane();
+        queue_item* front = l.head;
+        l.head            = front->next;
+        if (l.head == nullptr) {
+            l.tail = nullptr;
+            update_non_empty();
+        }
         return front;
     }
 
+    // Takes the whole of the next lane. Requires has_items().
+    queue_item* pop_lane() noexcept {
+        lane&       l     = pick_lane();
+        queue_item* front = std::exchange(l.head, nullptr);
+        l.tail            = nullptr;
+        update_non_empty();
+        return front;
+    }
+
+    // Waits, with 'lock' held, until there is an item to run. Returns false
+    // if should_stop() returned true instead.
+    template <typename ShouldStop>
+    bool wait_for_work(std::unique_lock<std::mutex>& lock,
+                       ShouldStop                    should_stop,
+                       int                           spin_count) noexcept {
+        while (true) {
+            if (should_stop()) {
+                return false;
+            }
+            fire_expired_timers();
+            if (has_items()) {
+                return true;
+            }
+
+            if (spin_count > 0) {
+                lock.unlock();
+                bool found = false;
+                for (int i = 0; i < spin_count; ++i) {
+                    if (non_empty.load(std::memory_order_relaxed) ||
+                        should_stop()) {
+                        found = true;
+                        break;
+                    }
+                    cpu_relax();
+                }
+                lock.lock();
+                ++counters.spins;
+                if (found || has_items()) {
+                    counters.spin_hits += found ? 1 : 0;
+                    continue;
+                }
+            }
+
+            ++sleepers;
+            ++counters.sleeps;
+            if (timers.empty()) {
+                cv.wait(lock);
+            } else {
+                cv.wait_until(lock, timers.top()->deadline);
+            }
+            --sleepers;
+            if (signalled > 0) {
+                --signalled;
+            }
+        }
+    }
+
+    // Resumes the next item, then re-takes the lock.
+    void run_one(std::unique_lock<std::mutex>& lock) noexcept {
+        queue_item* item = pop_item();
+
+        lock.unlock();
+        trace_queue_wait(item->coro, item->enqueued);
+        item->coro.resume();
+        lock.lock();
+    }
+
+    auto stop_notifier() noexcept {
+        return [this]() noexcept {
+            std::lock_guard lock{mut};
+            cv.notify_all();
+        };
+    }
+
     struct schedule_awaitable {
-        manual_event_loop* loop;
-        queue_item         item;
+        using scheduler_type = manual_event_loop;
 
-        explicit schedule_awaitable(manual_event_loop& loop) noexcept
-            : loop(&loop) {}
+        manual_event_loop*               loop;
+        queue_item                       item;
+        bool                             cancelled{false};
+        [[no_unique_address]] async_wait wait{};
+
+        schedule_awaitable(manual_event_loop& loop, priority p) noexcept
+            : loop(&loop) {
+            item.lane = p;
+        }
 
         bool await_ready() noexcept { return false; }
-        void await_suspend(std::coroutine_handle<> coro) noexcept {
+
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> coro) noexcept {
+            if (stop_requested(coro)) {
+                cancelled = true;
+                return false;
+            }
             item.coro = coro;
+            trace_suspend(coro);
+            wait.begin(coro, "queued on manual_event_loop", loop);
             loop->enqueue(&item);
+            return true;
+        }
+
+        void await_resume() {
+            wait.end();
+            if (cancelled) [[unlikely]] {
+                throw operation_cancelled{};
+            }
+        }
+    };
+
+    struct schedule_at_awaitable {
+        struct canceller {
+            schedule_at_awaitable* self;
+            void                   operator()() noexcept {
+                self->loop->cancel_timer(&self->timer);
+            }
+        };
+
+        using scheduler_type = manual_event_loop;
+
+        manual_event_loop*                           loop;
+        timer_item                                   timer;
+        std::optional<std::stop_callback<canceller>> on_stop;
+        [[no_unique_address]] async_wait             wait{};
+
+        schedule_at_awaitable(manual_event_loop& loop,
+                              clock::time_point  deadline,
+                              priority           p) noexcept
+            : loop(&loop) {
+            timer.deadline  = deadline;
+            timer.item.lane = p;
+        }
+
+        // Only valid before the awaitable is awaited.
+        schedule_at_awaitable(schedule_at_awaitable&& other) noexcept
+            : schedule_at_awaitable(
+                  *other.loop, other.timer.deadline, other.timer.item.lane) {}
+
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> coro) noexcept {
+            timer.item.coro = coro;
+            trace_suspend(coro);
+            wait.begin(coro, "waiting for a timer on manual_event_loop", loop);
+
+            const std::stop_token* stop = get_stop_token(coro);
+            if (stop != nullptr && stop->stop_possible()) {
+                // Registered before the timer is visible to the loop, as
+                // the coroutine may be resumed (destroying this awaiter)
+                // as soon as it is.
+                on_stop.emplace(*stop, canceller{this});
+            }
+            loop->enqueue_timer(&timer, stop);
+        }
+
+        void await_resume() {
+            wait.end();
+            if (timer.cancelled) [[unlikely]] {
+                throw operation_cancelled{};
+            }
         }
-        void await_resume() noexcept {}
     };
 
   public:
-    schedule_awaitable schedule() noexcept {
-        return schedule_awaitable{*this};
+    schedule_awaitable schedule(priority p = priority::normal) noexcept {
+        return schedule_awaitable{*this, p};
+    }
+
+    // Resume on one of the loop's threads once 'deadline' has passed.
+    schedule_at_awaitable
+    schedule_at(clock::time_point deadline,
+                priority          p = priority::normal) noexcept {
+        return schedule_at_awaitable{*this, deadline, p};
+    }
+
+    template <typename Rep, typename Period>
+    schedule_at_awaitable
+    schedule_after(std::chrono::duration<Rep, Period> delay,
+                   priority p = priority::normal) noexcept {
+        return schedule_at_awaitable{
+            *this,
+            clock::now() + std::chrono::duration_cast<clock::duration>(delay),
+            p};
     }
 
     void run(std::stop_token st) noexcept {
-        std::stop_callback cb{st, [&]() noexcept {
-                                  std::lock_guard lock{mut};
-                                  cv.notify_all();
-                              }};
+        std::stop_callback      cb{st, stop_notifier()};
+        current_scheduler_scope on_loop{*this};
 
         std::unique_lock lock{mut};
-        while (true) {
-            cv.wait(lock, [&]() noexcept {
-                return head != nullptr || st.stop_requested();
-            });
-            if (st.stop_requested()) {
-                return;
-            }
+        auto             should_stop = [&]() noexcept {
+            return st.stop_requested();
+        };
+        while (wait_for_work(lock, should_stop, 0)) {
+            run_one(lock);
+        }
+    }
+
+    // Runs work on the calling thread, as run() does, until 'done' is
+    // set by set_and_wake(done). Used by sync_wait(loop, t).
+    void run_until(const std::atomic<std::uint32_t>& done) noexcept {
+        current_scheduler_scope on_loop{*this};
+
+        std::unique_lock lock{mut};
+        auto             should_stop = [&]() noexcept {
+            return done.load(std::memory_order_acquire) != 0;
+        };
+        while (wait_for_work(lock, should_stop, 0)) {
+            run_one(lock);
+        }
+    }
 
-            queue_item* item = pop_item();
+    // Sets 'done' and wakes the threads waiting for work, so that
+    // run_until(done) returns. The loop is not touched after the lock is
+    // released, so it may then be destroyed.
+    void set_and_wake(std::atomic<std::uint32_t>& done) noexcept {
+        std::lock_guard lock{mut};
+        done.store(1, std::memory_order_release);
+        cv.notify_all();
+    }
+
+    // Like run(), but takes every pending item at once and spins for up to
+    // 'spin_count' iterations before parking when the queue is empty.
+    void run_batched(std::stop_token st,
+                     int spin_count = default_spin_count) noexcept {
+        std::stop_callback      cb{st, stop_notifier()};
+        current_scheduler_scope on_loop{*this};
+
+        std::unique_lock lock{mut};
+        auto             should_stop = [&]() noexcept {
+            return st.stop_requested();
+        };
+        while (wait_for_work(lock, should_stop, spin_count)) {
+            queue_item* item = pop_lane();
+            ++counters.batches;
 
             lock.unlock();
-            item->coro.resume();
+            std::size_t n = 0;
+            while (item != nullptr) {
+                // Read 'next' first: resuming destroys the awaiter that
+                // owns 'item'.
+                queue_item* next = item->next;
+                trace_queue_wait(item->coro, item->enqueued);
+                item->coro.resume();
+                item = next;
+                ++n;
+            }
             lock.lock();
+            counters.batch_items += n;
         }
     }
+
+    loop_stats stats() noexcept {
+        std::lock_guard lock{mut};
+        return counters;
+    }
 };
 
 #endif
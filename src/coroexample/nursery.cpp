@@ -0,0 +1,2 @@
+// coroexample_nursery.cpp                                            -*-C++-*-
+#include <coroexample/nursery.h>
@@ -0,0 +1,223 @@
+// coroexample_nursery.h                                              -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_NURSERY
+#define INCLUDED_COROEXAMPLE_NURSERY
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <stop_token>
+#include <type_traits>
+#include <utility>
+
+#include <coroexample/asyncscope.h>
+#include <coroexample/helper.h>
+#include <coroexample/task.h>
+
+/////////////////////////////////////////////////
+// nursery
+//
+// An async_scope that keeps accounts of its children, for when a group of
+// tasks (say, everything spawned to serve one request) is the unit of
+// resource accounting:
+//
+//   nursery children;
+//   for (auto& part : parts) {
+//       children.spawn_detached(fetch(part, loop));
+//   }
+//   bool in_time = co_await children.join_async_for(loop, 50ms);
+//   nursery_stats s = children.stats(); // s.live == 0 after joining
+//
+// `stats()` reports how many children are live, how many have been
+// spawned and completed, the most that were live at once, and the summed
+// and longest lifetimes of those that have completed, a lifetime being
+// from spawn to completion. Time spent suspended counts: a child's CPU
+// time would need a hook at every place that resumes a coroutine, whereas
+// the lifetime costs two clock reads per child, and summed lifetimes
+// divided by the elapsed time give the mean number of children live.
+//
+// `co_await join_async_for(sched, timeout)` joins like join_async(), but
+// arms a timer on 'sched' (anything with `schedule_after()`, such as
+// manual_event_loop) first. If the children haven't all completed when it
+// fires, it asks them to stop, counting those still live as stragglers,
+// and then still waits for them: a child is never outlived by its
+// nursery, so a straggler that ignores cancellation delays the join. The
+// result is true if the children completed before the deadline. Once a
+// deadline has passed the nursery stays stopped, as with request_stop().
+//
+// The accounting wraps each child's awaiter rather than the child, so a
+// nursery allocates no more frames per spawn than an async_scope.
+
+struct nursery_stats {
+    std::size_t              live{0};
+    std::uint64_t            spawned{0};
+    std::uint64_t            completed{0};
+    std::size_t              peak_live{0};
+    std::chrono::nanoseconds child_time{0};    // summed over the completed
+    std::chrono::nanoseconds longest_child{0};
+    std::uint64_t            stragglers{0};    // cancelled at a deadline
+};
+
+struct nursery {
+  private:
+    using clock = std::chrono::steady_clock;
+
+    // Wraps a child so that its awaiter reports to the nursery when the
+    // spawned task starts and finishes awaiting it.
+    template <typename A>
+    struct child {
+        nursery* owner;
+        A        a;
+
+        struct awaiter {
+            nursery&          owner;
+            awaiter_type_t<A> inner;
+            clock::time_point start;
+
+            awaiter(nursery& owner, A&& a)
+                : owner(owner),
+                  inner(get_awaiter(std::move(a))),
+                  start(owner.child_started()) {}
+
+            awaiter(const awaiter&) = delete;
+
+            // Also on the way out of an exception from the child.
+            ~awaiter() { owner.child_finished(start); }
+
+            bool await_ready() { return inner.await_ready(); }
+
+            template <typename Promise>
+            decltype(auto) await_suspend(std::coroutine_handle<Promise> h) {
+                return inner.await_suspend(h);
+            }
+
+            decltype(auto) await_resume() { return inner.await_resume(); }
+        };
+
+        awaiter operator co_await() && { return {*owner, std::move(a)}; }
+    };
+
+    clock::time_point child_started() noexcept {
+        std::size_t now  = live.fetch_add(1, std::memory_order_relaxed) + 1;
+        std::size_t peak = peak_live.load(std::memory_order_relaxed);
+        while (peak < now && !peak_live.compare_exchange_weak(
+                                 peak, now, std::memory_order_relaxed)) {
+        }
+        spawned.fetch_add(1, std::memory_order_relaxed);
+        return clock::now();
+    }
+
+    // Runs before the spawned task drops its reference to the scope, so
+    // a joiner sees the final figures.
+    void child_finished(clock::time_point start) noexcept {
+        std::int64_t took =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                clock::now() - start)
+                .count();
+        child_ns.fetch_add(took, std::memory_order_relaxed);
+        std::int64_t longest = longest_ns.load(std::memory_order_relaxed);
+        while (longest < took &&
+               !longest_ns.compare_exchange_weak(
+                   longest, took, std::memory_order_relaxed)) {
+        }
+        completed.fetch_add(1, std::memory_order_relaxed);
+        live.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    template <typename Scheduler, typename Duration>
+    static task<void> expire_after(Scheduler&         sched,
+                                   Duration           timeout,
+                                   nursery&           n,
+                                   std::atomic<bool>& settled) {
+        co_await sched.schedule_after(timeout);
+        if (!settled.exchange(true, std::memory_order_acq_rel)) {
+            n.stragglers.fetch_add(n.live.load(std::memory_order_relaxed),
+                                   std::memory_order_relaxed);
+            n.request_stop();
+        }
+    }
+
+    async_scope                scope;
+    std::atomic<std::size_t>   live{0};
+    std::atomic<std::size_t>   peak_live{0};
+    std::atomic<std::uint64_t> spawned{0};
+    std::atomic<std::uint64_t> completed{0};
+    std::atomic<std::int64_t>  child_ns{0};
+    std::atomic<std::int64_t>  longest_ns{0};
+    std::atomic<std::uint64_t> stragglers{0};
+
+  public:
+    template <typename T>
+    using future = async_scope::future<T>;
+
+    nursery() = default;
+    explicit nursery(async_scope::collect_exceptions_t c) : scope(c) {}
+
+    template <typename A>
+    requires decay_copyable<A> && awaitable<std::decay_t<A>>
+    void spawn_detached(A&& a) {
+        scope.spawn_detached(child<std::decay_t<A>>{this, std::forward<A>(a)});
+    }
+
+    template <typename A>
+    requires decay_copyable<A> && awaitable<std::decay_t<A>>
+    future<std::decay_t<await_result_t<std::decay_t<A>>>>
+    spawn_future(A&& a) {
+        return scope.spawn_future(
+            child<std::decay_t<A>>{this, std::forward<A>(a)});
+    }
+
+    // A snapshot; the fields are read one at a time, so while children
+    // are running they may not quite agree with each other.
+    nursery_stats stats() const noexcept {
+        constexpr auto relaxed = std::memory_order_relaxed;
+        using std::chrono::nanoseconds;
+
+        nursery_stats s;
+        s.completed     = completed.load(relaxed);
+        s.spawned       = spawned.load(relaxed);
+        s.live          = live.load(relaxed);
+        s.peak_live     = peak_live.load(relaxed);
+        s.child_time    = nanoseconds(child_ns.load(relaxed));
+        s.longest_child = nanoseconds(longest_ns.load(relaxed));
+        s.stragglers    = stragglers.load(relaxed);
+        return s;
+    }
+
+    void request_stop() noexcept { scope.request_stop(); }
+
+    std::stop_token get_stop_token() const noexcept {
+        return scope.get_stop_token();
+    }
+
+    [[nodiscard]] auto join_async() noexcept { return scope.join_async(); }
+
+    // Returns true if every child completed within 'timeout'.
+    template <typename Scheduler, typename Rep, typename Period>
+    task<bool> join_async_for(Scheduler&                         sched,
+                              std::chrono::duration<Rep, Period> timeout) {
+        // Whichever of the join and the timer gets here first decides.
+        std::atomic<bool> settled{false};
+        async_scope       timer;
+        timer.spawn_detached(expire_after(sched, timeout, *this, settled));
+
+        std::exception_ptr failed;
+        try {
+            co_await scope.join_async();
+        } catch (...) {
+            failed = std::current_exception();
+        }
+        bool in_time = !settled.exchange(true, std::memory_order_acq_rel);
+
+        // Cancels the timer if it's still pending; it refers to locals.
+        timer.request_stop();
+        co_await timer.join_async();
+        if (failed) {
+            std::rethrow_exception(std::move(failed));
+        }
+        co_return in_time;
+    }
+};
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_singleconsumereventloop.cpp                            -*-C++-*-
+#include <coroexample/singleconsumereventloop.h>
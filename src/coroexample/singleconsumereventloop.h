@@ -0,0 +1,183 @@
+// coroexample_singleconsumereventloop.h                              -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_SINGLECONSUMEREVENTLOOP
+#define INCLUDED_COROEXAMPLE_SINGLECONSUMEREVENTLOOP
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <stop_token>
+
+#include <coroexample/cancellation.h>
+#include <coroexample/currentscheduler.h>
+#include <coroexample/generalhelper.h>
+
+/////////////////////////////////////////////////
+// single_consumer_event_loop
+//
+// An event loop with the same `co_await loop.schedule()` interface as
+// `manual_event_loop`, for the case where exactly one thread calls
+// `run()` and any number of threads schedule onto it (e.g. one loop per
+// shard).
+//
+// With a single consumer the run queue doesn't need a lock. It is an
+// intrusive multi-producer/single-consumer queue after Dmitry Vyukov: a
+// producer links its node in with one atomic exchange on the queue's
+// head plus a store to the previous node's 'next', and the consumer
+// walks the list from its own end without any read-modify-write at all.
+// As elsewhere, the node lives in the schedule awaitable, so scheduling
+// never allocates.
+//
+// The consumer only parks, with an atomic wait, once it sees the queue
+// empty; producers then pay for one notification. While the consumer is
+// busy, producers never touch the futex.
+//
+// There is a brief window where a producer has swapped the head but not
+// yet linked its node. The consumer can't see past it and spins until the
+// link appears rather than parking.
+
+struct single_consumer_event_loop {
+  private:
+    static constexpr std::size_t cache_line = 64;
+
+    struct queue_item {
+        std::atomic<queue_item*> next{nullptr};
+        std::coroutine_handle<>  coro;
+    };
+
+    // Producers push at 'head'; the consumer pops at 'tail'. 'stub' keeps
+    // the list non-empty so that push never has to special-case it.
+    alignas(cache_line) std::atomic<queue_item*> head{&stub};
+    alignas(cache_line) queue_item* tail{&stub};
+    queue_item stub;
+
+    // 1 while the consumer is parked, or about to park.
+    alignas(cache_line) std::atomic<std::uint32_t> parked{0};
+
+    void push(queue_item* item) noexcept {
+        item->next.store(nullptr, std::memory_order_relaxed);
+        queue_item* prev = head.exchange(item, std::memory_order_acq_rel);
+        prev->next.store(item, std::memory_order_release);
+    }
+
+    void enqueue(queue_item* item) noexcept {
+        push(item);
+        // Pairs with the fence in park(): either the consumer sees the
+        // item, or we see that it is parking.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed) != 0) {
+            wake();
+        }
+    }
+
+    void wake() noexcept {
+        if (parked.exchange(0, std::memory_order_release) != 0) {
+            parked.notify_one();
+        }
+    }
+
+    // Consumer only. Returns null if the queue is empty or the next node
+    // hasn't been linked in yet.
+    queue_item* pop() noexcept {
+        queue_item* t    = tail;
+        queue_item* next = t->next.load(std::memory_order_acquire);
+        if (t == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            tail = t = next;
+            next     = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return t;
+        }
+        if (t != head.load(std::memory_order_acquire)) {
+            return nullptr; // a producer is part way through push()
+        }
+        // 't' is the last node; put the stub behind it so that it can be
+        // unlinked without a producer ever writing to it again.
+        push(&stub);
+        next = t->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return t;
+        }
+        return nullptr;
+    }
+
+    // Consumer only. False while a push is still being linked in.
+    bool empty() const noexcept {
+        return tail == &stub &&
+               head.load(std::memory_order_relaxed) == &stub;
+    }
+
+    void park(std::stop_token& st) noexcept {
+        parked.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (empty() && !st.stop_requested()) {
+            parked.wait(1, std::memory_order_acquire);
+        }
+        parked.store(0, std::memory_order_relaxed);
+    }
+
+    struct schedule_awaitable {
+        using scheduler_type = single_consumer_event_loop;
+
+        single_consumer_event_loop* loop;
+        queue_item                  item;
+        bool                        cancelled{false};
+
+        explicit schedule_awaitable(single_consumer_event_loop& loop) noexcept
+            : loop(&loop) {}
+
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> coro) noexcept {
+            if (stop_requested(coro)) {
+                cancelled = true;
+                return false;
+            }
+            item.coro = coro;
+            loop->enqueue(&item);
+            return true;
+        }
+
+        void await_resume() {
+            if (cancelled) [[unlikely]] {
+                throw operation_cancelled{};
+            }
+        }
+    };
+
+  public:
+    single_consumer_event_loop() = default;
+
+    single_consumer_event_loop(const single_consumer_event_loop&) = delete;
+    single_consumer_event_loop&
+    operator=(const single_consumer_event_loop&) = delete;
+
+    schedule_awaitable schedule() noexcept {
+        return schedule_awaitable{*this};
+    }
+
+    // Runs queued coroutines on the calling thread until 'st' is
+    // signalled. At most one thread may be in run() at a time.
+    void run(std::stop_token st) noexcept {
+        std::stop_callback      cb{st, [this]() noexcept { wake(); }};
+        current_scheduler_scope on_loop{*this};
+
+        while (!st.stop_requested()) {
+            if (queue_item* item = pop()) {
+                item->coro.resume();
+            } else if (empty()) {
+                park(st);
+            } else {
+                cpu_relax();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,222 @@
+// coroexample_staticthreadpool.cpp                                   -*-C++-*-
+#include <coroexample/staticthreadpool.h>
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <string>
+#include <utility>
+
+#include <sched.h>
+
+namespace {
+// The CPUs the calling thread may run on, in increasing order.
+std::vector<unsigned> allowed_cpus() {
+    std::vector<unsigned> cpus;
+    cpu_set_t             set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        unsigned n = std::max(std::thread::hardware_concurrency(), 1u);
+        for (unsigned cpu = 0; cpu < n; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Node number of a /sys/devices/system/node entry such as "node1".
+bool parse_node_name(std::string_view name, unsigned& node) noexcept {
+    constexpr std::string_view prefix = "node";
+    if (!name.starts_with(prefix) || name.size() == prefix.size()) {
+        return false;
+    }
+    const char* first = name.data() + prefix.size();
+    const char* last  = name.data() + name.size();
+    auto [p, ec]      = std::from_chars(first, last, node);
+    return ec == std::errc{} && p == last;
+}
+
+void pin_to(std::span<const unsigned> cpus) noexcept {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    // Best effort; e.g. a container may not let us.
+    (void)::sched_setaffinity(0, sizeof(set), &set);
+}
+} // namespace
+
+std::vector<unsigned> cpu_topology::parse_cpu_list(std::string_view list) {
+    std::vector<unsigned> cpus;
+    while (!list.empty()) {
+        std::size_t      comma = list.find(',');
+        std::string_view range = list.substr(0, comma);
+        list.remove_prefix(comma == list.npos ? list.size() : comma + 1);
+
+        const char* p    = range.data();
+        const char* last = range.data() + range.size();
+        while (last != p && (last[-1] == '\n' || last[-1] == ' ')) {
+            --last;
+        }
+
+        unsigned lo = 0;
+        auto     r  = std::from_chars(p, last, lo);
+        if (r.ec != std::errc{}) {
+            continue;
+        }
+        unsigned hi = lo;
+        if (r.ptr != last && *r.ptr == '-') {
+            r = std::from_chars(r.ptr + 1, last, hi);
+            if (r.ec != std::errc{} || hi < lo) {
+                continue;
+            }
+        }
+        if (r.ptr != last) {
+            continue;
+        }
+        for (unsigned cpu = lo; cpu <= hi; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+cpu_topology cpu_topology::detect() {
+    std::vector<unsigned> allowed = allowed_cpus();
+
+    std::vector<std::pair<unsigned, std::vector<unsigned>>> found;
+    std::error_code                                         ec;
+    std::filesystem::directory_iterator it{"/sys/devices/system/node", ec};
+    for (; !ec && it != std::filesystem::directory_iterator{};
+         it.increment(ec)) {
+        unsigned node;
+        if (!parse_node_name(it->path().filename().native(), node)) {
+            continue;
+        }
+        std::ifstream in{it->path() / "cpulist"};
+        std::string   line;
+        if (!std::getline(in, line)) {
+            continue;
+        }
+
+        std::vector<unsigned> cpus;
+        for (unsigned cpu : parse_cpu_list(line)) {
+            if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            found.emplace_back(node, std::move(cpus));
+        }
+    }
+
+    cpu_topology topology;
+    if (found.empty()) {
+        topology.nodes.push_back(std::move(allowed));
+        return topology;
+    }
+    std::sort(found.begin(), found.end(), [](auto& a, auto& b) {
+        return a.first < b.first;
+    });
+    for (auto& [node, cpus] : found) {
+        topology.nodes.push_back(std::move(cpus));
+    }
+    return topology;
+}
+
+static_thread_pool::static_thread_pool(std::size_t thread_count, pinning pin)
+    : topology(cpu_topology::detect()) {
+    start(thread_count, pin);
+}
+
+static_thread_pool::static_thread_pool(cpu_topology topology,
+                                       std::size_t  thread_count,
+                                       pinning      pin)
+    : topology(std::move(topology)) {
+    start(thread_count, pin);
+}
+
+static_thread_pool::~static_thread_pool() {
+    // Stop them all before joining any, so they shut down in parallel.
+    for (std::jthread& thread : threads) {
+        thread.request_stop();
+    }
+}
+
+void static_thread_pool::start(std::size_t thread_count, pinning pin) {
+    assert(!topology.nodes.empty());
+    if (thread_count == 0) {
+        thread_count = std::max<std::size_t>(topology.cpu_count(), 1);
+    }
+    if (thread_count < topology.nodes.size()) {
+        // Every node we schedule onto needs a worker.
+        topology.nodes.resize(thread_count);
+    }
+    queues = std::make_unique<node_queue[]>(topology.nodes.size());
+
+    // Interleave over the nodes, then over the CPUs within each node.
+    threads.reserve(thread_count);
+    std::size_t node_count = topology.nodes.size();
+    for (std::size_t i = 0; i < thread_count; ++i) {
+        std::size_t                  node = i % node_count;
+        const std::vector<unsigned>& cpus = topology.nodes[node];
+        unsigned cpu = cpus.empty() ? 0 : cpus[(i / node_count) % cpus.size()];
+        threads.emplace_back([this, node, cpu, pin](std::stop_token st) {
+            run_worker(node, cpu, pin, std::move(st));
+        });
+    }
+}
+
+void static_thread_pool::run_worker(std::size_t     node,
+                                    unsigned        cpu,
+                                    pinning         pin,
+                                    std::stop_token st) noexcept {
+    if (pin == pinning::core) {
+        pin_to({&cpu, 1});
+    } else if (pin == pinning::node) {
+        pin_to(topology.nodes[node]);
+    }
+    current = thread_state{this, node};
+    current_scheduler_scope on_pool{*this};
+
+    node_queue&        q = queues[node];
+    std::stop_callback cb{st, [&q]() noexcept {
+                              std::lock_guard lock{q.mut};
+                              q.cv.notify_all();
+                          }};
+
+    std::unique_lock lock{q.mut};
+    while (true) {
+        while (q.head == nullptr && !st.stop_requested()) {
+            ++q.sleepers;
+            q.cv.wait(lock);
+            --q.sleepers;
+        }
+        if (st.stop_requested()) {
+            break;
+        }
+
+        queue_item* item = q.head;
+        q.head           = item->next;
+        if (q.head == nullptr) {
+            q.tail = nullptr;
+        }
+
+        lock.unlock();
+        item->coro.resume();
+        lock.lock();
+    }
+}
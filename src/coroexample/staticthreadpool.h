@@ -0,0 +1,208 @@
+// coroexample_staticthreadpool.h                                     -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_STATICTHREADPOOL
+#define INCLUDED_COROEXAMPLE_STATICTHREADPOOL
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <coroexample/cancellation.h>
+#include <coroexample/currentscheduler.h>
+
+/////////////////////////////////////////////////
+// cpu_topology
+//
+// The NUMA nodes of the machine and the CPUs in each that the process is
+// allowed to run on, read from /sys/devices/system/node. If that isn't
+// available (no NUMA support, or no sysfs) every allowed CPU is reported
+// as belonging to a single node.
+
+struct cpu_topology {
+    // Allowed CPUs of each node; nodes with none are left out.
+    std::vector<std::vector<unsigned>> nodes;
+
+    static cpu_topology detect();
+
+    // Parses a sysfs CPU list such as "0-3,8,10-11".
+    static std::vector<unsigned> parse_cpu_list(std::string_view list);
+
+    std::size_t cpu_count() const noexcept {
+        std::size_t n = 0;
+        for (const std::vector<unsigned>& cpus : nodes) {
+            n += cpus.size();
+        }
+        return n;
+    }
+};
+
+/////////////////////////////////////////////////
+// static_thread_pool
+//
+// A scheduler that owns its worker threads, rather than borrowing threads
+// that call `run()`, and lays them out over the machine's NUMA nodes:
+//
+//   static_thread_pool pool;                    // one worker per CPU
+//   co_await pool.schedule();                   // stay on this node
+//   co_await pool.schedule_on(1);               // move to node 1
+//
+// Workers are spread round-robin over the nodes of a `cpu_topology` and,
+// by default, each is pinned to one CPU of its node (`pinning::node` pins
+// to the whole node instead, and `pinning::none` leaves placement to the
+// OS). Pinning is best effort: if the OS refuses, the worker still runs.
+// With fewer workers than nodes, only the first nodes are used.
+//
+// Each node has its own intrusive run queue that only that node's workers
+// take from, and there is no stealing between nodes. `schedule()` from one
+// of the pool's workers queues on the worker's own node, so a coroutine
+// stays on the node whose memory its frame - allocated from the worker's
+// thread-local frame_pool - was first touched on. `schedule()` from any
+// other thread picks a node round-robin.
+//
+// As with `manual_event_loop`, `schedule()` completes with
+// `operation_cancelled` if the awaiting coroutine's stop token has already
+// been signalled.
+//
+// The destructor stops and joins the workers; coroutines still queued at
+// that point are never resumed, so join the scopes that use the pool
+// first.
+
+struct static_thread_pool {
+  public:
+    enum class pinning { none, node, core };
+
+    // Returned by current_node() on threads that aren't workers.
+    static constexpr std::size_t no_node = static_cast<std::size_t>(-1);
+
+  private:
+    static constexpr std::size_t cache_line = 64;
+
+    struct queue_item {
+        queue_item*             next;
+        std::coroutine_handle<> coro;
+    };
+
+    struct alignas(cache_line) node_queue {
+        std::mutex              mut;
+        std::condition_variable cv;
+        queue_item*             head{nullptr};
+        queue_item*             tail{nullptr};
+        std::size_t             sleepers{0};
+    };
+
+    struct thread_state {
+        static_thread_pool* pool;
+        std::size_t         node;
+    };
+
+    // Zero-initialised, so threads that aren't workers belong to no pool.
+    static inline thread_local thread_state current;
+
+    cpu_topology                  topology;
+    std::unique_ptr<node_queue[]> queues;
+    std::atomic<std::size_t>      next_node{0};
+
+    // Last, so the workers are joined before the queues are destroyed.
+    std::vector<std::jthread> threads;
+
+    void start(std::size_t thread_count, pinning pin);
+    void run_worker(std::size_t     node,
+                    unsigned        cpu,
+                    pinning         pin,
+                    std::stop_token st) noexcept;
+
+    void enqueue(queue_item* item, std::size_t node) noexcept {
+        if (node == no_node) {
+            node = current.pool == this
+                       ? current.node
+                       : next_node.fetch_add(1, std::memory_order_relaxed) %
+                             topology.nodes.size();
+        }
+
+        node_queue& q = queues[node];
+        std::lock_guard lock{q.mut};
+        item->next = nullptr;
+        if (q.head == nullptr) {
+            q.head = item;
+        } else {
+            q.tail->next = item;
+        }
+        q.tail = item;
+        if (q.sleepers > 0) {
+            q.cv.notify_one();
+        }
+    }
+
+    struct schedule_awaitable {
+        using scheduler_type = static_thread_pool;
+
+        static_thread_pool* pool;
+        std::size_t         node;
+        queue_item          item;
+        bool                cancelled{false};
+
+        schedule_awaitable(static_thread_pool& pool, std::size_t node) noexcept
+            : pool(&pool), node(node) {}
+
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> coro) noexcept {
+            if (stop_requested(coro)) {
+                cancelled = true;
+                return false;
+            }
+            item.coro = coro;
+            pool->enqueue(&item, node);
+            return true;
+        }
+
+        void await_resume() {
+            if (cancelled) [[unlikely]] {
+                throw operation_cancelled{};
+            }
+        }
+    };
+
+  public:
+    // 'thread_count' 0 means one worker per allowed CPU.
+    explicit static_thread_pool(std::size_t thread_count = 0,
+                                pinning     pin          = pinning::core);
+
+    static_thread_pool(cpu_topology topology,
+                       std::size_t  thread_count,
+                       pinning      pin = pinning::core);
+
+    ~static_thread_pool();
+
+    static_thread_pool(const static_thread_pool&)            = delete;
+    static_thread_pool& operator=(const static_thread_pool&) = delete;
+
+    std::size_t size() const noexcept { return threads.size(); }
+
+    std::size_t node_count() const noexcept { return topology.nodes.size(); }
+
+    // The node of the calling worker, or `no_node`.
+    std::size_t current_node() const noexcept {
+        return current.pool == this ? current.node : no_node;
+    }
+
+    schedule_awaitable schedule() noexcept {
+        return schedule_awaitable{*this, no_node};
+    }
+
+    // Resume on one of the workers of 'node' (< node_count()).
+    schedule_awaitable schedule_on(std::size_t node) noexcept {
+        assert(node < node_count());
+        return schedule_awaitable{*this, node};
+    }
+};
+
+#endif
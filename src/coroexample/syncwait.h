@@ -2,117 +2,195 @@
 #ifndef INCLUDED_COROEXAMPLE_SYNCWAIT
 #define INCLUDED_COROEXAMPLE_SYNCWAIT
 
-#include <variant>
-#include <exception>
-#include <semaphore>
+#include <atomic>
 #include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-#include <coroexample/generalhelper.h>
 #include <coroexample/helper.h>
 
 ////////////////////////////////////////////////////////////////
 // sync_wait()
+//
+// Blocks the calling thread until `co_await t` completes, and returns its
+// result (or rethrows its exception):
+//
+//   int x = sync_wait(compute());
+//
+// There is no coroutine frame per call. sync_wait() drives the awaiter
+// itself: if await_ready() is false, it calls await_suspend() with the
+// handle of a small "waker" coroutine, waits until that handle is resumed,
+// and then calls await_resume(). The awaiter is a local of sync_wait(),
+// so the result is returned straight from await_resume() without an
+// intermediate copy.
+//
+// Each thread keeps one suspended waker per level of nested sync_wait()
+// calls, created the first time that depth is reached and reused after
+// that, so in the steady state sync_wait() does not allocate. Resuming a
+// waker sets an atomic flag, and the blocked thread sleeps on that flag
+// with std::atomic::wait (a futex on Linux).
+//
+// `sync_wait(loop, t)` instead runs work queued on 'loop' on the calling
+// thread until `co_await t` completes, rather than parking the thread:
+//
+//   manual_event_loop loop;
+//   int x = sync_wait(loop, handler(loop)); // handler's hops run here
+//
+// 'loop' needs `run_until(const std::atomic<std::uint32_t>& done)`, which
+// runs work until 'done' is non-zero, and `set_and_wake(done)`, which sets
+// it and wakes a thread inside run_until() to notice. The waker calls the
+// latter, which takes the loop's lock, so the loop is not touched once
+// sync_wait() can return.
+
+struct _sync_waker {
+    struct promise_type {
+        using wake_fn = void(std::atomic<std::uint32_t>& done,
+                             void* context) noexcept;
+
+        std::atomic<std::uint32_t> done{0};
+
+        // Sets 'done' and wakes the waiting thread.
+        wake_fn* wake{nullptr};
+        void*    wake_context{nullptr};
+
+        _sync_waker get_return_object() noexcept {
+            return _sync_waker{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
 
-template <typename Task>
-await_result_t<Task> sync_wait(Task&& t) {
-    struct _void {};
-    using return_type  = await_result_t<Task>;
-    using storage_type = std::add_pointer_t<
-        std::conditional_t<std::is_void_v<return_type>, _void, return_type>>;
-    using result_type =
-        std::variant<std::monostate, storage_type, std::exception_ptr>;
-
-    struct _sync_task {
-        struct promise_type {
-            std::binary_semaphore sem{0};
-            result_type           result;
-
-            _sync_task get_return_object() noexcept {
-                return _sync_task{
-                    std::coroutine_handle<promise_type>::from_promise(*this)};
-            }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void                return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
 
-            struct final_awaiter {
-                bool await_ready() noexcept { return false; }
-                void
-                await_suspend(std::coroutine_handle<promise_type> h) noexcept {
-                    // Now that coroutine has suspended we can signal the
-                    // semaphore, unblocking the waiting thread. The other
-                    // thread will then destroy this coroutine (which is safe
-                    // because it is suspended).
-                    h.promise().sem.release();
-                }
-                void await_resume() noexcept {}
-            };
-
-            std::suspend_always initial_suspend() noexcept { return {}; }
-
-            final_awaiter final_suspend() noexcept { return {}; }
-
-            using non_void_return_type = std::
-                conditional_t<std::is_void_v<return_type>, _void, return_type>;
-
-            final_awaiter yield_value(non_void_return_type&& x)
-            requires(!std::is_void_v<return_type>)
-            {
-                // Note that we just store the address here and then suspend
-                // and unblock the waiting thread which then copies/moves the
-                // result from this address directly to the return-value of
-                // sync_wait(). This avoids having to make an extra
-                // intermediate copy of the result value.
-                result.template emplace<1>(std::addressof(x));
-                return {};
-            }
+    using handle_t = std::coroutine_handle<promise_type>;
 
-            void return_void() noexcept { result.template emplace<1>(); }
+    // Signals from await_suspend(), once the waker is suspended again and
+    // so can be reused as soon as the waiting thread sees 'done'.
+    struct signal {
+        bool await_ready() noexcept { return false; }
 
-            void unhandled_exception() noexcept {
-                result.template emplace<2>(std::current_exception());
-            }
+        void await_suspend(handle_t h) noexcept {
+            promise_type& p = h.promise();
+            p.wake(p.done, p.wake_context);
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    handle_t coro;
+
+    explicit _sync_waker(handle_t h) noexcept : coro(h) {}
+
+    _sync_waker(_sync_waker&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+
+    ~_sync_waker() {
+        if (coro)
+            coro.destroy();
+    }
+
+    static _sync_waker make() {
+        for (;;) {
+            co_await signal{};
+        }
+    }
+
+    // Borrows this thread's waker for the current sync_wait() depth.
+    struct lease {
+        struct pool {
+            std::vector<_sync_waker> wakers;
+            std::size_t              depth{0};
         };
 
-        using handle_t = std::coroutine_handle<promise_type>;
+        pool&    p;
         handle_t coro;
 
-        explicit _sync_task(handle_t h) noexcept : coro(h) {}
-        _sync_task(_sync_task&& o) noexcept
-            : coro(std::exchange(o.coro, {})) {}
-        ~_sync_task() {
-            if (coro)
-                coro.destroy();
+        lease() : p(local()) {
+            if (p.depth == p.wakers.size()) {
+                p.wakers.push_back(make());
+            }
+            coro = p.wakers[p.depth++].coro;
         }
 
-        // The force-inline here is required to get the _sync_task coroutine
-        // elided. Otherwise the compiler doesn't know that this function
-        // hasn't modified 'coro' member variable and so can't deduce that it's
-        // always destroyed before sync_wait() returns.
-        FORCE_INLINE return_type run() {
-            coro.resume();
-            coro.promise().sem.acquire();
-
-            auto& result = coro.promise().result;
-            if (result.index() == 2) {
-                std::rethrow_exception(std::get<2>(std::move(result)));
-            }
+        lease(const lease&) = delete;
 
-            assert(result.index() == 1);
+        ~lease() { --p.depth; }
 
-            if constexpr (!std::is_void_v<return_type>) {
-                return static_cast<return_type&&>(*std::get<1>(result));
-            }
+        static pool& local() noexcept {
+            thread_local pool wakers;
+            return wakers;
         }
     };
-
-    return [&]() -> _sync_task {
-        if constexpr (std::is_void_v<return_type>) {
-            co_await static_cast<Task&&>(t);
+};
+
+// Drives the awaiter of 't', calling wait(promise) to block until the
+// waker has been resumed, if it had to suspend.
+template <typename Task, typename Wait>
+await_result_t<Task> _sync_wait(Task&&                              t,
+                                Wait                                wait,
+                                _sync_waker::promise_type::wake_fn* wake,
+                                void* wake_context) {
+    decltype(auto) awaiter = get_awaiter(static_cast<Task&&>(t));
+    if (!awaiter.await_ready()) {
+        _sync_waker::lease         lease;
+        _sync_waker::promise_type& p = lease.coro.promise();
+        p.done.store(0, std::memory_order_relaxed);
+        p.wake         = wake;
+        p.wake_context = wake_context;
+
+        using suspend_result = decltype(awaiter.await_suspend(lease.coro));
+        if constexpr (std::is_void_v<suspend_result>) {
+            awaiter.await_suspend(lease.coro);
+            wait(p);
+        } else if constexpr (std::is_same_v<suspend_result, bool>) {
+            if (awaiter.await_suspend(lease.coro)) {
+                wait(p);
+            }
         } else {
-            // use co_yield instead of co_return so we suspend while the
-            // potentially temporary result of co_await is still alive.
-            co_yield co_await static_cast<Task&&>(t);
+            awaiter.await_suspend(lease.coro).resume();
+            wait(p);
         }
-    }()
-                        .run();
+    }
+    return awaiter.await_resume();
+}
+
+template <typename Task>
+await_result_t<Task> sync_wait(Task&& t) {
+    return _sync_wait(
+        static_cast<Task&&>(t),
+        [](_sync_waker::promise_type& p) noexcept {
+            while (p.done.load(std::memory_order_acquire) == 0) {
+                p.done.wait(0, std::memory_order_acquire);
+            }
+        },
+        [](std::atomic<std::uint32_t>& done, void*) noexcept {
+            done.store(1, std::memory_order_release);
+            done.notify_one();
+        },
+        nullptr);
+}
+
+template <typename Loop, typename Task>
+requires requires(Loop& loop, std::atomic<std::uint32_t>& done) {
+    loop.run_until(done);
+    loop.set_and_wake(done);
+}
+await_result_t<Task> sync_wait(Loop& loop, Task&& t) {
+    return _sync_wait(
+        static_cast<Task&&>(t),
+        [&loop](_sync_waker::promise_type& p) {
+            loop.run_until(p.done);
+        },
+        [](std::atomic<std::uint32_t>& done, void* l) noexcept {
+            static_cast<Loop*>(l)->set_and_wake(done);
+        },
+        &loop);
 }
 
 #endif
@@ -7,23 +7,65 @@
 #include <exception>
 #include <utility>
 #include <cassert>
+#include <source_location>
+
+#include <coroexample/asyncstacks.h>
+#include <coroexample/cancellation.h>
+#include <coroexample/frameallocator.h>
+#include <coroexample/framestats.h>
+#include <coroexample/tracing.h>
 
 ///////////////////////////////////////////////////
 // task<T> - basic async task type
+//
+// Frames are allocated via `frame_allocating_promise`, so they come from
+// the per-thread frame pool by default, or from a caller-supplied memory
+// resource if the coroutine's leading parameters are
+// `std::allocator_arg_t, std::pmr::polymorphic_allocator<>`.
+//
+// A task inherits the stop token of the coroutine that awaits it (see
+// `stop_token_promise`).
+//
+// With tracing enabled (see tracing.h), each transfer into or out of a
+// task is recorded, and so is the task's duration from when it is first
+// awaited until it completes. With async stacks enabled (see
+// asyncstacks.h), live task frames can be listed along with the chain of
+// tasks awaiting each one.
 
 template <typename T>
 struct task;
 
 template <typename T>
-struct task_promise {
+struct task_promise : frame_allocating_promise, stop_token_promise {
+    task_promise(std::source_location where =
+                     std::source_location::current()) noexcept
+        : stack_frame(
+              std::coroutine_handle<task_promise>::from_promise(*this)
+                  .address(),
+              where) {
+        note_frame_constructed(
+            std::coroutine_handle<task_promise>::from_promise(*this)
+                .address(),
+            where);
+    }
+
     task<T> get_return_object() noexcept;
 
     std::suspend_always initial_suspend() noexcept { return {}; }
 
     struct final_awaiter {
         bool await_ready() noexcept { return false; }
+
+        // 'Promise' is task_promise, or a type derived from it (see
+        // affine_task).
+        template <typename Promise>
         std::coroutine_handle<>
-        await_suspend(std::coroutine_handle<task_promise> h) noexcept {
+        await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            trace_task_done(h.promise().started);
+            h.promise().stack_frame.set_parent(nullptr);
+            h.promise().stack_frame.set_waiting("completed", nullptr);
+            trace_suspend(h);
+            trace_resume(h.promise().continuation);
             return h.promise().continuation;
         }
         [[noreturn]] void await_resume() noexcept { std::terminate(); }
@@ -44,18 +86,41 @@ struct task_promise {
 
     std::coroutine_handle<>                             continuation;
     std::variant<std::monostate, T, std::exception_ptr> result;
+    [[no_unique_address]] trace_stamp                   started;
+    [[no_unique_address]] async_frame                   stack_frame;
 };
 
 template <>
-struct task_promise<void> {
+struct task_promise<void> : frame_allocating_promise, stop_token_promise {
+    task_promise(std::source_location where =
+                     std::source_location::current()) noexcept
+        : stack_frame(
+              std::coroutine_handle<task_promise>::from_promise(*this)
+                  .address(),
+              where) {
+        note_frame_constructed(
+            std::coroutine_handle<task_promise>::from_promise(*this)
+                .address(),
+            where);
+    }
+
     task<void> get_return_object() noexcept;
 
     std::suspend_always initial_suspend() noexcept { return {}; }
 
     struct final_awaiter {
         bool await_ready() noexcept { return false; }
+
+        // 'Promise' is task_promise, or a type derived from it (see
+        // affine_task).
+        template <typename Promise>
         std::coroutine_handle<>
-        await_suspend(std::coroutine_handle<task_promise> h) noexcept {
+        await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            trace_task_done(h.promise().started);
+            h.promise().stack_frame.set_parent(nullptr);
+            h.promise().stack_frame.set_waiting("completed", nullptr);
+            trace_suspend(h);
+            trace_resume(h.promise().continuation);
             return h.promise().continuation;
         }
         [[noreturn]] void await_resume() noexcept { std::terminate(); }
@@ -73,6 +138,8 @@ struct task_promise<void> {
 
     std::coroutine_handle<>                                 continuation;
     std::variant<std::monostate, empty, std::exception_ptr> result;
+    [[no_unique_address]] trace_stamp                       started;
+    [[no_unique_address]] async_frame                       stack_frame;
 };
 
 template <typename T>
@@ -85,8 +152,14 @@ struct [[nodiscard]] task {
         handle_t coro;
         bool     await_ready() noexcept { return false; }
 
-        handle_t await_suspend(std::coroutine_handle<> h) noexcept {
+        template <typename Promise>
+        handle_t await_suspend(std::coroutine_handle<Promise> h) noexcept {
             coro.promise().continuation = h;
+            coro.promise().stop         = get_stop_token(h);
+            coro.promise().started.mark();
+            coro.promise().stack_frame.set_parent(async_frame_of(h));
+            trace_suspend(h);
+            trace_resume(coro);
             return coro;
         }
 
@@ -127,7 +200,7 @@ task<T> task_promise<T>::get_return_object() noexcept {
         std::coroutine_handle<task_promise<T>>::from_promise(*this)};
 }
 
-task<void> task_promise<void>::get_return_object() noexcept {
+inline task<void> task_promise<void>::get_return_object() noexcept {
     return task<void>{
         std::coroutine_handle<task_promise<void>>::from_promise(*this)};
 }
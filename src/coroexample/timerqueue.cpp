@@ -0,0 +1,2 @@
+// coroexample_timerqueue.cpp                                         -*-C++-*-
+#include <coroexample/timerqueue.h>
@@ -0,0 +1,123 @@
+// coroexample_timerqueue.h                                           -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_TIMERQUEUE
+#define INCLUDED_COROEXAMPLE_TIMERQUEUE
+
+#include <chrono>
+#include <utility>
+
+/////////////////////////////////////////////////
+// timer_queue
+//
+// An intrusive min-heap of deadlines, used by the event loops to hold
+// coroutines waiting for a point in time.
+//
+// The heap is a pairing heap: nodes are linked through child/sibling
+// pointers that live inside the node, so as with the scheduler queues the
+// node can be embedded in the awaiter and pending timers cost no
+// allocation. Insertion is O(1); removing the earliest timer, or removing
+// an arbitrary timer (cancellation), is O(log n) amortised.
+//
+// Not synchronised; callers hold their own lock.
+
+struct timer_node {
+    using clock = std::chrono::steady_clock;
+
+    clock::time_point deadline;
+    timer_node*       child{nullptr};
+    timer_node*       next{nullptr}; // next sibling
+    timer_node*       prev{nullptr}; // previous sibling, or parent if first
+};
+
+struct timer_queue {
+  private:
+    timer_node* root{nullptr};
+
+    // Both arguments must be roots with no siblings.
+    static timer_node* meld(timer_node* a, timer_node* b) noexcept {
+        if (a == nullptr) {
+            return b;
+        }
+        if (b == nullptr) {
+            return a;
+        }
+        if (b->deadline < a->deadline) {
+            std::swap(a, b);
+        }
+        b->prev = a;
+        b->next = a->child;
+        if (a->child != nullptr) {
+            a->child->prev = b;
+        }
+        a->child = b;
+        return a;
+    }
+
+    // Standard two-pass pairing: meld siblings pairwise left to right, then
+    // meld the results right to left.
+    static timer_node* merge_pairs(timer_node* first) noexcept {
+        timer_node* pairs = nullptr;
+        while (first != nullptr) {
+            timer_node* a = first;
+            timer_node* b = a->next;
+            first         = b != nullptr ? b->next : nullptr;
+
+            a->next = a->prev = nullptr;
+            if (b != nullptr) {
+                b->next = b->prev = nullptr;
+            }
+            timer_node* m = meld(a, b);
+            m->next       = pairs;
+            pairs         = m;
+        }
+
+        timer_node* result = nullptr;
+        while (pairs != nullptr) {
+            timer_node* rest = pairs->next;
+            pairs->next      = nullptr;
+            result           = meld(result, pairs);
+            pairs            = rest;
+        }
+        return result;
+    }
+
+  public:
+    bool empty() const noexcept { return root == nullptr; }
+
+    timer_node* top() const noexcept { return root; }
+
+    void push(timer_node* node) noexcept {
+        node->child = node->next = node->prev = nullptr;
+        root = meld(root, node);
+    }
+
+    timer_node* pop() noexcept {
+        timer_node* front = root;
+        root              = merge_pairs(front->child);
+        front->child      = nullptr;
+        return front;
+    }
+
+    // Removes a node that is currently in the queue.
+    void remove(timer_node* node) noexcept {
+        if (node == root) {
+            pop();
+            return;
+        }
+
+        if (node->prev->child == node) {
+            node->prev->child = node->next;
+        } else {
+            node->prev->next = node->next;
+        }
+        if (node->next != nullptr) {
+            node->next->prev = node->prev;
+        }
+        node->next = node->prev = nullptr;
+
+        timer_node* children = merge_pairs(node->child);
+        node->child          = nullptr;
+        root                 = meld(root, children);
+    }
+};
+
+#endif
@@ -0,0 +1,191 @@
+// coroexample_tracing.cpp                                            -*-C++-*-
+#include <coroexample/tracing.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+// Every thread's buffer, in registration order. Buffers are never freed,
+// so that events from threads that have exited can still be exported.
+struct trace_registry {
+    std::mutex                                 mut;
+    std::vector<std::unique_ptr<trace_buffer>> buffers;
+
+    static trace_registry& get() noexcept {
+        static trace_registry registry;
+        return registry;
+    }
+};
+
+// Chrome trace timestamps are in microseconds.
+void write_us(std::ostream& out, std::uint64_t ns) {
+    char fraction[4] = {static_cast<char>('0' + ns / 100 % 10),
+                        static_cast<char>('0' + ns / 10 % 10),
+                        static_cast<char>('0' + ns % 10),
+                        '\0'};
+    out << ns / 1000 << '.' << fraction;
+}
+
+struct chrome_trace_writer {
+    std::ostream& out;
+    unsigned      tid;
+    bool          first{true};
+
+    // Starts an event object, leaving it open after "ts".
+    void begin(const char* name, const char* phase, std::uint64_t ns) {
+        out << (first ? "\n" : ",\n") << R"({"name":")" << name
+            << R"(","ph":")" << phase << R"(","pid":1,"tid":)" << tid
+            << R"(,"ts":)";
+        write_us(out, ns);
+        first = false;
+    }
+
+    void instant(const char* name, const trace_event& e, const char* arg) {
+        begin(name, "i", e.timestamp);
+        out << R"(,"s":"t","args":{")" << arg << R"(":")" << e.id << "\"";
+        if (e.kind == trace_kind::frame_create) {
+            out << R"(,"size":)" << e.value;
+        }
+        out << "}}";
+    }
+
+    void slice(const void* frame, std::uint64_t start, std::uint64_t end) {
+        begin("resume", "X", start);
+        out << R"(,"dur":)";
+        write_us(out, end - start);
+        out << R"(,"args":{"frame":")" << frame << "\"}}";
+    }
+
+    void queue_wait(const trace_event& e) {
+        begin("queue wait", "b", e.timestamp - e.value);
+        out << R"(,"cat":"queue","id":")" << e.id << "\"}";
+        begin("queue wait", "e", e.timestamp);
+        out << R"(,"cat":"queue","id":")" << e.id << "\"}";
+    }
+
+    void thread_name() {
+        out << (first ? "\n" : ",\n")
+            << R"({"name":"thread_name","ph":"M","pid":1,"tid":)" << tid
+            << R"(,"args":{"name":"thread )" << tid << "\"}}";
+        first = false;
+    }
+};
+} // namespace
+
+trace_buffer* trace_buffer::register_thread() noexcept {
+    trace_registry& r = trace_registry::get();
+    std::lock_guard lock{r.mut};
+    auto            index = static_cast<unsigned>(r.buffers.size() + 1);
+    r.buffers.push_back(std::make_unique<trace_buffer>(index));
+    return r.buffers.back().get();
+}
+
+double latency_histogram::mean() const noexcept {
+    std::uint64_t n = count();
+    return n == 0 ? 0.0
+                  : static_cast<double>(sum.load(std::memory_order_relaxed)) /
+                        static_cast<double>(n);
+}
+
+std::uint64_t
+latency_histogram::value_at_percentile(double percentile) const noexcept {
+    std::uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    auto target = static_cast<std::uint64_t>(
+        std::ceil(percentile / 100.0 * static_cast<double>(n)));
+    target = std::max<std::uint64_t>(target, 1);
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return std::min(bucket_limit(i), max());
+        }
+    }
+    return max();
+}
+
+void latency_histogram::reset() noexcept {
+    for (std::atomic<std::uint64_t>& c : counts) {
+        c.store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    largest.store(0, std::memory_order_relaxed);
+}
+
+void latency_histogram::print(std::ostream& out, std::string_view name) const {
+    out << name << ": count=" << count() << " mean=" << mean()
+        << "ns p50=" << value_at_percentile(50)
+        << "ns p90=" << value_at_percentile(90)
+        << "ns p99=" << value_at_percentile(99)
+        << "ns p99.9=" << value_at_percentile(99.9) << "ns max=" << max()
+        << "ns\n";
+}
+
+trace_histograms& trace_histograms::global() noexcept {
+    static trace_histograms histograms;
+    return histograms;
+}
+
+void write_chrome_trace(std::ostream& out) {
+    trace_registry& r = trace_registry::get();
+    std::lock_guard lock{r.mut};
+
+    out << R"({"displayTimeUnit":"ns","traceEvents":[)";
+    chrome_trace_writer w{out, 0};
+    std::uint64_t       dropped = 0;
+    for (const std::unique_ptr<trace_buffer>& b : r.buffers) {
+        w.tid = b->thread_index();
+        w.thread_name();
+        dropped += b->dropped();
+
+        // When each frame that is running on this thread was resumed.
+        // Frames that were resumed before the previous export are left
+        // out.
+        std::unordered_map<const void*, std::uint64_t> running;
+        b->drain([&](const trace_event& e) {
+            switch (e.kind) {
+            case trace_kind::frame_create:
+                w.instant("frame create", e, "frame");
+                break;
+            case trace_kind::frame_destroy:
+                w.instant("frame destroy", e, "frame");
+                break;
+            case trace_kind::resume:
+                running[e.id] = e.timestamp;
+                break;
+            case trace_kind::queue_wait:
+                w.queue_wait(e);
+                running[e.id] = e.timestamp;
+                break;
+            case trace_kind::suspend:
+                if (auto it = running.find(e.id); it != running.end()) {
+                    w.slice(e.id, it->second, e.timestamp);
+                    running.erase(it);
+                }
+                break;
+            case trace_kind::scope_spawn:
+                w.instant("scope spawn", e, "scope");
+                break;
+            case trace_kind::scope_join:
+                w.instant("scope join", e, "scope");
+                break;
+            }
+        });
+    }
+    out << "\n],\"otherData\":{\"dropped_events\":" << dropped << "}}\n";
+}
+
+void print_trace_histograms(std::ostream& out) {
+    trace_histograms& h = trace_histograms::global();
+    h.queue_latency.print(out, "queue latency");
+    h.task_duration.print(out, "task duration");
+}
@@ -0,0 +1,298 @@
+// coroexample_tracing.h                                              -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_TRACING
+#define INCLUDED_COROEXAMPLE_TRACING
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string_view>
+
+#include <coroexample/generalhelper.h>
+
+// Set by the COROEXAMPLE_ENABLE_TRACING CMake option.
+#ifndef COROEXAMPLE_TRACING
+#define COROEXAMPLE_TRACING 0
+#endif
+
+/////////////////////////////////////////////////
+// tracing
+//
+// Optional instrumentation of the hot paths, for finding out where the
+// time goes when latency regresses. The hooks are compiled in only when
+// COROEXAMPLE_TRACING is 1. Otherwise every hook is an empty inline
+// function, and the timestamps that the instrumented types carry are
+// empty [[no_unique_address]] members, so the code and layouts are the
+// same as without tracing.
+//
+// When enabled, the hooks record:
+// - frame create/destroy, in frame_allocating_promise;
+// - suspend/resume, wherever task or manual_event_loop::schedule()
+//   transfers control;
+// - queue wait, from when manual_event_loop queues a coroutine until a
+//   run() or run_batched() thread resumes it;
+// - spawn and join on an async_scope.
+//
+// Each thread appends its events to its own fixed-size ring buffer, of
+// which it is the only writer, so recording an event is a clock read plus
+// a store and a release. A full buffer drops (and counts) new events
+// rather than make the thread wait for whoever drains it.
+//
+// Queue waits and task durations (from when a task is first awaited until
+// it completes) also go into `latency_histogram`s, which are HDR-style:
+// buckets are log-linear, 16 per power of two, so any value is reported
+// to within 1/16 of itself.
+//
+// On demand, `write_chrome_trace()` drains every thread's buffer as
+// Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev can
+// open: each resume..suspend is a slice on its thread's track, and each
+// queue wait an async slice of its own. `print_trace_histograms()` dumps
+// the histograms.
+
+inline constexpr bool tracing_enabled = COROEXAMPLE_TRACING != 0;
+
+inline std::uint64_t trace_now() noexcept {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+enum class trace_kind : std::uint8_t {
+    frame_create,  // value: frame size
+    frame_destroy,
+    suspend,
+    resume,
+    queue_wait,    // the loop resumes 'id'; value: ns spent queued
+    scope_spawn,   // id: the scope
+    scope_join,    // id: the scope
+};
+
+struct trace_event {
+    std::uint64_t timestamp; // trace_now()
+    std::uint64_t value;
+    const void*   id;        // coroutine frame, unless noted above
+    trace_kind    kind;
+};
+
+/////////////////////////////////////////////////
+// trace_buffer
+//
+// Single-producer/single-consumer ring of trace_events. `local()` is the
+// calling thread's buffer, registered on first use; buffers outlive their
+// threads so that their events can still be exported.
+
+struct trace_buffer {
+    static constexpr std::size_t capacity = std::size_t{1} << 14;
+
+    explicit trace_buffer(unsigned thread_index) noexcept
+        : index(thread_index) {}
+
+    trace_buffer(const trace_buffer&)            = delete;
+    trace_buffer& operator=(const trace_buffer&) = delete;
+
+    static trace_buffer& local() noexcept {
+        thread_local trace_buffer* buffer = nullptr;
+        if (buffer == nullptr) [[unlikely]] {
+            buffer = register_thread();
+        }
+        return *buffer;
+    }
+
+    // Only the owning thread may push.
+    void push(const trace_event& e) noexcept {
+        std::uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == capacity) {
+            lost.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        events[h % capacity] = e;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Calls f(event) for each event pushed so far, oldest first, and
+    // removes them. Only one thread may drain at a time.
+    template <typename F>
+    void drain(F f) {
+        std::uint64_t t = tail.load(std::memory_order_relaxed);
+        std::uint64_t h = head.load(std::memory_order_acquire);
+        for (; t != h; ++t) {
+            f(events[t % capacity]);
+        }
+        tail.store(t, std::memory_order_release);
+    }
+
+    // Events dropped because the buffer was full.
+    std::uint64_t dropped() const noexcept {
+        return lost.load(std::memory_order_relaxed);
+    }
+
+    // Order in which the owning thread registered, from 1.
+    unsigned thread_index() const noexcept { return index; }
+
+  private:
+    static trace_buffer* register_thread() noexcept;
+
+    alignas(64) std::atomic<std::uint64_t> head{0};
+    std::atomic<std::uint64_t>             lost{0};
+    alignas(64) std::atomic<std::uint64_t> tail{0};
+    unsigned                               index;
+    trace_event                            events[capacity];
+};
+
+/////////////////////////////////////////////////
+// latency_histogram
+//
+// Counts of nanosecond values in log-linear buckets. Values below 16 have
+// a bucket each; above that, each power of two is split into 16 equal
+// buckets. record() is wait-free and may be called from any thread.
+
+struct latency_histogram {
+    static constexpr unsigned    sub_bucket_bits = 4;
+    static constexpr std::size_t sub_buckets     = 1u << sub_bucket_bits;
+    static constexpr std::size_t bucket_count =
+        (65 - sub_bucket_bits) * sub_buckets;
+
+    static std::size_t bucket_of(std::uint64_t v) noexcept {
+        if (v < sub_buckets) {
+            return static_cast<std::size_t>(v);
+        }
+        unsigned shift = static_cast<unsigned>(std::bit_width(v)) -
+                         (sub_bucket_bits + 1);
+        return (shift + 1) * sub_buckets +
+               static_cast<std::size_t>((v >> shift) - sub_buckets);
+    }
+
+    // The largest value that falls in bucket 'i'.
+    static std::uint64_t bucket_limit(std::size_t i) noexcept {
+        if (i < sub_buckets) {
+            return i;
+        }
+        auto          shift = static_cast<unsigned>(i / sub_buckets - 1);
+        std::uint64_t first = std::uint64_t{i % sub_buckets + sub_buckets}
+                              << shift;
+        return first + ((std::uint64_t{1} << shift) - 1);
+    }
+
+    void record(std::uint64_t v) noexcept {
+        counts[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        std::uint64_t old = largest.load(std::memory_order_relaxed);
+        while (old < v && !largest.compare_exchange_weak(
+                              old, v, std::memory_order_relaxed)) {
+        }
+    }
+
+    std::uint64_t count() const noexcept {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t max() const noexcept {
+        return largest.load(std::memory_order_relaxed);
+    }
+
+    double mean() const noexcept;
+
+    // The smallest bucket limit that at least 'percentile'% of the values
+    // are at or below (capped at max()), or 0 if nothing was recorded.
+    std::uint64_t value_at_percentile(double percentile) const noexcept;
+
+    void reset() noexcept;
+
+    // One line: count, mean, p50, p90, p99, p99.9 and max.
+    void print(std::ostream& out, std::string_view name) const;
+
+  private:
+    std::atomic<std::uint64_t> counts[bucket_count]{};
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<std::uint64_t> sum{0};
+    std::atomic<std::uint64_t> largest{0};
+};
+
+struct trace_histograms {
+    latency_histogram queue_latency; // manual_event_loop enqueue to resume
+    latency_histogram task_duration; // task first awaited to completed
+
+    static trace_histograms& global() noexcept;
+};
+
+// Drains every thread's trace buffer into 'out' as a Chrome trace event
+// JSON object.
+void write_chrome_trace(std::ostream& out);
+
+void print_trace_histograms(std::ostream& out);
+
+/////////////////////////////////////////////////
+// Hooks
+
+template <bool Enabled>
+struct _trace_stamp {
+    void          mark() noexcept {}
+    std::uint64_t elapsed(std::uint64_t) const noexcept { return 0; }
+};
+
+template <>
+struct _trace_stamp<true> {
+    std::uint64_t ns{0};
+
+    void          mark() noexcept { ns = trace_now(); }
+    std::uint64_t elapsed(std::uint64_t now) const noexcept {
+        return now - ns;
+    }
+};
+
+// A point in time that instrumented types keep as a
+// [[no_unique_address]] member; empty unless tracing is enabled.
+using trace_stamp = _trace_stamp<tracing_enabled>;
+
+FORCE_INLINE inline void trace_record(trace_kind    kind,
+                                      const void*   id,
+                                      std::uint64_t value = 0) noexcept {
+    if constexpr (tracing_enabled) {
+        trace_buffer::local().push(trace_event{trace_now(), value, id, kind});
+    }
+}
+
+FORCE_INLINE inline void trace_frame_create(const void* frame,
+                                            std::size_t size) noexcept {
+    trace_record(trace_kind::frame_create, frame, size);
+}
+
+FORCE_INLINE inline void trace_frame_destroy(const void* frame) noexcept {
+    trace_record(trace_kind::frame_destroy, frame);
+}
+
+FORCE_INLINE inline void trace_suspend(std::coroutine_handle<> h) noexcept {
+    trace_record(trace_kind::suspend, h.address());
+}
+
+FORCE_INLINE inline void trace_resume(std::coroutine_handle<> h) noexcept {
+    trace_record(trace_kind::resume, h.address());
+}
+
+// A loop is about to resume 'h', which it queued at 'enqueued'.
+FORCE_INLINE inline void
+trace_queue_wait(std::coroutine_handle<> h,
+                 const trace_stamp&      enqueued) noexcept {
+    if constexpr (tracing_enabled) {
+        std::uint64_t now  = trace_now();
+        std::uint64_t wait = enqueued.elapsed(now);
+        trace_histograms::global().queue_latency.record(wait);
+        trace_buffer::local().push(
+            trace_event{now, wait, h.address(), trace_kind::queue_wait});
+    }
+}
+
+// A task that was first awaited at 'started' has completed.
+FORCE_INLINE inline void trace_task_done(const trace_stamp& started) noexcept {
+    if constexpr (tracing_enabled) {
+        trace_histograms::global().task_duration.record(
+            started.elapsed(trace_now()));
+    }
+}
+
+#endif
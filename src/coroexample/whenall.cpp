@@ -0,0 +1,2 @@
+// coroexample_whenall.cpp                                            -*-C++-*-
+#include <coroexample/whenall.h>
@@ -0,0 +1,431 @@
+// coroexample_whenall.h                                              -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_WHENALL
+#define INCLUDED_COROEXAMPLE_WHENALL
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <limits>
+#include <optional>
+#include <ranges>
+#include <stop_token>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <coroexample/cancellation.h>
+#include <coroexample/frameallocator.h>
+#include <coroexample/generalhelper.h>
+#include <coroexample/helper.h>
+#include <coroexample/inlinetask.h>
+
+///////////////////////////////////////////////////
+// when_all() / when_any()
+//
+// Run several awaitables concurrently and wait for them as a group:
+//
+//   auto [a, b] = co_await when_all(fetch(shard0), fetch(shard1));
+//   std::vector<int> rs = co_await when_all(std::move(tasks));
+//
+//   auto first = co_await when_any(std::move(tasks));
+//   use(first.index, first.value);
+//
+// Each awaitable is wrapped in a small child coroutine which is started
+// when the result of when_all() is awaited. The children share a single
+// atomic countdown, which like async_scope's ref_count holds one extra
+// reference for the awaiting coroutine while it is still starting the
+// children; whichever of them drops the count to zero resumes the awaiting
+// coroutine, and if every child completed synchronously the awaiting
+// coroutine is never suspended at all.
+//
+// Child results are stored inline in the child coroutine's promise, and
+// the children themselves are held in a tuple (variadic form) or a single
+// vector (range form) inside the awaiter, so the fan-out costs one child
+// frame per awaitable - taken from the frame pool - plus, for the range
+// form, the vector. Compared with spawn_detached() there is no separate
+// detached_task frame per child and no join step.
+//
+// when_all() resumes with a std::tuple (variadic form) or std::vector
+// (range form) of the results; void results become std::monostate in the
+// tuple, and the range form of a void awaitable returns void. If any child
+// throws, the exception of the first such child (by position) is rethrown
+// once all children have completed.
+//
+// when_any() resumes with the result of the child that completed first:
+// a std::variant whose index() is the winner's position (variadic form)
+// or a `when_any_result` holding the index and value (range form). If the
+// winner threw, its exception is rethrown. Like when_all(), when_any()
+// waits for the remaining children to complete before resuming, so it
+// never leaves work running that refers to the awaiting coroutine's
+// state; to make that prompt, it gives the children their own stop token
+// and requests stop on it as soon as there is a winner.
+//
+// when_all() children inherit the awaiting coroutine's stop token. The
+// when_any() token is also stopped when the awaiting coroutine's is.
+
+template <typename T>
+struct when_any_result {
+    std::size_t index;
+    T           value;
+};
+
+template <>
+struct when_any_result<void> {
+    std::size_t index;
+};
+
+template <typename R>
+using _when_all_value_t =
+    std::conditional_t<std::is_void_v<R>, std::monostate, std::decay_t<R>>;
+
+struct _when_all_counter {
+    std::atomic<std::size_t> count{0};
+    std::coroutine_handle<>  continuation;
+
+    _when_all_counter() noexcept = default;
+
+    // Only moved before it is started.
+    _when_all_counter(_when_all_counter&&) noexcept {}
+
+    // One reference per child, plus one for the awaiting coroutine.
+    void start(std::size_t children, std::coroutine_handle<> h) noexcept {
+        count.store(children + 1, std::memory_order_relaxed);
+        continuation = h;
+    }
+
+    // Returns true if this was the last reference.
+    bool arrive() noexcept {
+        return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    bool notify_child_finished(std::size_t) noexcept { return arrive(); }
+
+    const std::stop_token*
+    child_stop_token(const std::stop_token* parent) noexcept {
+        return parent;
+    }
+};
+
+struct _when_any_counter : _when_all_counter {
+    static constexpr std::size_t no_winner =
+        std::numeric_limits<std::size_t>::max();
+
+    struct stop_forwarder {
+        std::stop_source* source;
+        void              operator()() noexcept { source->request_stop(); }
+    };
+
+    std::atomic<std::size_t>                          winner{no_winner};
+    std::stop_source                                  source;
+    std::stop_token                                   token;
+    std::optional<std::stop_callback<stop_forwarder>> parent_stop;
+
+    _when_any_counter() : token(source.get_token()) {}
+    _when_any_counter(_when_any_counter&& other) noexcept
+        : _when_all_counter(std::move(other)),
+          source(std::move(other.source)),
+          token(source.get_token()) {}
+
+    bool notify_child_finished(std::size_t index) noexcept {
+        // The fetch_sub in arrive() publishes the winner to whoever
+        // resumes the awaiting coroutine.
+        std::size_t none = no_winner;
+        if (winner.compare_exchange_strong(
+                none, index, std::memory_order_relaxed)) {
+            // Cancel the losers.
+            source.request_stop();
+        }
+        return arrive();
+    }
+
+    const std::stop_token*
+    child_stop_token(const std::stop_token* parent) noexcept {
+        if (parent != nullptr && parent->stop_possible()) {
+            parent_stop.emplace(*parent, stop_forwarder{&source});
+        }
+        return &token;
+    }
+};
+
+template <typename R, typename Counter>
+struct _when_all_task {
+    struct promise_type : frame_allocating_promise,
+                          stop_token_promise,
+                          inline_task_result<std::decay_t<R>> {
+        Counter*    counter;
+        std::size_t index;
+
+        _when_all_task get_return_object() noexcept {
+            return _when_all_task{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                promise_type& p = h.promise();
+                if (p.counter->notify_child_finished(p.index)) {
+                    return p.counter->continuation;
+                }
+                return std::noop_coroutine();
+            }
+            [[noreturn]] void await_resume() noexcept { std::terminate(); }
+        };
+
+        final_awaiter final_suspend() noexcept { return {}; }
+    };
+
+    using handle_t = std::coroutine_handle<promise_type>;
+    handle_t coro;
+
+    explicit _when_all_task(handle_t h) noexcept : coro(h) {}
+    _when_all_task(_when_all_task&& other) noexcept
+        : coro(std::exchange(other.coro, {})) {}
+    ~_when_all_task() {
+        if (coro)
+            coro.destroy();
+    }
+
+    void start(Counter&               counter,
+               std::size_t            index,
+               const std::stop_token* stop) noexcept {
+        coro.promise().counter = &counter;
+        coro.promise().index   = index;
+        coro.promise().stop    = stop;
+        coro.resume();
+    }
+
+    bool failed() const noexcept {
+        return static_cast<bool>(coro.promise().exception);
+    }
+
+    void rethrow_if_failed() {
+        if (failed()) [[unlikely]] {
+            std::rethrow_exception(coro.promise().exception);
+        }
+    }
+
+    _when_all_value_t<R> take() {
+        if constexpr (std::is_void_v<R>) {
+            coro.promise().get();
+            return {};
+        } else {
+            return coro.promise().get();
+        }
+    }
+};
+
+template <typename Counter, typename A>
+_when_all_task<await_result_t<A>, Counter> _make_when_all_task(A a) {
+    if constexpr (std::is_void_v<await_result_t<A>>) {
+        co_await std::move(a);
+    } else {
+        co_return co_await std::move(a);
+    }
+}
+
+// Holds the children and starts them; the awaiters below add
+// await_resume().
+template <typename Counter, typename Children>
+struct _when_all_awaiter_base {
+    Children children;
+    Counter  counter;
+
+    bool await_ready() noexcept { return size() == 0; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        counter.start(size(), h);
+        const std::stop_token* stop =
+            counter.child_stop_token(get_stop_token(h));
+        if constexpr (requires { children.size(); }) {
+            for (std::size_t i = 0; i < children.size(); ++i) {
+                children[i].start(counter, i, stop);
+            }
+        } else {
+            std::apply(
+                [&](auto&... child) {
+                    std::size_t i = 0;
+                    (child.start(counter, i++, stop), ...);
+                },
+                children);
+        }
+        // Drop the awaiting coroutine's reference; if that was the last one
+        // every child has already finished and we carry on without
+        // suspending. 'this' must not be touched after a false return.
+        return !counter.arrive();
+    }
+
+    std::size_t size() const noexcept {
+        if constexpr (requires { children.size(); }) {
+            return children.size();
+        } else {
+            return std::tuple_size_v<Children>;
+        }
+    }
+};
+
+template <typename Counter, typename... Rs>
+using _when_all_tuple_t = std::tuple<_when_all_task<Rs, Counter>...>;
+
+template <typename Counter, typename R>
+using _when_all_vector_t = std::vector<_when_all_task<R, Counter>>;
+
+template <typename... Rs>
+struct [[nodiscard]] _when_all_awaiter
+    : _when_all_awaiter_base<_when_all_counter,
+                             _when_all_tuple_t<_when_all_counter, Rs...>> {
+    std::tuple<_when_all_value_t<Rs>...> await_resume() {
+        return std::apply(
+            [](auto&... child) {
+                (child.rethrow_if_failed(), ...);
+                return std::tuple<_when_all_value_t<Rs>...>{child.take()...};
+            },
+            this->children);
+    }
+};
+
+template <typename R>
+struct [[nodiscard]] _when_all_range_awaiter
+    : _when_all_awaiter_base<_when_all_counter,
+                             _when_all_vector_t<_when_all_counter, R>> {
+    auto await_resume() {
+        for (auto& child : this->children) {
+            child.rethrow_if_failed();
+        }
+        if constexpr (!std::is_void_v<R>) {
+            std::vector<std::decay_t<R>> results;
+            results.reserve(this->children.size());
+            for (auto& child : this->children) {
+                results.push_back(child.take());
+            }
+            return results;
+        }
+    }
+};
+
+template <typename... Rs>
+struct [[nodiscard]] _when_any_awaiter
+    : _when_all_awaiter_base<_when_any_counter,
+                             _when_all_tuple_t<_when_any_counter, Rs...>> {
+    using result_type = std::variant<_when_all_value_t<Rs>...>;
+
+    bool await_ready() noexcept { return false; }
+
+    result_type await_resume() {
+        return take_winner(
+            this->counter.winner.load(std::memory_order_relaxed));
+    }
+
+  private:
+    template <std::size_t I = 0>
+    result_type take_winner(std::size_t winner) {
+        if constexpr (I + 1 < sizeof...(Rs)) {
+            if (winner != I) {
+                return take_winner<I + 1>(winner);
+            }
+        }
+        return result_type{std::in_place_index<I>,
+                           std::get<I>(this->children).take()};
+    }
+};
+
+template <typename R>
+struct [[nodiscard]] _when_any_range_awaiter
+    : _when_all_awaiter_base<_when_any_counter,
+                             _when_all_vector_t<_when_any_counter, R>> {
+    bool await_ready() noexcept { return false; }
+
+    when_any_result<std::decay_t<R>> await_resume() {
+        std::size_t winner =
+            this->counter.winner.load(std::memory_order_relaxed);
+        if constexpr (std::is_void_v<R>) {
+            this->children[winner].take();
+            return {winner};
+        } else {
+            return {winner, this->children[winner].take()};
+        }
+    }
+};
+
+// Elements of an rvalue range are moved into the children, so that a
+// vector of move-only tasks can be passed with std::move().
+template <typename Range>
+using _range_element_t =
+    std::conditional_t<std::is_lvalue_reference_v<Range>,
+                       std::ranges::range_reference_t<Range>,
+                       std::ranges::range_rvalue_reference_t<Range>>;
+
+template <typename Range>
+concept _awaitable_range =
+    std::ranges::input_range<Range> && !awaitable<Range> &&
+    decay_copyable<_range_element_t<Range>> &&
+    awaitable<std::decay_t<_range_element_t<Range>>>;
+
+template <typename Range>
+using _range_result_t =
+    await_result_t<std::decay_t<_range_element_t<Range>>>;
+
+template <typename Counter, typename Range>
+auto _make_when_all_tasks(Range&& awaitables) {
+    using element_t = _range_element_t<Range>;
+
+    _when_all_vector_t<Counter, _range_result_t<Range>> children;
+    if constexpr (std::ranges::sized_range<Range>) {
+        children.reserve(std::ranges::size(awaitables));
+    }
+    for (auto&& a : awaitables) {
+        children.push_back(
+            _make_when_all_task<Counter, std::decay_t<element_t>>(
+                static_cast<element_t>(a)));
+    }
+    return children;
+}
+
+template <typename... As>
+requires((decay_copyable<As> && awaitable<std::decay_t<As>>) && ...)
+auto when_all(As&&... awaitables) {
+    return _when_all_awaiter<await_result_t<std::decay_t<As>>...>{
+        {{_make_when_all_task<_when_all_counter, std::decay_t<As>>(
+             std::forward<As>(awaitables))...},
+         {}}};
+}
+
+template <typename Range>
+requires _awaitable_range<Range>
+auto when_all(Range&& awaitables) {
+    return _when_all_range_awaiter<_range_result_t<Range>>{
+        {_make_when_all_tasks<_when_all_counter>(
+             std::forward<Range>(awaitables)),
+         {}}};
+}
+
+template <typename... As>
+requires(sizeof...(As) > 0) &&
+        ((decay_copyable<As> && awaitable<std::decay_t<As>>) && ...)
+auto when_any(As&&... awaitables) {
+    return _when_any_awaiter<await_result_t<std::decay_t<As>>...>{
+        {{_make_when_all_task<_when_any_counter, std::decay_t<As>>(
+             std::forward<As>(awaitables))...},
+         {}}};
+}
+
+// The range must not be empty.
+template <typename Range>
+requires _awaitable_range<Range>
+auto when_any(Range&& awaitables) {
+    _when_any_range_awaiter<_range_result_t<Range>> result{
+        {_make_when_all_tasks<_when_any_counter>(
+             std::forward<Range>(awaitables)),
+         {}}};
+    assert(!result.children.empty());
+    return result;
+}
+
+#endif
@@ -0,0 +1,2 @@
+// coroexample_workstealingscheduler.cpp                              -*-C++-*-
+#include <coroexample/workstealingscheduler.h>
@@ -0,0 +1,291 @@
+// coroexample_workstealingscheduler.h                                -*-C++-*-
+#ifndef INCLUDED_COROEXAMPLE_WORKSTEALINGSCHEDULER
+#define INCLUDED_COROEXAMPLE_WORKSTEALINGSCHEDULER
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stop_token>
+#include <utility>
+
+#include <coroexample/currentscheduler.h>
+
+/////////////////////////////////////////////////
+// work_stealing_scheduler
+//
+// A multi-threaded scheduler with the same `co_await sched.schedule()`
+// interface as `manual_event_loop`, but without a single lock that every
+// schedule() and every resumption has to go through.
+//
+// The scheduler is constructed with a fixed number of worker slots and each
+// thread calling `run()` claims one of them. Every worker owns a bounded
+// local queue that only it pushes onto; the owner and any idle workers
+// take items from the front of that queue with a CAS, so an idle worker
+// can steal from a busy one without taking any lock.
+//
+// Coroutines scheduled from a thread that is not one of this scheduler's
+// workers (or scheduled when the local queue is full) go onto a shared
+// mutex-protected injection queue, which workers only look at when their
+// own queue is empty.
+//
+// As with `manual_event_loop`, the queue node is stored inside the
+// schedule awaitable, so scheduling never allocates.
+//
+// Idle workers park on an atomic epoch counter and producers only touch it
+// when at least one worker is actually parked.
+
+struct work_stealing_scheduler {
+  private:
+    struct queue_item {
+        queue_item*             next;
+        std::coroutine_handle<> coro;
+    };
+
+    static constexpr std::size_t cache_line = 64;
+
+    // Bounded single-producer/multi-consumer ring.
+    //
+    // Only the owning worker pushes (at 'bottom'), but both the owner and
+    // thieves pop from 'top' via compare-exchange. Taking from the same end
+    // as thieves keeps the owner FIFO, so a coroutine that repeatedly
+    // re-schedules itself cannot starve the rest of the queue.
+    struct alignas(cache_line) local_queue {
+        static constexpr std::uint32_t capacity = 256;
+        static constexpr std::uint32_t mask     = capacity - 1;
+
+        alignas(cache_line) std::atomic<std::uint32_t> top{0};
+        alignas(cache_line) std::atomic<std::uint32_t> bottom{0};
+        std::array<std::atomic<queue_item*>, capacity> slots{};
+
+        // Owner thread only. Returns false if the queue is full.
+        bool push(queue_item* item) noexcept {
+            std::uint32_t b = bottom.load(std::memory_order_relaxed);
+            std::uint32_t t = top.load(std::memory_order_acquire);
+            if (b - t >= capacity) {
+                return false;
+            }
+            slots[b & mask].store(item, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Any thread.
+        queue_item* pop() noexcept {
+            std::uint32_t t = top.load(std::memory_order_acquire);
+            while (true) {
+                std::uint32_t b = bottom.load(std::memory_order_acquire);
+                if (static_cast<std::int32_t>(b - t) <= 0) {
+                    return nullptr;
+                }
+                // The slot may be overwritten by the owner once 'top' moves
+                // past 't', but then the CAS below fails and the stale value
+                // is discarded.
+                queue_item* item = slots[t & mask].load(
+                    std::memory_order_relaxed);
+                if (top.compare_exchange_weak(t,
+                                              t + 1,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire)) {
+                    return item;
+                }
+            }
+        }
+
+        bool empty() const noexcept {
+            return bottom.load(std::memory_order_acquire) ==
+                   top.load(std::memory_order_acquire);
+        }
+    };
+
+    struct worker {
+        local_queue queue;
+    };
+
+    struct inject_queue {
+        std::mutex        mut;
+        queue_item*       head{nullptr};
+        queue_item*       tail{nullptr};
+        std::atomic<bool> non_empty{false};
+
+        void push(queue_item* item) noexcept {
+            std::lock_guard lock{mut};
+            item->next = nullptr;
+            if (head == nullptr) {
+                head = item;
+            } else {
+                tail->next = item;
+            }
+            tail = item;
+            non_empty.store(true, std::memory_order_release);
+        }
+
+        queue_item* pop() noexcept {
+            if (!non_empty.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            std::lock_guard lock{mut};
+            queue_item*     front = head;
+            if (front != nullptr) {
+                head = front->next;
+                if (head == nullptr) {
+                    tail = nullptr;
+                    non_empty.store(false, std::memory_order_relaxed);
+                }
+            }
+            return front;
+        }
+    };
+
+    std::size_t               worker_count;
+    std::unique_ptr<worker[]> workers;
+    std::atomic<std::size_t>  next_worker{0};
+    inject_queue              injected;
+
+    alignas(cache_line) std::atomic<std::size_t> sleepers{0};
+    alignas(cache_line) std::atomic<std::uint32_t> wake_epoch{0};
+
+    // Zero-initialised, as a thread_local, so threads that never call run()
+    // are not workers of any scheduler.
+    struct thread_state {
+        work_stealing_scheduler* sched;
+        std::size_t              index;
+    };
+
+    static inline thread_local thread_state current;
+
+    worker* current_worker() noexcept {
+        return current.sched == this ? &workers[current.index] : nullptr;
+    }
+
+    void wake_one() noexcept {
+        // Pairs with the fence in park(): either this load sees the parking
+        // worker, or that worker sees the item we have just published.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) != 0) {
+            wake_epoch.fetch_add(1, std::memory_order_release);
+            wake_epoch.notify_one();
+        }
+    }
+
+    void wake_all() noexcept {
+        wake_epoch.fetch_add(1, std::memory_order_release);
+        wake_epoch.notify_all();
+    }
+
+    void enqueue(queue_item* item) noexcept {
+        worker* w = current_worker();
+        if (w == nullptr || !w->queue.push(item)) {
+            injected.push(item);
+        }
+        wake_one();
+    }
+
+    queue_item* steal(std::size_t self) noexcept {
+        for (std::size_t i = 1; i < worker_count; ++i) {
+            std::size_t victim = (self + i) % worker_count;
+            if (queue_item* item = workers[victim].queue.pop()) {
+                return item;
+            }
+        }
+        return nullptr;
+    }
+
+    queue_item* find_work(std::size_t self) noexcept {
+        if (queue_item* item = workers[self].queue.pop()) {
+            return item;
+        }
+        if (queue_item* item = injected.pop()) {
+            return item;
+        }
+        return steal(self);
+    }
+
+    bool has_work() noexcept {
+        if (injected.non_empty.load(std::memory_order_acquire)) {
+            return true;
+        }
+        for (std::size_t i = 0; i < worker_count; ++i) {
+            if (!workers[i].queue.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void park(std::stop_token& st) noexcept {
+        std::uint32_t epoch = wake_epoch.load(std::memory_order_acquire);
+        sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work() && !st.stop_requested()) {
+            wake_epoch.wait(epoch, std::memory_order_acquire);
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    struct schedule_awaitable {
+        using scheduler_type = work_stealing_scheduler;
+
+        work_stealing_scheduler* sched;
+        queue_item               item;
+
+        explicit schedule_awaitable(work_stealing_scheduler& sched) noexcept
+            : sched(&sched) {}
+
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> coro) noexcept {
+            item.coro = coro;
+            sched->enqueue(&item);
+        }
+        void await_resume() noexcept {}
+    };
+
+  public:
+    explicit work_stealing_scheduler(std::size_t worker_count)
+        : worker_count(worker_count),
+          workers(std::make_unique<worker[]>(worker_count)) {
+        assert(worker_count > 0);
+    }
+
+    work_stealing_scheduler(const work_stealing_scheduler&) = delete;
+    work_stealing_scheduler& operator=(const work_stealing_scheduler&) = delete;
+
+    std::size_t size() const noexcept { return worker_count; }
+
+    schedule_awaitable schedule() noexcept {
+        return schedule_awaitable{*this};
+    }
+
+    // Run the calling thread as one of the scheduler's workers until 'st'
+    // is signalled. Each call claims a new worker slot, so run() may be
+    // called at most `size()` times over the scheduler's lifetime; further
+    // calls throw std::logic_error.
+    void run(std::stop_token st) {
+        std::size_t self = next_worker.fetch_add(1, std::memory_order_relaxed);
+        if (self >= worker_count) {
+            throw std::logic_error(
+                "work_stealing_scheduler::run: no worker slots left");
+        }
+
+        thread_state saved = std::exchange(current, thread_state{this, self});
+        current_scheduler_scope on_scheduler{*this};
+        std::stop_callback cb{st, [&]() noexcept { wake_all(); }};
+
+        while (!st.stop_requested()) {
+            if (queue_item* item = find_work(self)) {
+                item->coro.resume();
+            } else {
+                park(st);
+            }
+        }
+
+        current = saved;
+    }
+};
+
+#endif
@@ -1,15 +1,19 @@
 #include <coroexample/coroexample.h>
 
-static task<int> f(int i) {
+#include <iostream>
+
+static task<int> f(int i, manual_event_loop& loop) {
     using namespace std::chrono_literals;
-    std::this_thread::sleep_for(1ms);
+    co_await loop.schedule_after(1ms);
 
     co_return i;
 }
 
-static task<int> g(int i, manual_event_loop& loop) {
+// An affine_task stays on 'loop' after the hop: were f() to complete on
+// another thread, g() would still carry on on one of the loop's threads.
+static affine_task<int> g(int i, manual_event_loop& loop) {
     co_await loop.schedule();
-    int x = co_await f(i);
+    int x = co_await f(i, loop);
     co_return x + 1;
 }
 
@@ -20,21 +24,31 @@ static task<void> h(int i, manual_event_loop& loop) {
         "[%u] %i -> %i (on %i)\n", (unsigned int)ts, i, x, (int)::gettid());
 }
 
+// Each nested group of tasks is a nursery, which accounts for its children
+// and cancels any still running a second after the join starts.
 static task<void> nested_scopes(int x, manual_event_loop& loop) {
+    using namespace std::chrono_literals;
     co_await loop.schedule();
 
-    async_scope scope;
+    nursery children;
     try {
         for (int i = 0; i < 10; ++i) {
-            scope.spawn_detached(h(i, loop));
+            children.spawn_detached(h(i, loop));
         }
     } catch (...) {
         std::printf("failure!\n");
     }
 
-    co_await scope.join_async();
+    bool          in_time = co_await children.join_async_for(loop, 1s);
+    nursery_stats s       = children.stats();
 
-    std::printf("nested %i done\n", x);
+    std::printf("nested %i done%s: %llu tasks, at most %zu live, "
+                "longest %lldus\n",
+                x,
+                in_time ? "" : " (cut off)",
+                static_cast<unsigned long long>(s.completed),
+                s.peak_live,
+                static_cast<long long>(s.longest_child.count() / 1000));
     std::fflush(stdout);
 }
 
@@ -69,5 +83,9 @@ int main() {
         }
     }
 
+    if (frame_stats_enabled) {
+        print_frame_sizes(std::cout);
+    }
+
     return 0;
 }